@@ -15,6 +15,9 @@
 #define CMD_KILL		10
 #define CMD_RESUME		11
 
+/* --dumpfile value to stream a dump to stdout or from stdin */
+#define DUMPFILE_STDIO		"-"
+
 int cpt_cmd(vps_handler *h, envid_t veid, const char *root,
 		int action, int cmd, unsigned int ctx);
 int vps_chkpnt(vps_handler *h, envid_t veid, const fs_param *fs,
@@ -22,5 +25,6 @@ int vps_chkpnt(vps_handler *h, envid_t veid, const fs_param *fs,
 int vps_restore(vps_handler *h, envid_t veid, struct vps_param *vps_p, int cmd,
 	cpt_param *param, skipFlags skip);
 void clean_hardlink_dir(const char *mntdir);
+int is_stdio_dump(const char *dumpfile);
 
 #endif
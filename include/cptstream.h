@@ -0,0 +1,124 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef	_CPTSTREAM_H_
+#define	_CPTSTREAM_H_
+
+#include <stdint.h>
+
+/* Streamed dump format. The kernel writes (reads) a plain dump to (from)
+ * a pipe, and vzctl compresses (decompresses) it on several threads.
+ *
+ * A stream is a cpt_stream_hdr followed by blocks, each being
+ * a cpt_block_hdr and up to block_size bytes of (compressed) data.
+ * The last block has len == 0 and carries the total number of raw
+ * bytes as a 64-bit value, so that truncated dumps are detected.
+ *
+ * With deduplication, block data is cut into content-defined chunks.
+ * Each chunk is kept in a file named by its hash and length, in a
+ * per-dump chunk directory (<dumpfile>.chunks), and the block stores
+ * a list of cpt_chunk_ref instead of data. Chunk files are hard links
+ * to a shared store in the dump directory (Dump.chunks/xx/), so equal
+ * chunks of different dumps take disk space once. The number of links
+ * to a store file is its reference count.
+ */
+#define CPT_STREAM_MAGIC	"VZCPTZ01"
+#define CPT_STREAM_BLOCK	(1024 * 1024)
+/* Fastest zlib level; the point is to not be bound by the dump disk */
+#define CPT_STREAM_LEVEL	1
+
+#define CPT_BLOCK_ZLIB		0x1
+#define CPT_BLOCK_CHUNKS	0x2	/* data is a list of cpt_chunk_ref */
+
+#define CPT_STREAM_CHUNKS	0x1	/* stream uses a chunk directory */
+
+#define CPT_CHUNK_STORE		"Dump.chunks"
+#define CPT_CHUNK_SUFFIX	".chunks"
+
+struct cpt_stream_hdr {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t flags;
+};
+
+struct cpt_block_hdr {
+	uint32_t len;		/* raw data length */
+	uint32_t clen;		/* stored data length */
+	uint32_t crc;		/* crc32 of raw data */
+	uint32_t flags;		/* CPT_BLOCK_* */
+};
+
+/* A chunk file is a cpt_block_hdr followed by (compressed) chunk data */
+struct cpt_chunk_ref {
+	uint64_t hash;
+	uint32_t len;
+	uint32_t pad;
+};
+
+struct cpt_stream;
+
+/** Start a dump or restore stream.
+ *
+ * @param dump		1 to compress a dump into fd,
+ *			0 to decompress a dump from fd.
+ * @param fd		dump file descriptor.
+ * @param level		compression level (1-9, or 0 to only add
+ *			checksums), for dump only.
+ * @param chunks	dump file name to deduplicate a dump against
+ *			the chunk store, or to find the chunks of
+ *			a deduplicated dump on restore; NULL if none.
+ * @param pipe_fd	returns the pipe end to pass to the kernel with
+ *			CPT_SET_DUMPFD. It is to be closed by the caller.
+ * @return		stream, or NULL on error.
+ */
+struct cpt_stream *cpt_stream_open(int dump, int fd, int level,
+		const char *chunks, int *pipe_fd);
+
+/** Wait for a stream to complete and free it.
+ * Must be called once the kernel is done with the pipe. Unless aborted,
+ * a dump is complete (trailer included) and a restored dump is read and
+ * verified up to its trailer on return.
+ *
+ * @param s		stream.
+ * @param abort		do not wait for the remaining data.
+ * @return		0 on success, -1 if the stream is broken.
+ */
+int cpt_stream_close(struct cpt_stream *s, int abort);
+
+/** Close the stream pipe end in a forked child, so that the kernel
+ * gets EPIPE rather than blocks if the stream is aborted.
+ *
+ * @param s		stream.
+ */
+void cpt_stream_close_fds(struct cpt_stream *s);
+
+/** Check if a dump file is a compressed stream.
+ *
+ * @param fd		dump file descriptor.
+ * @return		1 if it is, 0 otherwise.
+ */
+int is_cpt_stream(int fd);
+
+/** Remove the chunk directory of a deduplicated dump, along with
+ * the store chunks no other dump refers to.
+ *
+ * @param dumpfile	dump file name.
+ * @return		0 on success (or if there are no chunks).
+ */
+int cpt_chunks_remove(const char *dumpfile);
+
+#endif /* _CPTSTREAM_H_ */
@@ -0,0 +1,83 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef	_DIRSNAP_H_
+#define	_DIRSNAP_H_
+
+#include <sys/types.h>
+
+/* Directory tree snapshot: attributes (not data) of every file in a tree,
+ * used to find out what was changed in the tree since the snapshot.
+ * Both snapshot and diff stat the tree on several threads.
+ *
+ * The snapshot is to be taken before the tree is copied, so that
+ * any change made while copying shows up in the diff.
+ */
+
+/* dir_change types */
+enum {
+	DS_FILE,	/* changed or new non-directory */
+	DS_HLINK,	/* same, with more than one hard link */
+	DS_DIR,		/* changed or new directory, or a parent of a change */
+	DS_DELETED,	/* no longer exists */
+};
+
+struct dir_change {
+	char *path;		/* relative to tree root */
+	off_t size;
+	int type;		/* DS_* */
+};
+
+/* Changes, sorted by path (so parents go before children) */
+struct dir_delta {
+	struct dir_change *ch;
+	int n;
+	int nfiles;		/* DS_FILE + DS_HLINK */
+	int ndirs;
+	int ndeleted;
+	unsigned long long bytes;	/* total size of files */
+};
+
+struct dir_snap;
+
+/** Take a snapshot of a directory tree.
+ *
+ * @param root		tree root.
+ * @param nthreads	number of threads to stat files on.
+ * @return		snapshot, or NULL on error.
+ */
+struct dir_snap *dir_snap_take(const char *root, int nthreads);
+
+/** Find changes in a tree since the snapshot.
+ *
+ * @param s		snapshot.
+ * @param root		tree root, the same as for the snapshot.
+ * @param nthreads	number of threads to stat files on.
+ * @param d		filled with changes, to be freed with
+ *			dir_delta_free().
+ * @return		0 on success.
+ */
+int dir_snap_diff(struct dir_snap *s, const char *root, int nthreads,
+		struct dir_delta *d);
+
+/** Number of entries in the snapshot. */
+int dir_snap_size(struct dir_snap *s);
+
+void dir_snap_free(struct dir_snap *s);
+void dir_delta_free(struct dir_delta *d);
+
+#endif /* _DIRSNAP_H_ */
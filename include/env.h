@@ -62,6 +62,17 @@ void vz_close(vps_handler *h);
  */
 int vps_is_run(vps_handler *h, envid_t veid);
 
+/** Parse a list of containers, as given to exec-many or snapshot-many.
+ *
+ * @param h		CT handler.
+ * @param str		comma-separated CT IDs or names, or "all" for
+ *			all running containers; modified by the call.
+ * @param list		array to add CT IDs to, to be freed by caller.
+ * @param size		number of CT IDs in the array.
+ * @return		0 on success.
+ */
+int parse_ve_list(vps_handler *h, char *str, envid_t **list, int *size);
+
 /** Start CT.
  *
  * @param h		CT handler.
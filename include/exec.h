@@ -31,6 +31,7 @@ enum {
 };
 
 int execvep(const char *path, char *const argv[], char *const envp[]);
+int stdredir(int rdfd, int wrfd);
 
 /** Execute command inside CT.
  *
@@ -68,6 +69,30 @@ int vps_execFn(vps_handler *h, envid_t veid, const char *root,
 
 int env_wait(int pid);
 
+/** Execute command inside CT via its exec agent.
+ *
+ * @param veid		CT ID.
+ * @param exec_mode	execution mode (MODE_EXEC, MODE_BASH).
+ * @param argv		argv array.
+ * @param envp		command environment array.
+ * @param std_in	read command from buffer stdin point to.
+ * @param timeout	execution timeout, 0 - unlimited.
+ * @return		command exit status, or -1 if agent is not used.
+ */
+int vps_exec_agent_run(envid_t veid, int exec_mode, char *argv[],
+	char *const envp[], char *std_in, int timeout);
+void vps_exec_agent_enable(int enable);
+int vps_exec_agent_start(vps_handler *h, envid_t veid, const char *root);
+int vps_exec_agent_stop(envid_t veid);
+int vps_exec_agent_status(envid_t veid);
+
+void vps_exec_batch_begin(void);
+int vps_exec_batch_nonfatal(int nonfatal);
+int vps_exec_batch_active(void);
+int vps_exec_batch_run(vps_handler *h, envid_t veid, const char *root,
+	int *failed);
+void vps_exec_batch_end(void);
+
 struct vps_param;
 int vps_run_script(vps_handler *h, envid_t veid, char *script,
 	struct vps_param *vps_p);
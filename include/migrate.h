@@ -0,0 +1,141 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef	_MIGRATE_H_
+#define	_MIGRATE_H_
+
+#include <time.h>
+#include <sys/types.h>
+#include "types.h"
+
+/* Migration engine: moves container data and state to another node,
+ * overlapping the stages where possible. It is used by vzmigrate after
+ * the destination is prepared (config copied, quota initialized).
+ */
+
+/* Error codes, same as vzmigrate exit codes */
+#define MIG_ERR_COPY		6
+#define MIG_ERR_START_VPS	7
+#define MIG_ERR_STOP_SOURCE	8
+#define MIG_ERR_QUOTA		13
+
+#define MIG_MAX_ARGS		64
+#define MIG_MAX_SYNC_JOBS	16
+
+/* Container state on source */
+enum {
+	MIG_STOPPED,
+	MIG_MOUNTED,
+	MIG_RUNNING,
+};
+
+/* Command line being built */
+struct mig_cmd {
+	char *argv[MIG_MAX_ARGS + 1];
+	int argc;
+};
+
+/* mig_transport.exec() flags */
+#define MIG_EXEC_INPUT		0x1	/* fd is input only, command output
+					   goes to our stderr */
+
+/* Transport: a way to run commands on the destination node */
+struct mig_transport {
+	const char *name;
+	/** Run a command on the destination node.
+	 *
+	 * @param t		transport.
+	 * @param argv		command and arguments.
+	 * @param flags		MIG_EXEC_* flags.
+	 * @param fd		returns a socket connected to the command
+	 *			stdin and stdout.
+	 * @param pid		returns local process to wait for.
+	 * @return		0 on success.
+	 */
+	int (*exec)(struct mig_transport *t, char *argv[], int flags,
+			int *fd, pid_t *pid);
+	/** Add rsync arguments to copy src to the destination node dst. */
+	int (*rsync)(struct mig_transport *t, struct mig_cmd *cmd,
+			const char *src, const char *dst);
+	void (*destroy)(struct mig_transport *t);
+};
+
+/** Transport to run "remote" commands on the local node.
+ * Used for moving a container within a node, and for testing.
+ */
+struct mig_transport *mig_local_transport(void);
+
+/** Transport to run remote commands with ssh.
+ *
+ * @param host		destination host.
+ * @param ssh_opts	additional ssh options, may be NULL.
+ */
+struct mig_transport *mig_ssh_transport(const char *host,
+		const char *ssh_opts);
+
+/* Migration phases, timed separately */
+enum {
+	MIG_PH_SYNC,		/* first sync of private area */
+	MIG_PH_PCOPY,		/* ploop copy after CT suspend/stop */
+	MIG_PH_DUMP,		/* dump and copy (or undump) */
+	MIG_PH_SYNC2,		/* second sync of private area */
+	MIG_PH_QUOTA,		/* 2nd level quota */
+	MIG_PH_UNDUMP,		/* undump from a copied dump file */
+	MIG_PH_START,		/* resume (start, mount) on destination */
+	MIG_PH_MAX,
+};
+
+struct mig_times {
+	struct timespec phase[MIG_PH_MAX][2];	/* start, end */
+	struct timespec suspend;	/* CT suspended (stopped) */
+	struct timespec finish;		/* CT resumed (started) */
+};
+
+struct mig_param {
+	envid_t veid;
+	int online;		/* use checkpoint/restore */
+	int state;		/* MIG_STOPPED, ... */
+	const char *private;
+	const char *private_remote;
+	const char *ploop_dev;	/* ploop device name, NULL if not ploop */
+	const char *top_delta;	/* relative to private */
+	const char *dumpfile_remote;
+	const char *rsync_opts;
+	const char *suspend_opts;
+	const char *quota_cmd;	/* run after final sync, may be NULL */
+	const char *vzctl;	/* local vzctl command */
+	const char *vzctl_remote;
+	int sync_jobs;		/* parallel jobs for the second sync of
+				   a simfs private area, 0 to rsync it all */
+	int verbose;
+	struct mig_transport *t;
+};
+
+/** Migrate a container: sync its private area, stop or checkpoint it
+ * and start or restore it on the destination node.
+ * On failure the container is left in its original state on source.
+ *
+ * @param p		migration parameters.
+ * @param times		filled with phase timings, may be NULL.
+ * @return		0 on success or MIG_ERR_*.
+ */
+int vz_migrate(struct mig_param *p, struct mig_times *times);
+
+/** Print phase timings and CT downtime. */
+void mig_print_times(struct mig_times *times);
+
+#endif /* _MIGRATE_H_ */
@@ -0,0 +1,37 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef	_NDSEND_H_
+#define	_NDSEND_H_
+
+#include <netinet/in.h>
+
+/** Send unsolicited Neighbor Advertisements (RFC4861) announcing
+ * IPv6 addresses to all IPv6 nodes, for every address on every
+ * interface given. Packets are sent in batches with sendmmsg().
+ *
+ * @param addrs		IPv6 addresses to announce.
+ * @param naddrs	number of addresses.
+ * @param ifaces	names of network interfaces to send from.
+ * @param nifaces	number of interfaces.
+ * @return		0 on success, -1 if some advertisements
+ *			could not be sent.
+ */
+int vz_ndsend(const struct in6_addr *addrs, int naddrs,
+		const char *const *ifaces, int nifaces);
+
+#endif /* _NDSEND_H_ */
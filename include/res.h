@@ -82,6 +82,11 @@ typedef struct cpt_param {
 	unsigned int cpu_flags;
 	int cmd;
 	int rst_fd;
+	int compress;		/* compression level for a streamed dump */
+	int dumpfd;		/* stdout/stdin copy for "--dumpfile -" */
+	int pre_dump_iter;	/* number of CRIU memory pre-dumps */
+	int lazy;		/* restore memory on demand (CRIU only) */
+	int dedup;		/* YES to use the dump chunk store */
 } cpt_param;
 
 /** Data structure for CT resources.
@@ -132,6 +137,8 @@ typedef struct {
 	int skip_umount;
 	int skip_fsck;
 	int skip_remount;
+	int skip_wait;
+	int exec_agent;
 } vps_opt;
 
 struct log_s {
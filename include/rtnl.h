@@ -0,0 +1,131 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef	_RTNL_H_
+#define	_RTNL_H_
+
+#include <stddef.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/* Minimal rtnetlink client. Requests are queued into a single buffer
+ * and sent to the kernel in batches, so that programming hundreds of
+ * routes or neighbour entries costs a few syscalls instead of
+ * hundreds of ip(8) invocations.
+ */
+
+/* Max number of requests sent in one sendmsg(); bounded so that all
+ * the replies fit into the socket receive buffer.
+ */
+#define RTNL_BATCH_MAX		256
+
+struct rtnl_handle {
+	int fd;
+	unsigned int seq;	/* sequence number of the first queued request */
+	int nmsg;		/* number of queued requests */
+	size_t last;		/* offset of the last queued request */
+	size_t len;
+	size_t size;
+	char *buf;
+};
+
+/** Reply callback.
+ * Called for every reply message (nlh != NULL, err == 0) and for
+ * every request completion (nlh == NULL, err is 0 or errno).
+ *
+ * @param idx		request index in the batch (0 for dumps).
+ * @param err		errno returned by kernel for the request.
+ * @param nlh		reply message.
+ * @param data		user data.
+ * @return		0 to continue, nonzero value is returned by the caller.
+ */
+typedef int (*rtnl_reply_f)(int idx, int err, struct nlmsghdr *nlh,
+		void *data);
+
+int rtnl_open(struct rtnl_handle *rth);
+void rtnl_close(struct rtnl_handle *rth);
+
+/** Queue a request.
+ *
+ * @param rth		rtnetlink handle.
+ * @param type		message type (RTM_*).
+ * @param flags		NLM_F_* flags, NLM_F_REQUEST|NLM_F_ACK are implied.
+ * @param hdr		family specific header (rtmsg, ndmsg, ...).
+ * @param hdrlen	its size.
+ * @return		request index in the batch, -1 on error.
+ */
+int rtnl_add_msg(struct rtnl_handle *rth, int type, int flags,
+		const void *hdr, int hdrlen);
+
+/** Add an attribute to the last queued request (or to its innermost
+ * open nest). The request length is updated to cover it.
+ *
+ * @return		0 on success.
+ */
+int rtnl_add_attr(struct rtnl_handle *rth, int type, const void *data,
+		int len);
+
+/** Start a nested attribute in the last queued request. Attributes
+ * added until rtnl_nest_end() go inside it.
+ *
+ * @param rth		rtnetlink handle.
+ * @param type		attribute type.
+ * @param hdr		optional header preceding nested attributes
+ *			(e.g. ifinfomsg for VETH_INFO_PEER), may be NULL.
+ * @param hdrlen	its size.
+ * @return		nest offset to pass to rtnl_nest_end(), -1 on error.
+ */
+int rtnl_nest_start(struct rtnl_handle *rth, int type, const void *hdr,
+		int hdrlen);
+
+/** Finish a nested attribute started by rtnl_nest_start(). */
+void rtnl_nest_end(struct rtnl_handle *rth, int off);
+
+/** Send all queued requests and wait for their completion.
+ *
+ * @param rth		rtnetlink handle.
+ * @param cb		reply callback, may be NULL.
+ * @param data		callback data.
+ * @return		-1 on communication error, otherwise the first
+ *			nonzero value returned by cb, or 0.
+ */
+int rtnl_flush(struct rtnl_handle *rth, rtnl_reply_f cb, void *data);
+
+/** Dump kernel objects (links, addresses, routes...).
+ *
+ * @param rth		rtnetlink handle, with no requests queued.
+ * @param type		RTM_GET* message type.
+ * @param family	address family or AF_UNSPEC.
+ * @param cb		called for every object.
+ * @param data		callback data.
+ * @return		-1 on error, otherwise the first nonzero value
+ *			returned by cb, or 0.
+ */
+int rtnl_dump(struct rtnl_handle *rth, int type, int family,
+		rtnl_reply_f cb, void *data);
+
+/** Fill tb[] with pointers to attributes, indexed by type.
+ *
+ * @param tb		array of max + 1 elements.
+ * @param max		max attribute type of interest.
+ * @param rta		first attribute.
+ * @param len		length of attributes.
+ */
+void rtnl_parse_attr(struct rtattr *tb[], int max, struct rtattr *rta,
+		int len);
+
+#endif /* _RTNL_H_ */
@@ -19,6 +19,7 @@
 #define _SCRIPT_H_
 
 #include <sys/types.h>
+#include "types.h"
 
 /* Second-level quota */
 struct setup_env_quota_param {
@@ -32,6 +33,9 @@ int read_script(const char *fname, char *include, char **buf);
 int run_script(const char *f, char *argv[], char *envp[], int quiet);
 int run_pre_script(int veid, char *script);
 int add_reach_runlevel_mark();
-int wait_on_fifo(void *data);
+
+#define MAX_WAIT_TIMEOUT	60 * 60
+int vps_wait_started(vps_handler *h, const envid_t *veids,
+	const char *const *roots, int n, int timeout, int *ready);
 
 #endif /* _SCRIPT_H_ */
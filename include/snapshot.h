@@ -14,9 +14,13 @@ struct vzctl_snapshot_data {
 	char *desc;
 };
 
+struct vzctl_snapshot_index;
+
 struct vzctl_snapshot_tree {
 	struct vzctl_snapshot_data **snapshots;
 	int nsnapshots;
+	/* GUID hash and parent/child links, built on first lookup */
+	struct vzctl_snapshot_index *idx;
 };
 
 struct vzctl_snapshot_param;
@@ -28,6 +32,9 @@ struct vzctl_snapshot_param;
 #define GET_SNAPSHOT_XML_TMP(buf, ve_private) \
 	snprintf(buf, sizeof(buf), "%s/" SNAPSHOT_XML ".tmp", ve_private);
 
+/* Binary copy of the parsed Snapshots.xml, next to it */
+#define SNAPSHOT_CACHE	SNAPSHOT_XML ".cache"
+
 /* src/lib/snapshot.c */
 void vzctl_free_snapshot_tree(struct vzctl_snapshot_tree *tree);
 struct vzctl_snapshot_tree *vzctl_alloc_snapshot_tree(void);
@@ -39,6 +46,13 @@ int vzctl_add_snapshot(struct vzctl_snapshot_tree *tree, const char *guid,
 		const struct vzctl_snapshot_param *param);
 void vzctl_snapshot_tree_set_current(struct vzctl_snapshot_tree *tree, const char *guid);
 int vzctl_find_snapshot_by_guid(struct vzctl_snapshot_tree *tree, const char *guid);
+/* Tree navigation by snapshot number; -1 means none, or the base
+ * (the parent of snapshots with an empty parent_guid).
+ * Children are returned in the snapshots[] order.
+ */
+int vzctl_snapshot_parent(struct vzctl_snapshot_tree *tree, int id);
+int vzctl_snapshot_first_child(struct vzctl_snapshot_tree *tree, int id);
+int vzctl_snapshot_next_sibling(struct vzctl_snapshot_tree *tree, int id);
 
 /* src/lib/xml.c */
 int vzctl_read_snapshot_tree(const char *fname, struct vzctl_snapshot_tree *tree);
@@ -49,6 +63,22 @@ int is_snapshot_supported(const fs_param *fs);
 int vzctl_env_create_snapshot(vps_handler *h, envid_t veid, const fs_param *fs,
 		const struct vzctl_snapshot_param *param);
 
+/* vzctl_env_create_snapshot() stages, so that a number of CTs
+ * can be snapshotted while all of them are frozen:
+ * begin - store the new Snapshots.xml aside and freeze the CT;
+ * take - create the ploop snapshot and dump the CT;
+ * end - resume the CT and commit the snapshot, or (if err is set)
+ * roll everything back; the context is freed.
+ * A failed begin cleans up by itself.
+ */
+struct vzctl_snapshot_ctx;
+int vzctl_snapshot_begin(vps_handler *h, envid_t veid, const fs_param *fs,
+		const struct vzctl_snapshot_param *param,
+		struct vzctl_snapshot_ctx **ctx);
+int vzctl_snapshot_take(struct vzctl_snapshot_ctx *ctx);
+int vzctl_snapshot_end(struct vzctl_snapshot_ctx *ctx, int err);
+const char *vzctl_snapshot_guid(struct vzctl_snapshot_ctx *ctx);
+
 int vzctl_env_switch_snapshot(vps_handler *h, envid_t veid, vps_param *g_p,
 		const struct vzctl_snapshot_param *param);
 
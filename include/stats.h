@@ -0,0 +1,91 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef	_STATS_H_
+#define	_STATS_H_
+
+#include <stdint.h>
+
+/* Per-phase latency statistics, kept in a file (STATSFILE) which is
+ * mmap()ed and updated in place by every vzctl process. The layout
+ * below is stable so that external tools can read it directly.
+ * Only successfully completed phases are accounted.
+ */
+
+#define VZ_STATS_MAGIC		0x56535441	/* "VSTA" */
+#define VZ_STATS_VERSION	1
+
+/* Histogram buckets: bucket i counts samples below
+ * (1 << (i + VZ_STATS_MIN_SHIFT)) microseconds, the last one
+ * counts everything else.
+ */
+#define VZ_STATS_MIN_SHIFT	10	/* 1 ms */
+#define VZ_STATS_NBUCKETS	18	/* ... 65 s, +Inf */
+#define VZ_STATS_NAME_LEN	32
+
+/** Phases being measured. Append only, do not reorder.
+ */
+enum {
+	VZ_STAT_START,		/**< whole CT start */
+	VZ_STAT_STOP,		/**< whole CT stop */
+	VZ_STAT_CHKPNT,		/**< whole checkpoint */
+	VZ_STAT_RESTORE,	/**< whole restore */
+	VZ_STAT_MOUNT,		/**< mount incl. mount scripts */
+	VZ_STAT_UMOUNT,		/**< umount incl. umount scripts */
+	VZ_STAT_QUOTA_ON,	/**< disk quota on */
+	VZ_STAT_ENV_CREATE,	/**< VE/cgroup creation */
+	VZ_STAT_SETUP_RES,	/**< netdev, IP and other resource setup */
+	VZ_STAT_SCRIPT,		/**< action script runs */
+	VZ_STAT_INIT_EXEC,	/**< waiting for init to be executed */
+	VZ_STAT_ENV_STOP,	/**< stopping CT processes */
+	VZ_STAT_MAX
+};
+
+struct vz_stats_phase {
+	char name[VZ_STATS_NAME_LEN];
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t max_us;
+	uint64_t bucket[VZ_STATS_NBUCKETS];
+};
+
+struct vz_stats {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nphases;
+	uint32_t pad;
+	struct vz_stats_phase phase[VZ_STAT_MAX];
+};
+
+/** Get current time to be passed to vz_stats_add().
+ *
+ * @return		time in microseconds.
+ */
+uint64_t vz_stats_now(void);
+
+/** Account one sample for a phase, started at the given time.
+ * Does nothing if the statistics file can not be used.
+ *
+ * @param phase		phase (VZ_STAT_*).
+ * @param start		value of vz_stats_now() at phase start.
+ */
+void vz_stats_add(int phase, uint64_t start);
+
+int vz_stats_print(void);
+int vz_stats_reset(void);
+
+#endif /* _STATS_H_ */
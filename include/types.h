@@ -31,6 +31,7 @@
 #define VPS_NET_DEL		SCRIPTDIR "/vps-net_del"
 #define VPS_NETNS_DEV_ADD	SCRIPTDIR "/vps-netns_dev_add"
 #define VPS_NETNS_DEV_DEL	SCRIPTDIR "/vps-netns_dev_del"
+#define NETNS_RUN_DIR		"/var/run/netns"
 #define VPS_PCI			SCRIPTDIR "/vps-pci"
 #define VPS_PRESTART		SCRIPTDIR "/vps-prestart"
 
@@ -103,6 +104,8 @@ typedef enum {
 	SKIP_DUMPFILE_UNLINK =	(1<<5),
 	SKIP_VETH_CREATE =	(1<<6),
 	SKIP_FSCK =		(1<<7),
+	SKIP_WAIT =		(1<<8),	/* set the start mark, but do not
+					   wait for it (vps_wait_started) */
 } skipFlags;
 
 /** CT handler.
@@ -25,6 +25,7 @@
 #define ETH_ALEN	6
 #define MAC_SIZE	3*ETH_ALEN - 1
 #define VZNETCFG	SBINDIR "/vznetcfg"
+#define VZNET_CFG	PKGCONFDIR "/vznet.conf"
 
 #define PROC_VETH	"/proc/vz/veth"
 
@@ -35,4 +35,11 @@ int vps_configure(vps_handler *h, envid_t veid, dist_actions *actions,
 int vps_ip_configure(vps_handler *h, envid_t veid, dist_actions *actions,
 	const char *root, int op, net_param *net, int state);
 const char *state2str(int state);
+
+#define VPS_CONFIG_FP_LEN	17
+void vps_config_fp_get(dist_actions *actions, const fs_param *fs,
+	vps_param *param, char *buf, int len);
+int vps_config_fp_check(envid_t veid, const char *fp);
+int vps_config_fp_save(envid_t veid, const char *fp);
+void vps_config_fp_remove(envid_t veid);
 #endif
@@ -40,6 +40,11 @@ typedef enum {
 	ACTION_QUOTAOFF,
 	ACTION_QUOTAINIT,
 	ACTION_CONSOLE,
+	ACTION_EXEC_MANY,
+	ACTION_START_MANY,
+	ACTION_EXEC_AGENT,
+	ACTION_STATS,
+	ACTION_SNAPSHOT_MANY,
 #ifdef HAVE_PLOOP
 	ACTION_CONVERT,
 	ACTION_SNAPSHOT_CREATE,
@@ -167,6 +167,11 @@
 
 #define PARAM_OFFLINE_RESIZE	422
 #define PARAM_NETFILTER		423
+#define PARAM_COMPRESS		424
+#define PARAM_PRE_DUMP_ITER	425
+#define PARAM_LAZY		426
+#define PARAM_DEDUP		427
+#define PARAM_EXEC_AGENT	428
 
 #define PARAM_LINE		"e:p:f:t:i:l:k:a:b:n:x:h"
 #endif
@@ -31,6 +31,10 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/wait.h>
 
 #define EXC_OK 0
 #define EXC_USAGE	1
@@ -86,6 +90,10 @@ enum {
 
 char* iface = NULL;
 
+#define MAX_IFACES	64
+char *ifaces[MAX_IFACES];
+int iface_count = 0;
+
 int timeout = 1;
 int count = -1;
 
@@ -114,6 +122,18 @@ struct in_addr trg_ipaddr[MAX_IPADDR_NUMBER];
 int trg_ipaddr_count = 0;
 int trg_ipaddr_flag = 0;
 
+/* Addresses to announce in burst mode (many -i and/or interfaces) */
+struct in_addr upd_ipaddr[MAX_IPADDR_NUMBER];
+int upd_ipaddr_count = 0;
+char *upd_ip6addr[MAX_IPADDR_NUMBER];
+int upd_ip6addr_count = 0;
+
+/* Max packets per second per interface in burst mode, 0 - no limit */
+int rate = 0;
+
+/* Print per address detection results to stdout */
+int machine_output = 0;
+
 const unsigned char broadcast[ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 struct in_addr zero = {0x00000000};
 
@@ -129,9 +149,13 @@ char* program_name = NULL;
 
 static void usage()
 {
-	fprintf(stderr, "Usage: %s <-U -i <src_ip_addr> | -D -e <trg_ip_addr> "
-		"[-e <trg_ip_addr>] ...> [-c <count>] [-w <timeout>] "
-		"interface_name\n", program_name);
+	fprintf(stderr, "Usage: %s -D -e <trg_ip_addr> [-e <trg_ip_addr> ...] "
+		"[-c <count>] [-w <timeout>] [-r <rate>] [-m] [-o] "
+		"interface_name [interface_name ...]\n"
+		"       %s -U -i <src_ip_addr> [-i <src_ip_addr> ...] "
+		"[-c <count>] [-w <timeout>] [-r <rate>] "
+		"interface_name [interface_name ...]\n",
+		program_name, program_name);
 	exit(EXC_USAGE);
 }
 
@@ -153,7 +177,7 @@ static void parse_options (int argc, char **argv)
 	})
 
 	int c;
-	static char short_options[] = "UDQPc:w:s:t:S:T:i:e:ov";
+	static char short_options[] = "UDQPc:w:s:t:S:T:i:e:or:mv";
 	static struct option long_options[] =
 	{
 		{"update", 0, NULL, 'U'},
@@ -169,6 +193,8 @@ static void parse_options (int argc, char **argv)
 		{"src-ip", 1, NULL, 'i'},
 		{"trg-ip", 1, NULL, 'e'},
 		{"at-once", 0, NULL, 'o'},
+		{"rate", 1, NULL, 'r'},
+		{"machine", 0, NULL, 'm'},
 		{NULL, 0, NULL, 0}
 	};
 
@@ -218,12 +244,17 @@ static void parse_options (int argc, char **argv)
 			read_hw(trg_arp_hwaddr);
 			break;
 		case 'i':
+			if (upd_ipaddr_count + upd_ip6addr_count >=
+					MAX_IPADDR_NUMBER)
+				usage();
 			if (strchr(optarg, ':')) {
 				ip6_addr = optarg;
+				upd_ip6addr[upd_ip6addr_count++] = optarg;
 				src_ipaddr_flag = 1;
 				break;
 			}
 			read_ip(src_ipaddr);
+			upd_ipaddr[upd_ipaddr_count++] = src_ipaddr;
 			break;
 		case 'e':
 			if (strchr(optarg, ':')) {
@@ -241,6 +272,14 @@ static void parse_options (int argc, char **argv)
 		case 'o':
 			at_once = 1;
 			break;
+		case 'm':
+			machine_output = 1;
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			if (rate < 0)
+				usage();
+			break;
 		case 'v':
 			debug_level ++ ;
 			break;
@@ -252,12 +291,15 @@ static void parse_options (int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (cmd == AR_NOTHING || argc != 1
+	if (cmd == AR_NOTHING || argc < 1 || argc > MAX_IFACES
+	    || (cmd != AR_UPDATE && cmd != AR_DETECT && argc != 1)
 	    || (cmd == AR_DETECT && !trg_ipaddr_flag)
 	    || (cmd == AR_UPDATE && !src_ipaddr_flag))
 		usage();
 
 	iface = argv[0];
+	for (iface_count = 0; iface_count < argc; iface_count++)
+		ifaces[iface_count] = argv[iface_count];
 
 	/* user have to choose something */
 	if (!cmd)
@@ -274,7 +316,7 @@ static void parse_options (int argc, char **argv)
 u_char real_hwaddr[ETH_ALEN];
 struct in_addr real_ipaddr;
 
-static int init_device_addresses(int sock, const char* device)
+static int init_device_addresses(int sock, const char* device, int need_ip)
 {
 	struct ifreq ifr;
 	int ifindex;
@@ -317,11 +359,14 @@ static int init_device_addresses(int sock, const char* device)
 	}
 	memcpy(real_hwaddr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
 
-	if (ioctl(sock, SIOCGIFADDR, &ifr)) {
+	if (ioctl(sock, SIOCGIFADDR, &ifr) == 0) {
+		memcpy(&real_ipaddr, ifr.ifr_addr.sa_data + 2, IP_ADDR_LEN);
+	} else if (need_ip) {
 		logger(LOG_ERROR, "can't get iface '%s' address : %m", device);
 		return -1;
+	} else {
+		real_ipaddr = zero;
 	}
-	memcpy(&real_ipaddr, ifr.ifr_addr.sa_data + 2, IP_ADDR_LEN);
 
 	logger(LOG_DEBUG, "got addresses hw='%s', ip='%s'",
 		print_hw_addr(real_hwaddr),
@@ -480,12 +525,340 @@ static void set_signal(int signo, void (*handler)(void))
 	sigaction(signo, &sa, NULL);
 }
 
+/* Burst mode: handle all the given addresses on all the given
+ * interfaces at once. Packets for an interface are prepared in advance
+ * and sent by sendmmsg() in chunks, rounds (-c) are spaced by exactly
+ * -w seconds, and an optional rate limit (-r) is kept by sleeping until
+ * absolute deadlines rather than relying on alarm() ticks.
+ *
+ * For update (announcement) no replies are waited for. For detection,
+ * replies from all interfaces are collected in a single poll() loop,
+ * which ends as soon as every address is found to be in use, or when
+ * -w seconds have passed since the last round.
+ */
+#define BURST_SIZE	64
+
+struct burst_iface {
+	const char *name;
+	int sock;
+	struct sockaddr_ll addr;
+	struct arp_packet *pkts;
+};
+
+/* Detection result for a target address */
+struct detect_result {
+	int busy;
+	int iface;
+	u_char hwaddr[ETH_ALEN];
+};
+
+static void ts_add(struct timespec *ts, long long ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/* a - b, in ms, rounded up, 0 if a is in the past */
+static int ts_diff_ms(const struct timespec *a, const struct timespec *b)
+{
+	long long ns;
+
+	ns = (a->tv_sec - b->tv_sec) * 1000000000LL +
+		(a->tv_nsec - b->tv_nsec);
+	return ns > 0 ? (ns + 999999) / 1000000 : 0;
+}
+
+static void sleep_until(const struct timespec *ts)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL)
+			== EINTR)
+		;
+}
+
+static int send_packets(struct burst_iface *bi, int first, int n)
+{
+	struct mmsghdr msgs[BURST_SIZE];
+	struct iovec iov[BURST_SIZE];
+	int i, rc, sent = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = &bi->pkts[first + i];
+		iov[i].iov_len = sizeof(struct arp_packet);
+		msgs[i].msg_hdr.msg_name = &bi->addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(bi->addr);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		logger(LOG_DEBUG, "send packet: %s",
+				print_arp_packet(&bi->pkts[first + i]));
+	}
+	while (sent < n) {
+		rc = sendmmsg(bi->sock, msgs + sent, n - sent, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(LOG_ERROR, "sendmmsg : %m");
+			return -1;
+		}
+		sent += rc;
+	}
+
+	return 0;
+}
+
+/* Send one round of npkts packets on every interface */
+static int send_round(struct burst_iface *bi, int npkts)
+{
+	struct timespec next;
+	int i, off, n, chunk = BURST_SIZE;
+
+	/* Send in 10 ms slots when rate limited */
+	if (rate > 0 && rate / 100 < chunk)
+		chunk = rate / 100 > 0 ? rate / 100 : 1;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (off = 0; off < npkts; off += n) {
+		n = npkts - off;
+		if (n > chunk)
+			n = chunk;
+		if (rate > 0 && off > 0) {
+			ts_add(&next, chunk * 1000000000LL / rate);
+			sleep_until(&next);
+		}
+		/* Interleave interfaces so each one gets the rate */
+		for (i = 0; i < iface_count; i++)
+			if (send_packets(&bi[i], off, n))
+				return -1;
+	}
+
+	return 0;
+}
+
+/* Open a socket bound to the interface and prepare packets for the
+ * given addresses. Update packets are gratuitous ARP requests, i.e.
+ * both sender and target are the address itself; detection packets
+ * only have the address as a target.
+ */
+static int init_burst_iface(struct burst_iface *bi, const char *device,
+		const struct in_addr *ips, int nips)
+{
+	struct arp_packet tmpl;
+	int i;
+
+	bi->name = device;
+	bi->sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ARP));
+	if (bi->sock < 0) {
+		logger(LOG_ERROR, "socket : %m");
+		return -1;
+	}
+	if (init_device_addresses(bi->sock, device,
+				cmd == AR_DETECT && !src_ipaddr_flag) < 0)
+		return -1;
+	bi->addr = iaddr;
+	if (bind(bi->sock, (struct sockaddr *)&bi->addr, sizeof(bi->addr))) {
+		logger(LOG_ERROR, "bind : %m");
+		return -1;
+	}
+	memset(&tmpl, 0, sizeof(tmpl));
+	create_arp_packet(&tmpl);
+	bi->pkts = calloc(nips, sizeof(struct arp_packet));
+	if (bi->pkts == NULL) {
+		logger(LOG_ERROR, "calloc : %m");
+		return -1;
+	}
+	for (i = 0; i < nips; i++) {
+		bi->pkts[i] = tmpl;
+		if (cmd == AR_UPDATE)
+			memcpy(bi->pkts[i].sndr_ip_addr, &ips[i], IP_ADDR_LEN);
+		memcpy(bi->pkts[i].rcpt_ip_addr, &ips[i], IP_ADDR_LEN);
+	}
+
+	return 0;
+}
+
+/* Announce all IPv6 addresses on all interfaces with one ndsend run */
+static int update_burst_ip6(void)
+{
+	char *args[MAX_IPADDR_NUMBER + MAX_IFACES + 2];
+	int i, n = 0, status;
+	pid_t pid;
+
+	args[n++] = "ndsend";
+	for (i = 0; i < upd_ip6addr_count; i++)
+		args[n++] = upd_ip6addr[i];
+	for (i = 0; i < iface_count; i++)
+		args[n++] = ifaces[i];
+	args[n] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		logger(LOG_ERROR, "fork : %m");
+		return EXC_SYS;
+	}
+	if (pid == 0) {
+		execv(SBINDIR "/ndsend", args);
+		logger(LOG_ERROR, "exec ndsend : %m");
+		_exit(EXC_SYS);
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return EXC_SYS;
+
+	return WIFEXITED(status) && !WEXITSTATUS(status) ? EXC_OK : EXC_SYS;
+}
+
+static int update_burst(void)
+{
+	struct burst_iface bi[MAX_IFACES];
+	struct timespec round;
+	int i, r;
+
+	if (upd_ipaddr_count == 0)
+		return update_burst_ip6();
+	for (i = 0; i < iface_count; i++)
+		if (init_burst_iface(&bi[i], ifaces[i],
+					upd_ipaddr, upd_ipaddr_count))
+			return EXC_SYS;
+
+	clock_gettime(CLOCK_MONOTONIC, &round);
+	for (r = 0; count < 0 || r < count; r++) {
+		if (r > 0) {
+			ts_add(&round, timeout * 1000000000LL);
+			sleep_until(&round);
+		}
+		if (send_round(bi, upd_ipaddr_count))
+			return EXC_SYS;
+	}
+
+	return upd_ip6addr_count ? update_burst_ip6() : EXC_OK;
+}
+
+/* Read all pending packets from the interface socket, and account
+ * replies from the target addresses.
+ * Returns number of addresses newly found to be in use.
+ */
+static int recv_detect(struct burst_iface *bi, int idx,
+		struct detect_result *res)
+{
+	u_char packet[4096];
+	struct arp_packet *pkt = (struct arp_packet *)packet;
+	struct sockaddr_ll from;
+	socklen_t alen;
+	int cc, i, found = 0;
+
+	for (;;) {
+		alen = sizeof(from);
+		cc = recvfrom(bi->sock, packet, sizeof(packet), MSG_DONTWAIT,
+				(struct sockaddr *)&from, &alen);
+		if (cc < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				logger(LOG_ERROR, "recvfrom : %m");
+			break;
+		}
+		/* Skip our own probes and anything but ARP */
+		if (from.sll_pkttype == PACKET_OUTGOING ||
+		    cc < (int)offsetof(struct arp_packet, padding) ||
+		    pkt->frame_type != htons(ETH_P_ARP) ||
+		    (pkt->op != htons(REQUEST) && pkt->op != htons(REPLY)))
+			continue;
+		for (i = 0; i < trg_ipaddr_count; i++) {
+			if (res[i].busy || memcmp(&trg_ipaddr[i],
+					pkt->sndr_ip_addr, IP_ADDR_LEN))
+				continue;
+			logger(LOG_DEBUG, "recv packet %s",
+					print_arp_packet(pkt));
+			logger(LOG_INFO, "%s is detected on another "
+					"computer : %s",
+				print_ip_addr((u_char *)&trg_ipaddr[i]),
+				print_hw_addr(pkt->sndr_hw_addr));
+			res[i].busy = 1;
+			res[i].iface = idx;
+			memcpy(res[i].hwaddr, pkt->sndr_hw_addr, ETH_ALEN);
+			found++;
+		}
+	}
+
+	return found;
+}
+
+static int detect_burst(void)
+{
+	struct burst_iface bi[MAX_IFACES];
+	struct pollfd pfd[MAX_IFACES];
+	struct detect_result *res;
+	struct timespec now, next;
+	int i, r = 0, busy = 0;
+
+	/* IPv6 addresses are not checked */
+	if (trg_ipaddr_count == 0)
+		return EXC_OK;
+	res = calloc(trg_ipaddr_count, sizeof(*res));
+	if (res == NULL) {
+		logger(LOG_ERROR, "calloc : %m");
+		return EXC_SYS;
+	}
+	for (i = 0; i < iface_count; i++) {
+		if (init_burst_iface(&bi[i], ifaces[i],
+					trg_ipaddr, trg_ipaddr_count))
+			return EXC_SYS;
+		pfd[i].fd = bi[i].sock;
+		pfd[i].events = POLLIN;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (busy < trg_ipaddr_count && !(at_once && busy)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (ts_diff_ms(&next, &now) == 0) {
+			/* Last round is answered or timed out */
+			if (count >= 0 && r >= count)
+				break;
+			if (send_round(bi, trg_ipaddr_count))
+				return EXC_SYS;
+			r++;
+			ts_add(&next, timeout * 1000000000LL);
+			continue;
+		}
+		if (poll(pfd, iface_count, ts_diff_ms(&next, &now)) < 0 &&
+				errno != EINTR) {
+			logger(LOG_ERROR, "poll : %m");
+			return EXC_SYS;
+		}
+		for (i = 0; i < iface_count; i++)
+			if (pfd[i].revents & POLLIN)
+				busy += recv_detect(&bi[i], i, res);
+	}
+
+	if (machine_output) {
+		for (i = 0; i < trg_ipaddr_count; i++) {
+			if (res[i].busy)
+				printf("%s busy %s %s\n",
+					print_ip_addr((u_char *)&trg_ipaddr[i]),
+					print_hw_addr(res[i].hwaddr),
+					bi[res[i].iface].name);
+			else
+				printf("%s %s\n",
+					print_ip_addr((u_char *)&trg_ipaddr[i]),
+					/* not waited for the answer */
+					at_once && busy ? "unknown" : "free");
+		}
+		fflush(stdout);
+	}
+
+	return busy ? EXC_RECV : EXC_OK;
+}
+
 int main(int argc, char** argv)
 {
 	sigset_t block_alarm;
 	program_name = argv[0];
 	parse_options (argc, argv);
 
+	if (cmd == AR_UPDATE &&
+	    (iface_count > 1 || upd_ipaddr_count + upd_ip6addr_count > 1))
+		exit(update_burst());
+	if (cmd == AR_DETECT)
+		exit(detect_burst());
+
 	if (ip6_addr) {
 		if (cmd == AR_UPDATE)
 			execlp(SBINDIR "/ndsend", "ndsend",
@@ -500,7 +873,7 @@ int main(int argc, char** argv)
 		exit(EXC_SYS);
 	}
 
-	if (init_device_addresses(sock, iface) < 0)
+	if (init_device_addresses(sock, iface, 1) < 0)
 		exit(EXC_SYS);
 
 	create_arp_packet(&pkt);
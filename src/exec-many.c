@@ -0,0 +1,507 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * vzctl exec-many: run the same command in a set of containers,
+ * using a number of parallel worker processes. Every worker enters
+ * one container, the parent multiplexes workers' output, prefixing
+ * each line with the CTID (or collecting it per CT), and enforces
+ * a per-CT timeout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include "vzerror.h"
+#include "vzconfig.h"
+#include "logger.h"
+#include "exec.h"
+#include "env.h"
+#include "util.h"
+
+#define EXEC_MANY_STDOUT	0
+#define EXEC_MANY_STDERR	1
+
+struct exec_stream {
+	int fd;		/* read end of worker's stdout/stderr, -1 on EOF */
+	FILE *out;	/* where to copy it to */
+	char *buf;	/* partial line (or whole output in collect mode) */
+	size_t len;
+};
+
+struct exec_job {
+	envid_t veid;
+	pid_t pid;
+	struct exec_stream st[2];
+	struct timeval start;
+	int status;
+	int timedout;
+};
+
+struct exec_many_param {
+	envid_t *ves;
+	int nves;
+	int jobs;
+	int timeout;	/* per-CT timeout, seconds; 0 - unlimited */
+	int collect;	/* print output per CT upon its completion */
+	char *cmd;
+};
+
+static void usage_exec_many(int err)
+{
+	fprintf(err ? stderr : stdout,
+"vzctl exec-many --ctids <ctid[,ctid...]>|all [--jobs <N>]\n"
+"   [--timeout <seconds>] [--collect] -- <command> [arg ...]\n");
+}
+
+static int parse_exec_many_opt(vps_handler *h, int argc, char **argv,
+		struct exec_many_param *p)
+{
+	int c, ret;
+	char *ctids = NULL;
+	static struct option exec_many_options[] = {
+		{"ctids",	required_argument, NULL, 'c'},
+		{"jobs",	required_argument, NULL, 'j'},
+		{"timeout",	required_argument, NULL, 't'},
+		{"collect",	no_argument, NULL, 'C'},
+		{"help",	no_argument, NULL, 'h'},
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while (1) {
+		c = getopt_long(argc, argv, "+", exec_many_options, NULL);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'c':
+			ctids = optarg;
+			break;
+		case 'j':
+			if (parse_int(optarg, &p->jobs) || p->jobs <= 0)
+				return vzctl_err(VZ_INVALID_PARAMETER_VALUE, 0,
+					"Invalid value for --jobs: %s",
+					optarg);
+			break;
+		case 't':
+			if (parse_int(optarg, &p->timeout) || p->timeout < 0)
+				return vzctl_err(VZ_INVALID_PARAMETER_VALUE, 0,
+					"Invalid value for --timeout: %s",
+					optarg);
+			break;
+		case 'C':
+			p->collect = 1;
+			break;
+		case 'h':
+			usage_exec_many(0);
+			exit(0);
+		default:
+			usage_exec_many(1);
+			return VZ_INVALID_PARAMETER_SYNTAX;
+		}
+	}
+
+	if (ctids == NULL) {
+		usage_exec_many(1);
+		return vzctl_err(VZ_INVALID_PARAMETER_SYNTAX, 0,
+				"Option --ctids is required");
+	}
+	if (optind >= argc) {
+		usage_exec_many(1);
+		return vzctl_err(VZ_INVALID_PARAMETER_SYNTAX, 0,
+				"No command line given for exec-many");
+	}
+	if ((ret = parse_ve_list(h, ctids, &p->ves, &p->nves)))
+		return ret;
+
+	/* Same as exec: the command is run via bash -c */
+	p->cmd = arg2str(argv + optind);
+	if (p->cmd == NULL)
+		return vzctl_err(VZ_RESOURCE_ERROR, ENOMEM,
+				"Unable to allocate command line");
+
+	return 0;
+}
+
+/* Runs in a worker process: enter a CT and execute the command */
+static int exec_one(envid_t veid, char *cmd)
+{
+	vps_handler *h;
+	vps_param *g_p, *vps_p;
+	char conf[STR_SIZE];
+	char *argv[] = {"bash", "-c", cmd, NULL};
+	int ret;
+
+	set_log_ctid(veid);
+	g_p = init_vps_param();
+	vps_p = init_vps_param();
+
+	get_vps_conf_path(veid, conf, sizeof(conf));
+	if (vps_parse_config(veid, GLOBAL_CFG, g_p, NULL)) {
+		ret = VZ_NOCONFIG;
+		goto out;
+	}
+	if (stat_file(conf) != 1) {
+		ret = vzctl_err(VZ_NOVECONFIG, 0,
+				"Container config file does not exist");
+		goto out;
+	}
+	if (vps_parse_config(veid, conf, vps_p, NULL)) {
+		ret = VZ_NOCONFIG;
+		goto out;
+	}
+	merge_vps_param(g_p, vps_p);
+
+	if ((h = vz_open(veid, g_p)) == NULL) {
+		ret = VZ_BAD_KERNEL;
+		goto out;
+	}
+	logger(1, 0, "Executing command: %s", cmd);
+	ret = vps_exec(h, veid, g_p->res.fs.root, MODE_BASH, argv,
+			NULL, NULL, 0);
+	vz_close(h);
+out:
+	free_vps_param(g_p);
+	free_vps_param(vps_p);
+
+	return ret;
+}
+
+static int start_job(struct exec_job *job, char *cmd)
+{
+	int out[2], err[2];
+	int fd;
+
+	if (pipe(out) < 0 || pipe(err) < 0)
+		return vzctl_err(VZ_RESOURCE_ERROR, errno,
+				"Unable to create pipe");
+	fflush(stdout);
+	fflush(stderr);
+	job->pid = fork();
+	if (job->pid < 0) {
+		close(out[0]); close(out[1]);
+		close(err[0]); close(err[1]);
+		return vzctl_err(VZ_RESOURCE_ERROR, errno, "Unable to fork");
+	} else if (job->pid == 0) {
+		/* Own process group, so the whole tree can be killed */
+		setpgid(0, 0);
+		if ((fd = open("/dev/null", O_RDONLY)) >= 0) {
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+		}
+		dup2(out[1], STDOUT_FILENO);
+		dup2(err[1], STDERR_FILENO);
+		close(out[0]); close(out[1]);
+		close(err[0]); close(err[1]);
+		exit(exec_one(job->veid, cmd));
+	}
+	close(out[1]);
+	close(err[1]);
+	job->st[EXEC_MANY_STDOUT].fd = out[0];
+	job->st[EXEC_MANY_STDOUT].out = stdout;
+	job->st[EXEC_MANY_STDERR].fd = err[0];
+	job->st[EXEC_MANY_STDERR].out = stderr;
+	gettimeofday(&job->start, NULL);
+
+	return 0;
+}
+
+/* Print all complete lines from the stream buffer, prefixed with CTID */
+static void flush_lines(struct exec_job *job, struct exec_stream *st, int all)
+{
+	char *sp = st->buf, *ep;
+	char *end = st->buf + st->len;
+
+	while (sp < end) {
+		ep = memchr(sp, '\n', end - sp);
+		if (ep == NULL) {
+			if (!all)
+				break;
+			ep = end;
+		}
+		fprintf(st->out, "%d: %.*s\n", job->veid, (int)(ep - sp), sp);
+		sp = ep + 1;
+	}
+	if (sp >= end) {
+		st->len = 0;
+	} else {
+		st->len = end - sp;
+		memmove(st->buf, sp, st->len);
+	}
+	fflush(st->out);
+}
+
+static int read_stream(struct exec_job *job, struct exec_stream *st,
+		int collect)
+{
+	char buf[4096];
+	char *tmp;
+	ssize_t n;
+
+	n = read(st->fd, buf, sizeof(buf));
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (n <= 0) {
+		close(st->fd);
+		st->fd = -1;
+		if (!collect)
+			flush_lines(job, st, 1);
+		return 0;
+	}
+	tmp = realloc(st->buf, st->len + n);
+	if (tmp == NULL)
+		return vzctl_err(VZ_RESOURCE_ERROR, ENOMEM,
+				"Unable to allocate output buffer");
+	st->buf = tmp;
+	memcpy(st->buf + st->len, buf, n);
+	st->len += n;
+	if (!collect)
+		flush_lines(job, st, 0);
+
+	return 0;
+}
+
+static void finish_job(struct exec_job *job, int collect)
+{
+	int i;
+
+	job->status = env_wait(job->pid);
+	job->pid = 0;
+	if (job->timedout)
+		job->status = VZ_EXEC_TIMEOUT;
+
+	if (collect) {
+		printf("==> CT %d: exit status %d%s <==\n", job->veid,
+				job->status, job->timedout ? " (timeout)" : "");
+		for (i = 0; i < 2; i++) {
+			fwrite(job->st[i].buf, 1, job->st[i].len,
+					job->st[i].out);
+			if (job->st[i].len &&
+					job->st[i].buf[job->st[i].len - 1] != '\n')
+				fputc('\n', job->st[i].out);
+			fflush(job->st[i].out);
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		free(job->st[i].buf);
+		job->st[i].buf = NULL;
+		job->st[i].len = 0;
+	}
+}
+
+/* Milliseconds left before the job times out, or -1 if no timeout */
+static int job_time_left(struct exec_job *job, int timeout,
+		struct timeval *now)
+{
+	long ms;
+
+	if (!timeout)
+		return -1;
+	ms = timeout * 1000L -
+		((now->tv_sec - job->start.tv_sec) * 1000L +
+		 (now->tv_usec - job->start.tv_usec) / 1000);
+
+	return ms < 0 ? 0 : ms;
+}
+
+static int run_jobs(struct exec_many_param *p, struct exec_job *jobs)
+{
+	struct pollfd *pfd;
+	struct exec_job **pjob;
+	struct timeval now;
+	int next = 0, running = 0;
+	int i, j, n, tmo, left, ret = 0;
+
+	pfd = calloc(p->jobs * 2, sizeof(*pfd));
+	pjob = calloc(p->jobs * 2, sizeof(*pjob));
+	if (pfd == NULL || pjob == NULL) {
+		ret = vzctl_err(VZ_RESOURCE_ERROR, ENOMEM,
+				"Unable to allocate job table");
+		goto out;
+	}
+
+	while (next < p->nves || running) {
+		/* Fill up free job slots */
+		while (next < p->nves && running < p->jobs && !ret) {
+			if ((ret = start_job(&jobs[next], p->cmd)))
+				break;
+			next++;
+			running++;
+		}
+		if (!running)
+			break;
+
+		/* Collect fds of running jobs, find nearest timeout */
+		gettimeofday(&now, NULL);
+		n = 0;
+		tmo = -1;
+		for (i = 0; i < next; i++) {
+			if (jobs[i].pid <= 0)
+				continue;
+			left = job_time_left(&jobs[i], p->timeout, &now);
+			if (left == 0 && !jobs[i].timedout) {
+				logger(-1, 0, "CT %d: execution timeout "
+						"expired", jobs[i].veid);
+				kill(-jobs[i].pid, SIGKILL);
+				jobs[i].timedout = 1;
+				/* Something daemonized in CT may hold them */
+				for (j = 0; j < 2; j++) {
+					if (jobs[i].st[j].fd < 0)
+						continue;
+					close(jobs[i].st[j].fd);
+					jobs[i].st[j].fd = -1;
+				}
+			}
+			if (left > 0 && (tmo < 0 || left < tmo))
+				tmo = left;
+			for (j = 0; j < 2; j++) {
+				if (jobs[i].st[j].fd < 0)
+					continue;
+				pfd[n].fd = jobs[i].st[j].fd;
+				pfd[n].events = POLLIN;
+				pjob[n] = &jobs[i];
+				n++;
+			}
+			/* Both streams are closed, the worker is done */
+			if (jobs[i].st[EXEC_MANY_STDOUT].fd < 0 &&
+			    jobs[i].st[EXEC_MANY_STDERR].fd < 0)
+			{
+				finish_job(&jobs[i], p->collect);
+				running--;
+			}
+		}
+		if (n == 0)
+			continue;
+
+		if (poll(pfd, n, tmo) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = vzctl_err(VZ_SYSTEM_ERROR, errno,
+					"Error in poll()");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			struct exec_stream *st;
+
+			if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			st = &pjob[i]->st[EXEC_MANY_STDOUT];
+			if (st->fd != pfd[i].fd)
+				st = &pjob[i]->st[EXEC_MANY_STDERR];
+			if ((ret = read_stream(pjob[i], st, p->collect)))
+				break;
+		}
+		if (ret)
+			break;
+	}
+
+out:
+	/* On error, do not leave any workers behind */
+	for (i = 0; i < next; i++) {
+		if (jobs[i].pid <= 0)
+			continue;
+		kill(-jobs[i].pid, SIGKILL);
+		for (j = 0; j < 2; j++)
+			if (jobs[i].st[j].fd >= 0)
+				close(jobs[i].st[j].fd);
+		jobs[i].st[EXEC_MANY_STDOUT].fd = -1;
+		jobs[i].st[EXEC_MANY_STDERR].fd = -1;
+		finish_job(&jobs[i], 0);
+	}
+	free(pfd);
+	free(pjob);
+
+	return ret;
+}
+
+/** Execute a command in a number of containers in parallel.
+ *
+ * @param g_p		global parameters.
+ * @param argc		number of arguments (argv[0] is program name).
+ * @param argv		exec-many options, followed by the command.
+ * @return		0 if the command succeeded in every CT.
+ */
+int exec_many(vps_param *g_p, int argc, char **argv)
+{
+	struct exec_many_param p = {};
+	struct exec_job *jobs = NULL;
+	vps_handler *h;
+	int i, failed = 0, ret;
+
+	if ((h = vz_open(0, g_p)) == NULL)
+		return VZ_BAD_KERNEL;
+	ret = parse_exec_many_opt(h, argc, argv, &p);
+	vz_close(h);
+	if (ret)
+		goto out;
+	if (p.nves == 0) {
+		logger(0, 0, "No containers to run the command in");
+		goto out;
+	}
+	if (p.jobs == 0)
+		p.jobs = get_num_cpu();
+	if (p.jobs > p.nves)
+		p.jobs = p.nves;
+
+	jobs = calloc(p.nves, sizeof(*jobs));
+	if (jobs == NULL) {
+		ret = vzctl_err(VZ_RESOURCE_ERROR, ENOMEM,
+				"Unable to allocate job table");
+		goto out;
+	}
+	for (i = 0; i < p.nves; i++) {
+		jobs[i].veid = p.ves[i];
+		jobs[i].st[EXEC_MANY_STDOUT].fd = -1;
+		jobs[i].st[EXEC_MANY_STDERR].fd = -1;
+	}
+
+	logger(1, 0, "Executing command in %d containers, %d jobs: %s",
+			p.nves, p.jobs, p.cmd);
+	if ((ret = run_jobs(&p, jobs)))
+		goto out;
+
+	for (i = 0; i < p.nves; i++) {
+		if (jobs[i].status == 0)
+			continue;
+		failed++;
+		logger(-1, 0, "CT %d: command %s (exit status %d)",
+				jobs[i].veid,
+				jobs[i].timedout ? "timed out" : "failed",
+				jobs[i].status);
+	}
+	if (failed) {
+		logger(-1, 0, "Command failed in %d of %d containers",
+				failed, p.nves);
+		ret = VZ_COMMAND_EXECUTION_ERROR;
+	}
+out:
+	free(jobs);
+	free(p.ves);
+	free(p.cmd);
+
+	return ret;
+}
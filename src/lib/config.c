@@ -56,6 +56,8 @@ static vps_config config[] = {
 /*	Op	*/
 {"LOCKDIR",	NULL, PARAM_LOCKDIR},
 {"DUMPDIR",	NULL, PARAM_DUMPDIR},
+{"DUMP_DEDUP",	NULL, PARAM_DEDUP},
+{"EXEC_AGENT",	NULL, PARAM_EXEC_AGENT},
 /*	Log	*/
 {"LOGGING",	NULL, PARAM_LOGGING},
 {"LOG_LEVEL",	NULL, PARAM_LOGLEVEL},
@@ -213,24 +215,6 @@ static int opt_get_by_id(struct option *opt, int id)
 	return -1;
 }
 
-static conf_struct *find_conf_line(list_head_t *head, const char *name,
-	char delim)
-{
-	conf_struct *conf;
-	char *p;
-	int len;
-
-	len = strlen(name);
-	list_for_each(conf, head, list) {
-		if (strncmp(conf->val, name, len))
-			continue;
-		p = conf->val + len;
-		if (*p == delim)
-			return conf;
-	}
-	return NULL;
-}
-
 static long long get_mul(char c)
 {
 	switch (c) {
@@ -2227,6 +2211,12 @@ static int parse(envid_t veid, vps_param *vps_p, char *val, int id)
 	case PARAM_DUMPDIR:
 		ret = conf_parse_str(&vps_p->res.cpt.dumpdir, val);
 		break;
+	case PARAM_DEDUP:
+		ret = conf_parse_yesno(&vps_p->res.cpt.dedup, val);
+		break;
+	case PARAM_EXEC_AGENT:
+		ret = conf_parse_yesno(&vps_p->opt.exec_agent, val);
+		break;
 	case PARAM_LOGGING:
 		ret = conf_parse_yesno(&vps_p->log.enable, val);
 		break;
@@ -2749,7 +2739,10 @@ static int write_conf(const char *fname, list_head_t *head)
 			goto out2;
 		}
 	}
-	fclose(fp);
+	if (fclose(fp)) {
+		logger(-1, errno, "Error writing to %s", tmpfile);
+		goto out2;
+	}
 	if (rename(tmpfile, file)) {
 		logger(-1, errno, "Unable to move %s -> %s",
 			tmpfile, file );
@@ -2765,30 +2758,126 @@ out_file:
 	return ret;
 }
 
-static int vps_merge_conf(list_head_t *dst, list_head_t *src)
+/* Index of "NAME=" lines in a config read by read_conf(),
+ * so merging does not have to scan the whole file per parameter.
+ */
+struct conf_index_ent {
+	conf_struct *line;
+	unsigned int len;		/* length of NAME */
+	struct conf_index_ent *next;
+};
+
+struct conf_index {
+	unsigned int size;		/* number of buckets, power of 2 */
+	unsigned int used;
+	unsigned int max;
+	struct conf_index_ent **tbl;
+	struct conf_index_ent *ent;	/* preallocated entries */
+};
+
+static unsigned int conf_name_hash(const char *name, unsigned int len)
 {
+	unsigned int hash = 5381;
+
+	while (len--)
+		hash = hash * 33 + (unsigned char)*name++;
+	return hash;
+}
+
+static conf_struct *conf_index_find(struct conf_index *idx,
+	const char *name, unsigned int len)
+{
+	struct conf_index_ent *e;
+
+	e = idx->tbl[conf_name_hash(name, len) & (idx->size - 1)];
+	for (; e != NULL; e = e->next)
+		if (e->len == len && !strncmp(e->line->val, name, len))
+			return e->line;
+	return NULL;
+}
+
+static void conf_index_add(struct conf_index *idx, conf_struct *line)
+{
+	struct conf_index_ent *e, **b;
+	char *p;
 	unsigned int len;
+
+	if ((p = strchr(line->val, '=')) == NULL || idx->used == idx->max)
+		return;
+	len = p - line->val;
+	/* Keep the first occurrence, same as a linear search would */
+	if (conf_index_find(idx, line->val, len) != NULL)
+		return;
+	e = &idx->ent[idx->used++];
+	e->line = line;
+	e->len = len;
+	b = &idx->tbl[conf_name_hash(line->val, len) & (idx->size - 1)];
+	e->next = *b;
+	*b = e;
+}
+
+static void conf_index_free(struct conf_index *idx)
+{
+	free(idx->tbl);
+	free(idx->ent);
+}
+
+static int conf_index_init(struct conf_index *idx, list_head_t *head,
+	unsigned int extra)
+{
+	conf_struct *line;
+	unsigned int n = 0;
+
+	list_for_each(line, head, list)
+		n++;
+	idx->max = n + extra;
+	for (idx->size = 16; idx->size < idx->max; idx->size <<= 1)
+		;
+	idx->used = 0;
+	idx->tbl = calloc(idx->size, sizeof(*idx->tbl));
+	idx->ent = malloc(idx->max * sizeof(*idx->ent));
+	if (idx->tbl == NULL || idx->ent == NULL) {
+		conf_index_free(idx);
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		return -1;
+	}
+	list_for_each(line, head, list)
+		conf_index_add(idx, line);
+
+	return 0;
+}
+
+static int vps_merge_conf(list_head_t *dst, list_head_t *src)
+{
+	unsigned int len, n = 0;
 	int cnt = 0;
 	conf_struct *conf, *line;
-	char ltoken[STR_SIZE];
+	struct conf_index idx;
 	char *p;
 
 	if (list_empty(src))
 		return 0;
+	list_for_each(conf, src, list)
+		n++;
+	if (conf_index_init(&idx, dst, n))
+		return -1;
 	list_for_each(conf, src, list) {
 		if ((p = strchr(conf->val, '=')) == NULL)
 			 continue;
-		len = p - conf->val + 1;
-		snprintf(ltoken, len < sizeof(ltoken) ? len : sizeof(ltoken),
-			 "%s", conf->val);
-		line = find_conf_line(dst, ltoken, '=');
+		len = p - conf->val;
+		line = conf_index_find(&idx, conf->val, len);
 		if (line != NULL) {
 			free(line->val);
 			line->val = strdup(conf->val);
-		} else
-			add_str_param(dst, conf->val);
+		} else {
+			if (add_str_param(dst, conf->val) == 0)
+				conf_index_add(&idx, list_entry(dst->prev,
+						conf_struct, list));
+		}
 		cnt++;
 	}
+	conf_index_free(&idx);
+
 	return cnt;
 }
 
@@ -2812,8 +2901,11 @@ int vps_save_config(envid_t veid, const char *path, vps_param *new_p,
 	store(old_p, new_p, &new_conf);
 	if (action != NULL)
 		mod_save_config(action, &new_conf);
-	if (vps_merge_conf(&conf, &new_conf) == 0)
-	{
+	ret = vps_merge_conf(&conf, &new_conf);
+	if (ret < 0) {
+		ret = VZ_CONFIG_SAVE_ERROR;
+		goto out;
+	} else if (ret == 0) {
 		/* Nothing to save */
 		logger(0, 0, "No changes in CT configuration, not saving");
 		ret = 0;
@@ -2923,6 +3015,28 @@ static int check_name(const char *name)
 	return 0;
 }
 
+static int replace_name_link(const char *conf, const char *link)
+{
+	char tmp[STR_SIZE];
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", link, getpid()) >=
+			(int)sizeof(tmp)) {
+		logger(-1, ENAMETOOLONG, "Unable to create link %s", link);
+		return -1;
+	}
+	unlink(tmp);
+	if (symlink(conf, tmp)) {
+		logger(-1, errno, "Unable to create link %s", tmp);
+		return -1;
+	}
+	if (rename(tmp, link)) {
+		logger(-1, errno, "Unable to move %s -> %s", tmp, link);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
 int set_name(int veid, char *new_name, char *old_name)
 {
 	int veid_old = -1;
@@ -2950,10 +3064,25 @@ int set_name(int veid, char *new_name, char *old_name)
 	if (new_name[0] != 0) {
 		snprintf(buf, sizeof(buf), VENAME_DIR "/%s", new_name);
 		get_vps_conf_path(veid, conf, sizeof(conf));
-		unlink(buf);
+		/* symlink() fails if the name exists, so a name can not
+		 * be grabbed by two containers at once. A stale or our
+		 * own link is replaced atomically.
+		 */
 		if (symlink(conf, buf)) {
-			logger(-1, errno, "Unable to create link %s", buf);
-			return VZ_SET_NAME_ERROR;
+			if (errno != EEXIST) {
+				logger(-1, errno, "Unable to create link %s",
+						buf);
+				return VZ_SET_NAME_ERROR;
+			}
+			veid_old = get_veid_by_name(new_name);
+			if (veid_old >= 0 && veid_old != veid) {
+				logger(-1, 0, "Conflict: name %s already "
+					"used by container %d",
+					new_name, veid_old);
+				return VZ_SET_NAME_ERROR;
+			}
+			if (replace_name_link(conf, buf))
+				return VZ_SET_NAME_ERROR;
 		}
 	}
 	veid_old = get_veid_by_name(old_name);
@@ -3248,6 +3377,11 @@ static void merge_cpt(cpt_param *dst, cpt_param *src)
 	MERGE_INT(ctx)
 	MERGE_INT(cpu_flags)
 	MERGE_INT(cmd)
+	MERGE_INT(compress)
+	MERGE_INT(dumpfd)
+	MERGE_INT(pre_dump_iter)
+	MERGE_INT(lazy)
+	MERGE_INT(dedup)
 }
 
 static void merge_meminfo(meminfo_param *dst, meminfo_param *src)
@@ -38,6 +38,7 @@
 #include "vzerror.h"
 #include "logger.h"
 #include "util.h"
+#include "stats.h"
 
 extern void clean_hardlink_dir(const char *mntdir) __attribute__((weak));
 void clean_hardlink_dir(const char *mntdir) {}
@@ -104,10 +105,17 @@ err:
 	return ret ? err : 0;
 }
 
+int is_stdio_dump(const char *dumpfile)
+{
+	return dumpfile != NULL && !strcmp(dumpfile, DUMPFILE_STDIO);
+}
+
 int vps_chkpnt(vps_handler *h, envid_t veid, const fs_param *fs,
 		int cmd, cpt_param *param)
 {
 	const char *root = fs->root;
+	uint64_t start = vz_stats_now();
+	int ret;
 
 	if (root == NULL) {
 		logger(-1, 0, "Container root (VE_ROOT) is not set");
@@ -119,17 +127,32 @@ int vps_chkpnt(vps_handler *h, envid_t veid, const fs_param *fs,
 		return VZ_VE_NOT_RUNNING;
 	}
 
-	return h->env_chkpnt(h, veid, fs, cmd, param);
+	/* Exec agent holds a socket bound on the host, it can not be
+	 * checkpointed (and is not needed after restore anyway) */
+	if (cmd == CMD_CHKPNT || cmd == CMD_SUSPEND)
+		vps_exec_agent_stop(veid);
+	ret = h->env_chkpnt(h, veid, fs, cmd, param);
+	if (ret == 0)
+		vz_stats_add(VZ_STAT_CHKPNT, start);
+
+	return ret;
 }
 
 int vps_restore(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 	cpt_param *param, skipFlags skip)
 {
+	uint64_t start = vz_stats_now();
+	int ret;
+
 	if (vps_is_run(h, veid)) {
 		logger(-1, 0, "Unable to perform restore: "
 			"container already running");
 		return VZ_VE_RUNNING;
 	}
 
-	return h->env_restore(h, veid, vps_p, cmd, param, skip);
+	ret = h->env_restore(h, veid, vps_p, cmd, param, skip);
+	if (ret == 0)
+		vz_stats_add(VZ_STAT_RESTORE, start);
+
+	return ret;
 }
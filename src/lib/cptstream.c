@@ -0,0 +1,994 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <pthread.h>
+#include <zlib.h>
+#endif
+
+#include "cptstream.h"
+#include "logger.h"
+
+#ifdef HAVE_ZLIB
+#define MAX_THREADS		8
+#define MAX_BLOCK		(64 * 1024 * 1024)
+/* How often blocked pipe I/O checks for abort/finish */
+#define POLL_MS			100
+
+/* Content-defined chunks: a cut is where the rolling hash has the mask
+ * bits clear, which gives 32K chunks on average.
+ */
+#define CHUNK_MIN		(8 * 1024)
+#define CHUNK_MAX		(128 * 1024)
+#define CHUNK_MASK		0xfffe000000000000ULL
+#define CHUNK_NAME_LEN		32
+
+enum {
+	SLOT_FREE,
+	SLOT_READ,	/* filled by reader */
+	SLOT_BUSY,	/* being processed by a worker */
+	SLOT_DONE,	/* ready to be written */
+};
+
+struct slot {
+	int state;
+	struct cpt_block_hdr hdr;
+	char *in;
+	char *out;
+	char *data;	/* what to write, in or out */
+	size_t len;
+	char *tmp;	/* chunk file buffer */
+	size_t shared;	/* bytes found in the chunk store */
+};
+
+struct cpt_stream {
+	int dump;
+	int level;
+	int in_fd;
+	int out_fd;
+	int pipe_fd;		/* our end of the pipe */
+	size_t block_size;
+	size_t bound;		/* max stored block size */
+	char *chunk_dir;	/* this dump chunks */
+	char *store_dir;	/* shared chunk store */
+	size_t tmp_size;
+	int nslots;
+	struct slot *slots;
+	unsigned long next_read;
+	unsigned long next_work;
+	unsigned long next_write;
+	int eof;
+	volatile int finish;
+	volatile int abort;
+	int err;
+	uint64_t total;		/* raw bytes processed */
+	uint64_t shared;	/* raw bytes found in the chunk store */
+	uint64_t expect;	/* raw bytes according to the trailer */
+	int trailer;
+	int feed;		/* restore: kernel still reads the pipe */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t reader;
+	pthread_t writer;
+	pthread_t *workers;
+	int nworkers;
+	int has_reader;
+	int has_writer;
+	int nstarted;		/* workers started */
+};
+
+static void stream_fail(struct cpt_stream *s, int err, const char *msg)
+{
+	pthread_mutex_lock(&s->lock);
+	if (!s->err && !s->abort) {
+		logger(-1, err, "Dump stream: %s", msg);
+		s->err = -1;
+	}
+	s->abort = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Read up to len bytes. Input is polled, so that the reader notices
+ * abort even on a stalled pipe, and an empty dump pipe is EOF once the
+ * kernel is done with it.
+ */
+static ssize_t stream_read(struct cpt_stream *s, int fd, char *buf, size_t len)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len && !s->abort) {
+		n = poll(&pfd, 1, POLL_MS);
+		if (n == 0 && s->finish && s->dump)
+			break;
+		if (n == 0 || (n < 0 && errno == EINTR))
+			continue;
+		n = read(fd, buf + done, len - done);
+		if (n > 0) {
+			done += n;
+			continue;
+		}
+		if (n == 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			return -1;
+	}
+
+	return done;
+}
+
+static int stream_write(struct cpt_stream *s, int fd, const char *buf,
+		size_t len)
+{
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	ssize_t n;
+
+	while (len > 0) {
+		/* On restore, the kernel is not reading any more */
+		if (s->abort || (s->finish && !s->dump))
+			return -1;
+		n = write(fd, buf, len);
+		if (n > 0) {
+			buf += n;
+			len -= n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN) {
+			poll(&pfd, 1, POLL_MS);
+			continue;
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Fill a slot with the next block; returns 0 at the end of data */
+static int read_block(struct cpt_stream *s, struct slot *sl)
+{
+	ssize_t n;
+
+	if (s->dump) {
+		n = stream_read(s, s->in_fd, sl->in, s->block_size);
+		if (n < 0) {
+			stream_fail(s, errno, "read error");
+			return -1;
+		}
+		sl->hdr.len = n;
+		return n > 0;
+	}
+	n = stream_read(s, s->in_fd, (char *)&sl->hdr, sizeof(sl->hdr));
+	if (n != sizeof(sl->hdr)) {
+		stream_fail(s, n < 0 ? errno : 0,
+				n < 0 ? "read error" : "dump is truncated");
+		return -1;
+	}
+	if (sl->hdr.len == 0) {
+		/* Trailer */
+		if (sl->hdr.clen != sizeof(s->expect) ||
+				stream_read(s, s->in_fd, (char *)&s->expect,
+					sizeof(s->expect)) != sizeof(s->expect)) {
+			stream_fail(s, 0, "bad trailer");
+			return -1;
+		}
+		s->trailer = 1;
+		return 0;
+	}
+	if (sl->hdr.len > s->block_size || sl->hdr.clen > s->bound) {
+		stream_fail(s, 0, "bad block header");
+		return -1;
+	}
+	n = stream_read(s, s->in_fd, sl->in, sl->hdr.clen);
+	if (n != (ssize_t)sl->hdr.clen) {
+		stream_fail(s, n < 0 ? errno : 0,
+				n < 0 ? "read error" : "dump is truncated");
+		return -1;
+	}
+
+	return 1;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct cpt_stream *s = arg;
+	struct slot *sl;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		sl = &s->slots[s->next_read % s->nslots];
+		while (sl->state != SLOT_FREE && !s->abort)
+			pthread_cond_wait(&s->cond, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+		if (s->abort)
+			break;
+		/* A free slot is only touched by the reader */
+		ret = read_block(s, sl);
+		pthread_mutex_lock(&s->lock);
+		if (ret > 0) {
+			sl->state = SLOT_READ;
+			s->next_read++;
+		} else {
+			s->eof = 1;
+		}
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		if (ret <= 0)
+			break;
+	}
+	/* Do not let the kernel block on a full pipe if we failed */
+	if (s->dump) {
+		close(s->pipe_fd);
+		s->pipe_fd = -1;
+	}
+
+	return NULL;
+}
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* The table must be the same for every dump, or no chunk would match */
+static void gear_init(void)
+{
+	uint64_t x = 0x5643505443484e4bULL, z;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* Returns the length of the next chunk */
+static size_t cut_chunk(const unsigned char *p, size_t len)
+{
+	uint64_t h = 0;
+	size_t i;
+
+	if (len <= CHUNK_MIN)
+		return len;
+	if (len > CHUNK_MAX)
+		len = CHUNK_MAX;
+	for (i = CHUNK_MIN; i < len; i++) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h & CHUNK_MASK))
+			return i + 1;
+	}
+
+	return len;
+}
+
+/* Only used to name chunks: a match is always verified byte by byte */
+static uint64_t chunk_hash(const char *p, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL, w;
+	size_t i;
+
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		h = (h ^ w) * 0x100000001b3ULL;
+	}
+	for (; i < len; i++)
+		h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+	h ^= len;
+	h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+	h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+
+	return h ^ (h >> 33);
+}
+
+static void chunk_name(const struct cpt_chunk_ref *ref, char *name)
+{
+	snprintf(name, CHUNK_NAME_LEN, "%016llx-%x",
+			(unsigned long long)ref->hash, ref->len);
+}
+
+static int read_full(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Read a chunk file into dst (ref->len bytes), using buf for
+ * compressed data. Returns 0 on success, -1 with errno set if the file
+ * can not be read, 1 if its contents do not match ref.
+ */
+static int read_chunk(const char *path, const struct cpt_chunk_ref *ref,
+		char *buf, size_t size, char *dst)
+{
+	struct cpt_block_hdr hdr;
+	uLongf len = ref->len;
+	int fd, ret;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	ret = read_full(fd, (char *)&hdr, sizeof(hdr));
+	if (ret == 0 && (hdr.len != ref->len || hdr.clen > size))
+		ret = 1;
+	if (ret == 0 && read_full(fd, buf, hdr.clen))
+		ret = -1;
+	close(fd);
+	if (ret)
+		return ret;
+	if (hdr.flags & CPT_BLOCK_ZLIB) {
+		if (uncompress((Bytef *)dst, &len, (Bytef *)buf,
+					hdr.clen) != Z_OK || len != ref->len)
+			return 1;
+	} else {
+		if (hdr.clen != ref->len)
+			return 1;
+		memcpy(dst, buf, hdr.clen);
+	}
+	if (crc32(0, (Bytef *)dst, ref->len) != hdr.crc)
+		return 1;
+
+	return 0;
+}
+
+/* Returns 1 if a chunk file has the given data, 0 if not, -1 if there
+ * is no such file.
+ */
+static int same_chunk(struct cpt_stream *s, struct slot *sl,
+		const char *path, const struct cpt_chunk_ref *ref,
+		const char *data)
+{
+	char *buf = sl->tmp + CHUNK_MAX;
+	int ret;
+
+	ret = read_chunk(path, ref, buf, s->tmp_size - CHUNK_MAX, sl->tmp);
+	if (ret < 0)
+		return errno == ENOENT ? -1 : 0;
+
+	return ret == 0 && !memcmp(sl->tmp, data, ref->len);
+}
+
+static int write_chunk(struct cpt_stream *s, struct slot *sl,
+		const char *path, const struct cpt_chunk_ref *ref,
+		const char *data)
+{
+	struct cpt_block_hdr *hdr = (struct cpt_block_hdr *)sl->tmp;
+	char *buf = sl->tmp + sizeof(*hdr);
+	uLongf clen = s->tmp_size - sizeof(*hdr);
+	int fd, ret;
+
+	hdr->len = ref->len;
+	hdr->crc = crc32(0, (const Bytef *)data, ref->len);
+	if (s->level > 0 && compress2((Bytef *)buf, &clen, (const Bytef *)data,
+				ref->len, s->level) == Z_OK &&
+			clen < ref->len) {
+		hdr->flags = CPT_BLOCK_ZLIB;
+		hdr->clen = clen;
+	} else {
+		hdr->flags = 0;
+		hdr->clen = ref->len;
+		memcpy(buf, data, ref->len);
+	}
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0600)) < 0)
+		return -1;
+	ret = stream_write(s, fd, sl->tmp, sizeof(*hdr) + hdr->clen);
+	if (close(fd))
+		ret = -1;
+	if (ret)
+		unlink(path);
+
+	return ret;
+}
+
+/* Make sure the dump chunk directory has the chunk, linking it from
+ * the store if it is there, and adding it to the store otherwise.
+ * Returns -1 if the chunk can not be saved.
+ */
+static int store_chunk(struct cpt_stream *s, struct slot *sl,
+		const struct cpt_chunk_ref *ref, const char *data)
+{
+	char name[CHUNK_NAME_LEN];
+	char path[PATH_MAX], store[PATH_MAX];
+	int ret;
+
+	chunk_name(ref, name);
+	snprintf(path, sizeof(path), "%s/%s", s->chunk_dir, name);
+	snprintf(store, sizeof(store), "%s/%.2s/%s", s->store_dir, name, name);
+
+	/* Repeated within this dump */
+	if ((ret = same_chunk(s, sl, path, ref, data)) >= 0)
+		return ret ? 0 : -1;
+
+	if ((ret = same_chunk(s, sl, store, ref, data)) == 1) {
+		if (link(store, path) == 0) {
+			sl->shared += ref->len;
+			return 0;
+		}
+		if (errno == EEXIST)
+			return same_chunk(s, sl, path, ref, data) == 1 ? 0 : -1;
+		/* Gone meanwhile, or too many links: keep our own copy */
+	}
+	if (write_chunk(s, sl, path, ref, data)) {
+		if (errno == EEXIST)
+			return same_chunk(s, sl, path, ref, data) == 1 ? 0 : -1;
+		return -1;
+	}
+	/* A different chunk with the same name is left alone */
+	if (ret == -1) {
+		snprintf(store, sizeof(store), "%s/%.2s", s->store_dir, name);
+		mkdir(store, 0700);
+		snprintf(store, sizeof(store), "%s/%.2s/%s",
+				s->store_dir, name, name);
+		link(path, store);
+	}
+
+	return 0;
+}
+
+/* Store block data as chunks; returns -1 to store it as is */
+static int dedup_block(struct cpt_stream *s, struct slot *sl)
+{
+	struct cpt_chunk_ref *ref = (struct cpt_chunk_ref *)sl->out;
+	size_t off, len, n;
+
+	sl->shared = 0;
+	for (off = n = 0; off < sl->hdr.len; off += len, n++) {
+		len = cut_chunk((unsigned char *)sl->in + off,
+				sl->hdr.len - off);
+		ref[n].hash = chunk_hash(sl->in + off, len);
+		ref[n].len = len;
+		ref[n].pad = 0;
+		if (store_chunk(s, sl, &ref[n], sl->in + off))
+			return -1;
+	}
+	sl->hdr.flags = CPT_BLOCK_CHUNKS;
+	sl->hdr.clen = n * sizeof(*ref);
+	sl->data = sl->out;
+	sl->len = sl->hdr.clen;
+
+	return 0;
+}
+
+/* Assemble block data from the chunks it refers to */
+static int load_chunks(struct cpt_stream *s, struct slot *sl)
+{
+	const struct cpt_chunk_ref *ref = (struct cpt_chunk_ref *)sl->in;
+	char name[CHUNK_NAME_LEN];
+	char path[PATH_MAX];
+	size_t off = 0, i, n;
+	int ret;
+
+	if (s->chunk_dir == NULL) {
+		stream_fail(s, 0, "no chunk directory for a deduplicated dump");
+		return -1;
+	}
+	n = sl->hdr.clen / sizeof(*ref);
+	if (sl->hdr.clen % sizeof(*ref)) {
+		stream_fail(s, 0, "corrupted block");
+		return -1;
+	}
+	for (i = 0; i < n; off += ref[i].len, i++) {
+		if (ref[i].len > CHUNK_MAX ||
+				ref[i].len > sl->hdr.len - off) {
+			stream_fail(s, 0, "corrupted block");
+			return -1;
+		}
+		chunk_name(&ref[i], name);
+		snprintf(path, sizeof(path), "%s/%s", s->chunk_dir, name);
+		ret = read_chunk(path, &ref[i], sl->tmp, s->tmp_size,
+				sl->out + off);
+		if (ret) {
+			snprintf(path, sizeof(path), "%s chunk %s",
+					ret < 0 ? "missing" : "corrupted", name);
+			stream_fail(s, ret < 0 ? errno : 0, path);
+			return -1;
+		}
+	}
+	if (off != sl->hdr.len) {
+		stream_fail(s, 0, "corrupted block");
+		return -1;
+	}
+	sl->data = sl->out;
+
+	return 0;
+}
+
+static int compress_block(struct cpt_stream *s, struct slot *sl)
+{
+	uLongf clen = s->bound;
+
+	sl->hdr.crc = crc32(0, (Bytef *)sl->in, sl->hdr.len);
+	if (s->chunk_dir != NULL && dedup_block(s, sl) == 0)
+		return 0;
+	sl->shared = 0;
+	if (s->level > 0 && compress2((Bytef *)sl->out, &clen, (Bytef *)sl->in,
+				sl->hdr.len, s->level) == Z_OK &&
+			clen < sl->hdr.len) {
+		sl->hdr.flags = CPT_BLOCK_ZLIB;
+		sl->hdr.clen = clen;
+		sl->data = sl->out;
+	} else {
+		/* Incompressible, store as is */
+		sl->hdr.flags = 0;
+		sl->hdr.clen = sl->hdr.len;
+		sl->data = sl->in;
+	}
+	sl->len = sl->hdr.clen;
+
+	return 0;
+}
+
+static int decompress_block(struct cpt_stream *s, struct slot *sl)
+{
+	uLongf len = s->block_size;
+
+	if (sl->hdr.flags & CPT_BLOCK_CHUNKS) {
+		if (load_chunks(s, sl))
+			return -1;
+	} else if (sl->hdr.flags & CPT_BLOCK_ZLIB) {
+		if (uncompress((Bytef *)sl->out, &len, (Bytef *)sl->in,
+					sl->hdr.clen) != Z_OK ||
+				len != sl->hdr.len) {
+			stream_fail(s, 0, "corrupted block");
+			return -1;
+		}
+		sl->data = sl->out;
+	} else {
+		if (sl->hdr.clen != sl->hdr.len) {
+			stream_fail(s, 0, "corrupted block");
+			return -1;
+		}
+		sl->data = sl->in;
+	}
+	sl->len = sl->hdr.len;
+	if (crc32(0, (Bytef *)sl->data, sl->len) != sl->hdr.crc) {
+		stream_fail(s, 0, "checksum mismatch");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct cpt_stream *s = arg;
+	struct slot *sl;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (s->next_work == s->next_read && !s->eof && !s->abort)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->abort || s->next_work == s->next_read) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		sl = &s->slots[s->next_work++ % s->nslots];
+		sl->state = SLOT_BUSY;
+		pthread_mutex_unlock(&s->lock);
+
+		if ((s->dump ? compress_block(s, sl) :
+					decompress_block(s, sl)))
+			break;
+
+		pthread_mutex_lock(&s->lock);
+		sl->state = SLOT_DONE;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return NULL;
+}
+
+static void write_trailer(struct cpt_stream *s)
+{
+	struct cpt_block_hdr hdr;
+
+	if (!s->dump) {
+		if (!s->trailer || s->expect != s->total)
+			stream_fail(s, 0, "dump is truncated");
+		return;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.clen = sizeof(s->total);
+	if (stream_write(s, s->out_fd, (char *)&hdr, sizeof(hdr)) ||
+			stream_write(s, s->out_fd, (char *)&s->total,
+				sizeof(s->total)))
+		stream_fail(s, errno, "write error");
+}
+
+static void *writer_thread(void *arg)
+{
+	struct cpt_stream *s = arg;
+	struct slot *sl;
+	sigset_t mask;
+	int ret;
+
+	/* Get EPIPE rather than being killed if the reader goes away */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		sl = &s->slots[s->next_write % s->nslots];
+		while (sl->state != SLOT_DONE && !s->abort &&
+				!(s->eof && s->next_write == s->next_read))
+			pthread_cond_wait(&s->cond, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+		if (s->abort || sl->state != SLOT_DONE)
+			break;
+		if (s->dump)
+			ret = stream_write(s, s->out_fd, (char *)&sl->hdr,
+					sizeof(sl->hdr)) ||
+				stream_write(s, s->out_fd, sl->data, sl->len);
+		else
+			ret = s->feed &&
+				stream_write(s, s->out_fd, sl->data, sl->len);
+		if (ret && (s->dump || s->abort)) {
+			stream_fail(s, errno, "write error");
+			break;
+		}
+		/* On restore, the kernel stops reading once it has all it
+		 * needs (or has failed, which the restore reports), but
+		 * the rest of the dump is still verified */
+		if (ret)
+			s->feed = 0;
+		s->total += sl->hdr.len;
+		s->shared += sl->shared;
+
+		pthread_mutex_lock(&s->lock);
+		sl->state = SLOT_FREE;
+		s->next_write++;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+	if (!s->abort)
+		write_trailer(s);
+	/* The kernel gets EOF instead of waiting for more data */
+	if (!s->dump) {
+		close(s->pipe_fd);
+		s->pipe_fd = -1;
+	}
+
+	return NULL;
+}
+
+static void free_stream(struct cpt_stream *s)
+{
+	int i;
+
+	if (s->slots != NULL) {
+		for (i = 0; i < s->nslots; i++) {
+			free(s->slots[i].in);
+			free(s->slots[i].out);
+			free(s->slots[i].tmp);
+		}
+		free(s->slots);
+	}
+	free(s->workers);
+	free(s->chunk_dir);
+	free(s->store_dir);
+	if (s->pipe_fd != -1)
+		close(s->pipe_fd);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+}
+
+void cpt_stream_close_fds(struct cpt_stream *s)
+{
+	if (s->pipe_fd != -1)
+		close(s->pipe_fd);
+}
+#endif /* HAVE_ZLIB */
+
+int is_cpt_stream(int fd)
+{
+	char magic[sizeof(CPT_STREAM_MAGIC) - 1];
+
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		return 0;
+
+	return !memcmp(magic, CPT_STREAM_MAGIC, sizeof(magic));
+}
+
+static void chunk_dirs(const char *dumpfile, char *dir, char *store,
+		size_t size)
+{
+	const char *p;
+
+	snprintf(dir, size, "%s" CPT_CHUNK_SUFFIX, dumpfile);
+	p = strrchr(dumpfile, '/');
+	if (p == NULL)
+		snprintf(store, size, CPT_CHUNK_STORE);
+	else
+		snprintf(store, size, "%.*s/" CPT_CHUNK_STORE,
+				(int)(p - dumpfile), dumpfile);
+}
+
+int cpt_chunks_remove(const char *dumpfile)
+{
+	char dir[PATH_MAX], store[PATH_MAX], path[PATH_MAX];
+	struct dirent *ent;
+	struct stat st;
+	DIR *dp;
+	int ret = 0;
+
+	chunk_dirs(dumpfile, dir, store, sizeof(dir));
+	if ((dp = opendir(dir)) == NULL)
+		return errno == ENOENT ? 0 : -1;
+	logger(1, 0, "Removing dump chunks %s", dir);
+	while ((ent = readdir(dp)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >=
+				(int)sizeof(path)) {
+			logger(-1, ENAMETOOLONG, "Unable to remove %s/%s",
+					dir, ent->d_name);
+			ret = -1;
+			continue;
+		}
+		if (unlink(path)) {
+			logger(-1, errno, "Unable to remove %s", path);
+			ret = -1;
+			continue;
+		}
+		/* No links left but the store one: nobody else uses it.
+		 * If a dump links it right now, it still has its own link.
+		 */
+		if (snprintf(path, sizeof(path), "%s/%.2s/%s",
+				store, ent->d_name, ent->d_name) >=
+					(int)sizeof(path))
+			continue;
+		if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+				st.st_nlink == 1)
+			unlink(path);
+	}
+	closedir(dp);
+	if (rmdir(dir) && errno != ENOENT) {
+		logger(-1, errno, "Unable to remove %s", dir);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+#ifdef HAVE_ZLIB
+/* Set up an empty chunk directory for a new dump */
+static int open_chunks(struct cpt_stream *s, const char *dumpfile)
+{
+	char dir[PATH_MAX], store[PATH_MAX];
+
+	chunk_dirs(dumpfile, dir, store, sizeof(dir));
+	if (s->dump) {
+		if (cpt_chunks_remove(dumpfile))
+			return -1;
+		if (mkdir(dir, 0700)) {
+			logger(-1, errno, "Unable to create %s", dir);
+			return -1;
+		}
+		if (mkdir(store, 0700) && errno != EEXIST) {
+			logger(-1, errno, "Unable to create %s", store);
+			return -1;
+		}
+	}
+	s->chunk_dir = strdup(dir);
+	s->store_dir = strdup(store);
+	if (s->chunk_dir == NULL || s->store_dir == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate dump stream");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct cpt_stream *cpt_stream_open(int dump, int fd, int level,
+		const char *chunks, int *pipe_fd)
+{
+	struct cpt_stream *s;
+	struct cpt_stream_hdr hdr;
+	int p[2], i;
+	long ncpu;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate dump stream");
+		return NULL;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->dump = dump;
+	s->level = level;
+	s->pipe_fd = -1;
+	s->block_size = CPT_STREAM_BLOCK;
+	memset(&hdr, 0, sizeof(hdr));
+	if (dump) {
+		if (chunks != NULL) {
+			pthread_once(&gear_once, gear_init);
+			if (open_chunks(s, chunks))
+				goto err;
+			hdr.flags |= CPT_STREAM_CHUNKS;
+		}
+		memcpy(hdr.magic, CPT_STREAM_MAGIC, sizeof(hdr.magic));
+		hdr.block_size = s->block_size;
+		if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+			logger(-1, errno, "Unable to write dump header");
+			goto err;
+		}
+	} else {
+		if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+				memcmp(hdr.magic, CPT_STREAM_MAGIC,
+					sizeof(hdr.magic)) ||
+				hdr.block_size == 0 ||
+				hdr.block_size > MAX_BLOCK) {
+			logger(-1, errno, "Invalid dump stream header");
+			goto err;
+		}
+		s->block_size = hdr.block_size;
+		if (hdr.flags & CPT_STREAM_CHUNKS) {
+			if (chunks == NULL) {
+				logger(-1, 0, "The dump is deduplicated, "
+						"it can only be read from "
+						"a file along with its "
+						"chunk directory");
+				goto err;
+			}
+			if (open_chunks(s, chunks))
+				goto err;
+		}
+	}
+	s->bound = compressBound(s->block_size);
+	if (s->chunk_dir != NULL)
+		s->tmp_size = CHUNK_MAX + sizeof(struct cpt_block_hdr) +
+			compressBound(CHUNK_MAX);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	s->nworkers = ncpu < 1 ? 1 : ncpu > MAX_THREADS ? MAX_THREADS : ncpu;
+	s->nslots = 2 * s->nworkers + 2;
+	s->slots = calloc(s->nslots, sizeof(*s->slots));
+	s->workers = calloc(s->nworkers, sizeof(*s->workers));
+	if (s->slots == NULL || s->workers == NULL)
+		goto err_nomem;
+	for (i = 0; i < s->nslots; i++) {
+		s->slots[i].in = malloc(s->bound);
+		s->slots[i].out = malloc(s->bound);
+		if (s->slots[i].in == NULL || s->slots[i].out == NULL)
+			goto err_nomem;
+		if (s->tmp_size &&
+				(s->slots[i].tmp = malloc(s->tmp_size)) == NULL)
+			goto err_nomem;
+	}
+
+	if (pipe2(p, O_CLOEXEC)) {
+		logger(-1, errno, "Unable to create pipe");
+		goto err;
+	}
+	/* Bigger pipe means fewer context switches for the kernel side */
+	fcntl(p[0], F_SETPIPE_SZ, CPT_STREAM_BLOCK);
+	if (dump) {
+		s->in_fd = s->pipe_fd = p[0];
+		s->out_fd = fd;
+		*pipe_fd = p[1];
+	} else {
+		s->in_fd = fd;
+		s->out_fd = s->pipe_fd = p[1];
+		*pipe_fd = p[0];
+		s->feed = 1;
+	}
+	fcntl(s->pipe_fd, F_SETFL, O_NONBLOCK);
+
+	if (pthread_create(&s->reader, NULL, reader_thread, s))
+		goto err_thread;
+	s->has_reader = 1;
+	if (pthread_create(&s->writer, NULL, writer_thread, s))
+		goto err_thread;
+	s->has_writer = 1;
+	for (; s->nstarted < s->nworkers; s->nstarted++)
+		if (pthread_create(&s->workers[s->nstarted], NULL,
+					worker_thread, s))
+			goto err_thread;
+
+	return s;
+
+err_thread:
+	logger(-1, 0, "Unable to start dump stream threads");
+	close(*pipe_fd);
+	cpt_stream_close(s, 1);
+	return NULL;
+err_nomem:
+	logger(-1, ENOMEM, "Unable to allocate dump stream buffers");
+err:
+	free_stream(s);
+	return NULL;
+}
+
+int cpt_stream_close(struct cpt_stream *s, int abort)
+{
+	int i, ret;
+
+	pthread_mutex_lock(&s->lock);
+	/* The kernel is done, an empty pipe is the end of the dump */
+	s->finish = 1;
+	if (abort)
+		s->abort = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	if (s->has_reader)
+		pthread_join(s->reader, NULL);
+	if (s->has_writer)
+		pthread_join(s->writer, NULL);
+	for (i = 0; i < s->nstarted; i++)
+		pthread_join(s->workers[i], NULL);
+	ret = s->err;
+	/* Chunk files are not synced by the caller with the dump file */
+	if (ret == 0 && !abort && s->dump && s->chunk_dir != NULL &&
+			syncfs(s->out_fd)) {
+		logger(-1, errno, "Dump stream: unable to sync chunks");
+		ret = -1;
+	}
+	if (ret == 0 && !abort && s->dump)
+		logger(1, 0, "Dump stream: %llu bytes written",
+				(unsigned long long)s->total);
+	if (ret == 0 && !abort && s->dump && s->chunk_dir != NULL)
+		logger(1, 0, "Dump stream: %llu bytes found in chunk store",
+				(unsigned long long)s->shared);
+	free_stream(s);
+
+	return ret;
+}
+#else /* HAVE_ZLIB */
+struct cpt_stream *cpt_stream_open(int dump, int fd, int level,
+		const char *chunks, int *pipe_fd)
+{
+	logger(-1, 0, "Compressed, streamed and deduplicated dumps "
+			"are not supported (vzctl is built without zlib)");
+	return NULL;
+}
+
+int cpt_stream_close(struct cpt_stream *s, int abort)
+{
+	return 0;
+}
+
+void cpt_stream_close_fds(struct cpt_stream *s)
+{
+}
+#endif /* HAVE_ZLIB */
@@ -39,6 +39,9 @@
 #include "create.h"
 #include "env.h"
 #include "image.h"
+#include "vps_configure.h"
+#include "cptstream.h"
+#include "exec.h"
 
 #define BACKUP		0
 #define DESTR		1
@@ -239,6 +242,9 @@ int destroy_dump(envid_t veid, const char *dumpdir)
 	char buf[128];
 
 	get_dump_file(veid, dumpdir, buf, sizeof(buf));
+	/* Drop our references to the chunk store, if any */
+	if (cpt_chunks_remove(buf))
+		return -1;
 	if (stat_file(buf) == 0)
 		return 0;
 
@@ -281,6 +287,9 @@ int vps_destroy(vps_handler *h, envid_t veid, fs_param *fs, cpt_param *cpt)
 #endif
 	ret = vps_destroy_dir(veid, fs->private, fs->layout);
 	move_config(veid, BACKUP);
+	vps_config_fp_remove(veid);
+	/* Removes a stale exec agent socket */
+	vps_exec_agent_stop(veid);
 	if (destroy_dump(veid, cpt != NULL ? cpt->dumpdir : NULL) < 0)
 		logger(-1, errno, "Warning: failed to remove dump file");
 	if (rmdir(fs->root) < 0)
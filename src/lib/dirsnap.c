@@ -0,0 +1,564 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dirsnap.h"
+#include "logger.h"
+
+#define MAX_THREADS		16
+/* A file changed that close to (or after) the snapshot start might
+ * have been changed again without a visible timestamp change, as file
+ * times have a coarse granularity. Such files are always sent again.
+ */
+#define RACY_SEC		2
+
+/* dir_snap.seen[] values */
+enum {
+	NOT_SEEN,
+	SEEN,
+	SEEN_DIR,	/* seen, and is a directory now */
+};
+
+struct ds_entry {
+	char *path;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	nlink_t nlink;
+	ino_t ino;
+	dev_t rdev;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+};
+
+struct dir_snap {
+	struct ds_entry *e;	/* sorted by path */
+	int n;
+	time_t start;		/* when the snapshot was started */
+	unsigned char *seen;	/* used by diff */
+};
+
+/* Growable array */
+struct vec {
+	void *a;
+	int n;
+	int size;
+};
+
+static void *vec_add(struct vec *v, size_t elsize)
+{
+	void *p;
+	int size;
+
+	if (v->n == v->size) {
+		size = v->size ? v->size * 2 : 256;
+		if ((p = realloc(v->a, size * elsize)) == NULL)
+			return NULL;
+		v->a = p;
+		v->size = size;
+	}
+	p = (char *)v->a + v->n++ * elsize;
+	memset(p, 0, elsize);
+
+	return p;
+}
+
+struct walker;
+
+struct walk_thread {
+	struct walker *w;
+	pthread_t tid;
+	struct vec out;		/* ds_entry (snapshot) or dir_change (diff) */
+};
+
+struct walker {
+	const char *root;
+	int rootfd;
+	int (*visit)(struct walk_thread *t, const char *path, struct stat *st);
+	struct dir_snap *snap;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct vec queue;	/* directories to read, char * */
+	int busy;		/* threads reading a directory */
+	int err;
+};
+
+static int push_dir(struct walker *w, const char *path)
+{
+	char **p, *dir;
+
+	if ((dir = strdup(path)) == NULL)
+		goto err;
+	pthread_mutex_lock(&w->lock);
+	if ((p = vec_add(&w->queue, sizeof(char *))) != NULL) {
+		*p = dir;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (p != NULL)
+		return 0;
+	free(dir);
+err:
+	logger(-1, ENOMEM, "Unable to walk %s", w->root);
+	return -1;
+}
+
+static int read_dir(struct walk_thread *t, const char *dir)
+{
+	struct walker *w = t->w;
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	DIR *dp;
+	size_t len;
+	int fd, ret = 0;
+
+	fd = openat(w->rootfd, *dir ? dir : ".",
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		/* Removed or replaced while we were walking */
+		if (errno == ENOENT || errno == ENOTDIR || errno == ELOOP)
+			return 0;
+		logger(-1, errno, "Unable to open %s/%s", w->root, dir);
+		return -1;
+	}
+	if ((dp = fdopendir(fd)) == NULL) {
+		logger(-1, errno, "Unable to open %s/%s", w->root, dir);
+		close(fd);
+		return -1;
+	}
+	while (!w->err) {
+		errno = 0;
+		if ((de = readdir(dp)) == NULL) {
+			if (errno) {
+				logger(-1, errno, "Unable to read %s/%s",
+						w->root, dir);
+				ret = -1;
+			}
+			break;
+		}
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		len = snprintf(path, sizeof(path), "%s%s%s", dir,
+				*dir ? "/" : "", de->d_name);
+		if (len >= sizeof(path)) {
+			logger(-1, ENAMETOOLONG, "Unable to walk %s/%s",
+					w->root, dir);
+			ret = -1;
+			break;
+		}
+		if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			if (errno == ENOENT)
+				continue;
+			logger(-1, errno, "Unable to stat %s/%s",
+					w->root, path);
+			ret = -1;
+			break;
+		}
+		if (w->visit(t, path, &st) ||
+				(S_ISDIR(st.st_mode) && push_dir(w, path)))
+		{
+			ret = -1;
+			break;
+		}
+	}
+	closedir(dp);
+
+	return ret;
+}
+
+static void *walk_thread(void *arg)
+{
+	struct walk_thread *t = arg;
+	struct walker *w = t->w;
+	char *dir;
+	int ret;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->queue.n == 0 && w->busy > 0 && !w->err)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->queue.n == 0 || w->err)
+			break;
+		dir = ((char **)w->queue.a)[--w->queue.n];
+		w->busy++;
+		pthread_mutex_unlock(&w->lock);
+
+		ret = read_dir(t, dir);
+		free(dir);
+
+		pthread_mutex_lock(&w->lock);
+		w->busy--;
+		if (ret)
+			w->err = -1;
+		if (w->busy == 0 || w->err)
+			pthread_cond_broadcast(&w->cond);
+	}
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+/* Walk the tree on nthreads threads (including the caller), calling
+ * w->visit() for every entry. Per-thread results are merged into out.
+ */
+static int walk(struct walker *w, int nthreads, size_t elsize,
+		struct vec *out)
+{
+	struct walk_thread *t;
+	int i, n, started = 1;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	else if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+	if ((t = calloc(nthreads, sizeof(*t))) == NULL) {
+		logger(-1, ENOMEM, "Unable to walk %s", w->root);
+		return -1;
+	}
+	w->rootfd = open(w->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (w->rootfd < 0) {
+		logger(-1, errno, "Unable to open %s", w->root);
+		free(t);
+		return -1;
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->err = push_dir(w, "");
+
+	for (i = 0; i < nthreads; i++)
+		t[i].w = w;
+	/* Fewer threads is not a reason to fail */
+	for (; started < nthreads; started++)
+		if (pthread_create(&t[started].tid, NULL, walk_thread,
+					&t[started]))
+			break;
+	walk_thread(&t[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(t[i].tid, NULL);
+
+	for (i = 0, n = 0; i < started; i++)
+		n += t[i].out.n;
+	memset(out, 0, sizeof(*out));
+	if (n > 0 && (out->a = malloc(n * elsize)) == NULL) {
+		logger(-1, ENOMEM, "Unable to walk %s", w->root);
+		w->err = -1;
+	}
+	for (i = 0; i < started; i++) {
+		if (out->a != NULL) {
+			memcpy((char *)out->a + out->n * elsize, t[i].out.a,
+					t[i].out.n * elsize);
+			out->n += t[i].out.n;
+		}
+		free(t[i].out.a);
+	}
+	out->size = out->n;
+
+	for (i = 0; i < w->queue.n; i++)
+		free(((char **)w->queue.a)[i]);
+	free(w->queue.a);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	close(w->rootfd);
+	free(t);
+
+	return w->err;
+}
+
+static int snap_visit(struct walk_thread *t, const char *path,
+		struct stat *st)
+{
+	struct ds_entry *e;
+
+	if ((e = vec_add(&t->out, sizeof(*e))) == NULL ||
+			(e->path = strdup(path)) == NULL)
+	{
+		logger(-1, ENOMEM, "Unable to take a snapshot of %s",
+				t->w->root);
+		return -1;
+	}
+	e->mode = st->st_mode;
+	e->uid = st->st_uid;
+	e->gid = st->st_gid;
+	e->nlink = st->st_nlink;
+	e->ino = st->st_ino;
+	e->rdev = st->st_rdev;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim;
+	e->ctime = st->st_ctim;
+
+	return 0;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct ds_entry *)a)->path,
+			((const struct ds_entry *)b)->path);
+}
+
+static int change_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct dir_change *)a)->path,
+			((const struct dir_change *)b)->path);
+}
+
+static int path_cmp(const void *key, const void *e)
+{
+	return strcmp(key, ((const struct ds_entry *)e)->path);
+}
+
+static struct ds_entry *snap_find(struct dir_snap *s, const char *path)
+{
+	return bsearch(path, s->e, s->n, sizeof(*s->e), path_cmp);
+}
+
+static void free_entries(struct ds_entry *e, int n)
+{
+	int i;
+
+	if (e == NULL)
+		return;
+	for (i = 0; i < n; i++)
+		free(e[i].path);
+	free(e);
+}
+
+struct dir_snap *dir_snap_take(const char *root, int nthreads)
+{
+	struct walker w = {
+		.root = root,
+		.visit = snap_visit,
+	};
+	struct dir_snap *s;
+	struct vec v;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+		logger(-1, ENOMEM, "Unable to take a snapshot of %s", root);
+		return NULL;
+	}
+	s->start = time(NULL);
+	if (walk(&w, nthreads, sizeof(struct ds_entry), &v)) {
+		free_entries(v.a, v.n);
+		free(s);
+		return NULL;
+	}
+	s->e = v.a;
+	s->n = v.n;
+	qsort(s->e, s->n, sizeof(*s->e), entry_cmp);
+
+	return s;
+}
+
+int dir_snap_size(struct dir_snap *s)
+{
+	return s->n;
+}
+
+void dir_snap_free(struct dir_snap *s)
+{
+	if (s == NULL)
+		return;
+	free_entries(s->e, s->n);
+	free(s->seen);
+	free(s);
+}
+
+static int is_changed(struct dir_snap *s, struct ds_entry *e,
+		struct stat *st)
+{
+	return e->mode != st->st_mode ||
+		e->uid != st->st_uid ||
+		e->gid != st->st_gid ||
+		e->nlink != st->st_nlink ||
+		e->ino != st->st_ino ||
+		e->rdev != st->st_rdev ||
+		e->size != st->st_size ||
+		e->mtime.tv_sec != st->st_mtim.tv_sec ||
+		e->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+		e->ctime.tv_sec != st->st_ctim.tv_sec ||
+		e->ctime.tv_nsec != st->st_ctim.tv_nsec ||
+		e->ctime.tv_sec >= s->start - RACY_SEC;
+}
+
+static int add_change(struct vec *v, const char *path, int type, off_t size)
+{
+	struct dir_change *c;
+
+	if ((c = vec_add(v, sizeof(*c))) == NULL ||
+			(c->path = strdup(path)) == NULL)
+	{
+		logger(-1, ENOMEM, "Unable to compare snapshot");
+		return -1;
+	}
+	c->type = type;
+	c->size = size;
+
+	return 0;
+}
+
+/* Add the parent of a changed entry, as its times are changed
+ * by the copy of the entry. The root is not needed.
+ */
+static int add_parent(struct vec *v, const char *path)
+{
+	char buf[PATH_MAX];
+	char *p;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	if ((p = strrchr(buf, '/')) == NULL)
+		return 0;
+	*p = '\0';
+
+	return add_change(v, buf, DS_DIR, 0);
+}
+
+static int diff_visit(struct walk_thread *t, const char *path,
+		struct stat *st)
+{
+	struct dir_snap *s = t->w->snap;
+	struct ds_entry *e;
+	int type;
+
+	if ((e = snap_find(s, path)) != NULL) {
+		/* Each entry is only visited once, so no locking */
+		s->seen[e - s->e] = S_ISDIR(st->st_mode) ? SEEN_DIR : SEEN;
+		if (!is_changed(s, e, st))
+			return 0;
+	}
+	if (S_ISDIR(st->st_mode))
+		type = DS_DIR;
+	else if (S_ISREG(st->st_mode) && st->st_nlink > 1)
+		type = DS_HLINK;
+	else
+		type = DS_FILE;
+
+	if (add_change(&t->out, path, type,
+				S_ISREG(st->st_mode) ? st->st_size : 0) ||
+			add_parent(&t->out, path))
+		return -1;
+
+	return 0;
+}
+
+/* Add deleted entries, and those parents of them that still exist */
+static int add_deleted(struct dir_snap *s, struct vec *v)
+{
+	struct ds_entry *parent;
+	char buf[PATH_MAX];
+	char *p;
+	int i;
+
+	for (i = 0; i < s->n; i++) {
+		if (s->seen[i] != NOT_SEEN)
+			continue;
+		if (add_change(v, s->e[i].path, DS_DELETED, 0))
+			return -1;
+		snprintf(buf, sizeof(buf), "%s", s->e[i].path);
+		if ((p = strrchr(buf, '/')) == NULL)
+			continue;
+		*p = '\0';
+		parent = snap_find(s, buf);
+		if (parent != NULL && s->seen[parent - s->e] == SEEN_DIR &&
+				add_change(v, buf, DS_DIR, 0))
+			return -1;
+	}
+
+	return 0;
+}
+
+void dir_delta_free(struct dir_delta *d)
+{
+	int i;
+
+	for (i = 0; i < d->n; i++)
+		free(d->ch[i].path);
+	free(d->ch);
+	memset(d, 0, sizeof(*d));
+}
+
+int dir_snap_diff(struct dir_snap *s, const char *root, int nthreads,
+		struct dir_delta *d)
+{
+	struct walker w = {
+		.root = root,
+		.visit = diff_visit,
+		.snap = s,
+	};
+	struct dir_change *c;
+	struct vec v;
+	int i, n;
+
+	memset(d, 0, sizeof(*d));
+	free(s->seen);
+	if ((s->seen = calloc(s->n ? : 1, 1)) == NULL) {
+		logger(-1, ENOMEM, "Unable to compare snapshot");
+		return -1;
+	}
+	if (walk(&w, nthreads, sizeof(struct dir_change), &v) ||
+			add_deleted(s, &v))
+		goto err;
+
+	/* Sort and drop duplicate parents */
+	c = v.a;
+	if (v.n > 0)
+		qsort(c, v.n, sizeof(*c), change_cmp);
+	for (i = 0, n = 0; i < v.n; i++) {
+		if (n > 0 && !strcmp(c[n - 1].path, c[i].path)) {
+			free(c[i].path);
+			continue;
+		}
+		c[n++] = c[i];
+		switch (c[i].type) {
+		case DS_DIR:
+			d->ndirs++;
+			break;
+		case DS_DELETED:
+			d->ndeleted++;
+			break;
+		default:
+			d->nfiles++;
+			d->bytes += c[i].size;
+		}
+	}
+	d->ch = c;
+	d->n = n;
+	free(s->seen);
+	s->seen = NULL;
+
+	return 0;
+err:
+	d->ch = v.a;
+	d->n = v.n;
+	dir_delta_free(d);
+	free(s->seen);
+	s->seen = NULL;
+
+	return -1;
+}
@@ -32,6 +32,7 @@
 #include <sys/utsname.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
+#include <dirent.h>
 
 #include "vzerror.h"
 #include "res.h"
@@ -47,6 +48,9 @@
 #include "image.h"
 #include "readelf.h"
 #include "destroy.h"
+#include "stats.h"
+#include "vzconfig.h"
+#include "vps_configure.h"
 
 #ifndef PROC_SUPER_MAGIC
 #define PROC_SUPER_MAGIC	0x9fa0
@@ -147,6 +151,70 @@ int vps_is_run(vps_handler *h, envid_t veid)
 	return h->is_run(h, veid);
 }
 
+static int add_ve(envid_t **list, int *size, envid_t veid)
+{
+	envid_t *tmp;
+
+	if (ve_in_list(*list, *size, veid))
+		return 0;
+	tmp = realloc(*list, (*size + 1) * sizeof(*tmp));
+	if (tmp == NULL)
+		return vzctl_err(VZ_RESOURCE_ERROR, ENOMEM,
+				"Unable to allocate CT list");
+	*list = tmp;
+	(*list)[(*size)++] = veid;
+
+	return 0;
+}
+
+/* Add all running containers that have a config */
+static int add_all_ves(vps_handler *h, envid_t **list, int *size)
+{
+	DIR *dp;
+	struct dirent *ep;
+	int veid, ret = 0;
+	char str[6];
+
+	if ((dp = opendir(VPSCONFDIR)) == NULL)
+		return vzctl_err(VZ_SYSTEM_ERROR, errno,
+				"Unable to open %s", VPSCONFDIR);
+	while ((ep = readdir(dp)) != NULL) {
+		if (sscanf(ep->d_name, "%d.%5s", &veid, str) != 2 ||
+				strcmp(str, "conf"))
+			continue;
+		if (veid <= 0 || veid > VEID_MAX)
+			continue;
+		if (!vps_is_run(h, veid))
+			continue;
+		if ((ret = add_ve(list, size, veid)))
+			break;
+	}
+	closedir(dp);
+
+	return ret;
+}
+
+int parse_ve_list(vps_handler *h, char *str, envid_t **list, int *size)
+{
+	char *tok;
+	int veid, ret;
+
+	if (!strcmp(str, "all"))
+		return add_all_ves(h, list, size);
+
+	for_each_strtok(tok, str, ", \t") {
+		if (parse_int(tok, &veid))
+			veid = get_veid_by_name(tok);
+		if (veid <= 0 || veid > VEID_MAX)
+			return vzctl_err(VZ_INVALID_PARAMETER_VALUE, 0,
+					"Bad CT ID %s", tok);
+		if ((ret = add_ve(list, size, veid)))
+			return ret;
+	}
+
+	return 0;
+}
+
 /** Change root to specified directory
  *
  * @param		CT root
@@ -616,6 +684,9 @@ int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
 	vps_res *res = &param->res;
 	dist_actions actions;
 	int ploop;
+	uint64_t start;
+	char fp[VPS_CONFIG_FP_LEN] = "";
+	int failed;
 
 	memset(&actions, 0, sizeof(actions));
 	if (check_var(res->fs.root, "VE_ROOT is not set"))
@@ -664,12 +735,26 @@ int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
 	}
 
 	if (!(skip & SKIP_ACTION_SCRIPT)) {
+		start = vz_stats_now();
 		ret = run_pre_script(veid, VPS_PRESTART);
 		if (ret)
 			return ret;
+		vz_stats_add(VZ_STAT_SCRIPT, start);
 	}
 	if ((ret = fill_vswap_ub(&res->ub, &res->ub)))
 		return ret;
+	/* Skip in-CT configuration if it is the same as on last start */
+	if (!fn && !(skip & (SKIP_SETUP | SKIP_CONFIGURE))) {
+		vps_config_fp_get(&actions, &res->fs, param, fp, sizeof(fp));
+		if (vps_config_fp_check(veid, fp)) {
+			logger(1, 0, "Container configuration is unchanged, "
+					"skipping configure scripts");
+			skip |= SKIP_CONFIGURE;
+			fp[0] = '\0';
+		} else {
+			vps_config_fp_remove(veid);
+		}
+	}
 
 	if (pipe(wait_p) < 0) {
 		logger(-1, errno, "Can not create pipe");
@@ -705,16 +790,24 @@ int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
 	fix_numiptent(&res->ub);
 	fix_cpu(&res->cpu);
 
+	start = vz_stats_now();
 	ret = vz_env_create(h, veid, res, wait_p,
 				old_wait_p, err_p, fn, data);
 	if (ret)
 		goto err;
+	vz_stats_add(VZ_STAT_ENV_CREATE, start);
 
+	/* Collect all in-CT scripts run during setup and run them
+	 * at once below, rather than entering CT for each one.
+	 */
+	vps_exec_batch_begin();
+	start = vz_stats_now();
 	if ((ret = vps_setup_res(h, veid, &actions, &res->fs, NULL, param,
 		STATE_STARTING, skip, mod)))
 	{
 		goto err;
 	}
+	vz_stats_add(VZ_STAT_SETUP_RES, start);
 	if (!(skip & SKIP_ACTION_SCRIPT) && !fn) {
 
 		/* Run dist actions PRE_START script */
@@ -749,12 +842,27 @@ int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
 			}
 		}
 	}
+	start = vz_stats_now();
+	if ((ret = vps_exec_batch_run(h, veid, res->fs.root, &failed)))
+		goto err;
+	vz_stats_add(VZ_STAT_SCRIPT, start);
+	if (fp[0] != '\0') {
+		if (failed)
+			vps_config_fp_remove(veid);
+		else
+			vps_config_fp_save(veid, fp);
+	}
+	/* Quota limits are set after configure scripts, see vps_setup_res() */
+	if (!ploop && !(skip & SKIP_SETUP) &&
+			(ret = vps_set_quota(veid, &res->dq)))
+		goto err;
 	/* Tell the child that it's time to start /sbin/init */
 	if (write(wait_p[1], &ret, sizeof(ret)) != sizeof(ret))
 		logger(-1, errno, "Unable to write to waitfd to start init");
 	close(wait_p[1]);
 	close(old_wait_p[1]);
 err:
+	vps_exec_batch_end();
 	free_dist_actions(&actions);
 	if (ret) {
 		/* Kill environment */
@@ -769,12 +877,17 @@ err:
 		write(old_wait_p[1], &ret, sizeof(ret));
 		close(old_wait_p[1]);
 	} else {
+		start = vz_stats_now();
 		if (!read(err_p[0], &ret, sizeof(ret))) {
-			if (res->misc.wait == YES) {
+			vz_stats_add(VZ_STAT_INIT_EXEC, start);
+			if (res->misc.wait == YES && !(skip & SKIP_WAIT)) {
+				const char *root = res->fs.root;
+				int ready;
+
 				logger(0, 0, "Container start in progress"
 					", waiting ...");
-				ret = vps_execFn(h, veid, res->fs.root,
-					wait_on_fifo, NULL, 0);
+				ret = vps_wait_started(h, &veid, &root, 1,
+						MAX_WAIT_TIMEOUT, &ready);
 				if (ret) {
 					logger(0, 0, "Container wait failed%s",
 						ret == VZ_EXEC_TIMEOUT ? \
@@ -828,11 +941,13 @@ int vps_start(vps_handler *h, envid_t veid, vps_param *param,
 	skipFlags skip, struct mod_action *mod)
 {
 	int ret;
+	uint64_t start = vz_stats_now();
 
 	logger(0, 0, "Starting container...");
 	ret = vps_start_custom(h, veid, param, skip, mod, NULL, NULL);
 
 	if (ret == 0) {
+		vz_stats_add(VZ_STAT_START, start);
 		/* Start was successful, remove the default dump file:
 		 * it is now useless and inconsistent with the fs state
 		 */
@@ -1012,6 +1127,7 @@ int vps_stop(vps_handler *h, envid_t veid, vps_param *param, int stop_mode,
 	char buf[64];
 	vps_res *res = &param->res;
 	int tm = res->misc.stop_timeout;
+	uint64_t start = vz_stats_now(), t;
 
 	if (check_var(res->fs.root, "VE_ROOT is not set"))
 		return VZ_VE_ROOT_NOTSET;
@@ -1023,20 +1139,26 @@ int vps_stop(vps_handler *h, envid_t veid, vps_param *param, int stop_mode,
 		snprintf(buf, sizeof(buf), VPSCONFDIR "/%d.%s", veid,
 			STOP_PREFIX);
 		if (stat_file(buf) == 1) {
+			t = vz_stats_now();
 			if (vps_exec_script(h, veid, res->fs.root, NULL, NULL,
 				buf, NULL, 0))
 			{
 				return VZ_ACTIONSCRIPT_ERROR;
 			}
+			vz_stats_add(VZ_STAT_SCRIPT, t);
 		}
 	}
 
+	vps_exec_agent_stop(veid);
+
 	/* get CT IP addresses for cleanup */
 	if (is_vz_kernel(h))
 		get_vps_ip(h, veid, &param->del_res.net.ip);
 
+	t = vz_stats_now();
 	if ((ret = env_stop(h, veid, res->fs.root, stop_mode, tm)))
 		goto end;
+	vz_stats_add(VZ_STAT_ENV_STOP, t);
 
 	mod_cleanup(h, veid, action, param);
 
@@ -1047,6 +1169,8 @@ int vps_stop(vps_handler *h, envid_t veid, vps_param *param, int stop_mode,
 
 	if (!(skip & SKIP_UMOUNT))
 		ret = vps_umount(h, veid, &res->fs, skip);
+	if (ret == 0)
+		vz_stats_add(VZ_STAT_STOP, start);
 
 end:
 	free_str_param(&param->del_res.net.ip);
@@ -77,7 +77,7 @@ int execvep(const char *path, char *const argv[], char *const envp[])
 	return -1;
 }
 
-static int stdredir(int rdfd, int wrfd)
+int stdredir(int rdfd, int wrfd)
 {
 	int lenr, lenw, lentotal, lenremain;
 	char buf[10240];
@@ -332,6 +332,10 @@ int vps_exec(vps_handler *h, envid_t veid, const char *root, int exec_mode,
 		logger(-1, 0, "Container is not running");
 		return VZ_VE_NOT_RUNNING;
 	}
+	/* Use CT exec agent if enabled and running, it is way cheaper */
+	ret = vps_exec_agent_run(veid, exec_mode, argv, envp, std_in, timeout);
+	if (ret != -1)
+		return ret;
 	fflush(stderr);
 	fflush(stdout);
 	/* Extra fork to skip UBC limit applying to the current process */
@@ -395,6 +399,182 @@ int vps_execFn(vps_handler *h, envid_t veid, const char *root,
 	return ret;
 }
 
+/* Batch of scripts to be run in a single CT session,
+ * see vps_exec_batch_begin()
+ */
+#define BATCH_NONFATAL_FAILED	254
+
+static struct {
+	int active;
+	int nonfatal;
+	int steps;
+	int timeout;
+	char *buf;
+	size_t len;
+} batch;
+
+static int batch_append(const char *str)
+{
+	size_t len = strlen(str);
+	char *tmp;
+
+	tmp = realloc(batch.buf, batch.len + len + 1);
+	if (tmp == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		return -1;
+	}
+	batch.buf = tmp;
+	memcpy(batch.buf + batch.len, str, len + 1);
+	batch.len += len;
+
+	return 0;
+}
+
+/* Append NAME='value' with value quoted for the shell */
+static int batch_append_env(const char *env)
+{
+	const char *p;
+	char c[2] = {};
+
+	if ((p = strchr(env, '=')) == NULL)
+		return 0;
+	if (batch_append("export "))
+		return -1;
+	for (; env <= p; env++) {
+		c[0] = *env;
+		if (batch_append(c))
+			return -1;
+	}
+	if (batch_append("'"))
+		return -1;
+	for (; *env != '\0'; env++) {
+		c[0] = *env;
+		if (batch_append(*env == '\'' ? "'\\''" : c))
+			return -1;
+	}
+	return batch_append("'\n");
+}
+
+static int batch_add(char *const envp[], const char *fname,
+	const char *script, int timeout)
+{
+	char buf[STR_SIZE];
+	int i;
+
+	/* Every script is run in a subshell, so it gets its own
+	 * environment (as if it was run by a separate bash) and
+	 * can not consume the rest of the batch from stdin.
+	 */
+	if (batch_append("(\n"))
+		return -1;
+	if (envp == NULL)
+		envp = envp_bash;
+	for (i = 0; envp[i] != NULL; i++)
+		if (batch_append_env(envp[i]))
+			return -1;
+	if (batch_append(script) ||
+			batch_append("\n) </dev/null\n"))
+		return -1;
+	snprintf(buf, sizeof(buf),
+		"rc=$?\n"
+		"if [ $rc -ne 0 ]; then\n"
+		"\techo \"Container script %s failed, exit code $rc\" >&2\n"
+		"\t%s\n"
+		"fi\n", fname, batch.nonfatal ? "failed=1" : "exit 1");
+	if (batch_append(buf))
+		return -1;
+	batch.steps++;
+	/* -1 means no timeout */
+	if (timeout == 0)
+		batch.timeout = -1;
+	else if (batch.timeout >= 0)
+		batch.timeout += timeout;
+
+	return 0;
+}
+
+/** Start collecting CT scripts into a batch.
+ * Until vps_exec_batch_run() or vps_exec_batch_end() is called,
+ * vps_exec_script() does not execute scripts but adds them to the batch,
+ * to be run later in a single CT session, saving a fork, CT enter and
+ * bash startup per script.
+ */
+void vps_exec_batch_begin(void)
+{
+	vps_exec_batch_end();
+	batch.active = 1;
+}
+
+/** Mark scripts added to the batch from now on as non-fatal, i.e. their
+ * failure is reported but does not stop the batch.
+ *
+ * @param nonfatal	1 to set, 0 to clear.
+ * @return		previous value.
+ */
+int vps_exec_batch_nonfatal(int nonfatal)
+{
+	int old = batch.nonfatal;
+
+	batch.nonfatal = nonfatal;
+	return old;
+}
+
+int vps_exec_batch_active(void)
+{
+	return batch.active;
+}
+
+/** Drop the batch without running it. */
+void vps_exec_batch_end(void)
+{
+	free(batch.buf);
+	memset(&batch, 0, sizeof(batch));
+}
+
+/** Run all scripts collected in the batch in a single CT session,
+ * in the order they were added, and end the batch.
+ *
+ * @param h		CT handler.
+ * @param veid		CT ID.
+ * @param root		CT root.
+ * @param failed	set to 1 if any non-fatal script failed (can be NULL).
+ * @return		0 on success, VZ_ACTIONSCRIPT_ERROR if a fatal
+ *			script failed.
+ */
+int vps_exec_batch_run(vps_handler *h, envid_t veid, const char *root,
+	int *failed)
+{
+	char *envp[] = {ENV_PATH, NULL};
+	char buf[64];
+	int ret = 0;
+
+	if (failed != NULL)
+		*failed = 0;
+	if (!batch.active)
+		return 0;
+	batch.active = 0;
+	snprintf(buf, sizeof(buf), "[ -z \"$failed\" ] || exit %d\nexit 0\n",
+			BATCH_NONFATAL_FAILED);
+	if (batch.steps != 0 && batch_append(buf) == 0) {
+		logger(1, 0, "Running %d container script(s) in one session",
+				batch.steps);
+		ret = vps_exec(h, veid, root, MODE_BASH, NULL, envp, batch.buf,
+					batch.timeout < 0 ? 0 : batch.timeout);
+		if (ret == BATCH_NONFATAL_FAILED) {
+			if (failed != NULL)
+				*failed = 1;
+			ret = 0;
+		} else if (ret) {
+			ret = VZ_ACTIONSCRIPT_ERROR;
+		}
+	} else if (batch.steps != 0) {
+		ret = VZ_RESOURCE_ERROR;
+	}
+	vps_exec_batch_end();
+
+	return ret;
+}
+
 /** Read script and execute it in CT.
  *
  * @param h		CT handler.
@@ -416,6 +596,12 @@ int vps_exec_script(vps_handler *h, envid_t veid, const char *root,
 
 	if ((len = read_script(fname, func, &script)) < 0)
 		return -1;
+	if (batch.active && argv == NULL) {
+		logger(1, 0, "Adding container script to batch: %s", fname);
+		ret = batch_add(envp, fname, script, timeout);
+		free(script);
+		return ret;
+	}
 	logger(1, 0, "Running container script: %s", fname);
 	ret = vps_exec(h, veid, root, MODE_BASH, argv, envp, script, timeout);
 	free(script);
@@ -0,0 +1,622 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Exec agent is a long-lived process which enters a container once
+ * and then serves exec requests coming over a unix socket bound on
+ * the host side (before entering). A request carries the command
+ * line, environment and the stdin/stdout/stderr pipes created by the
+ * client, so a command is run by a single fork inside an already
+ * entered context. The reply is the command exit status.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vzerror.h"
+#include "exec.h"
+#include "env.h"
+#include "util.h"
+#include "logger.h"
+
+#define EXEC_AGENT_QUIT		-1
+/* Time for a timed out command to exit on SIGTERM, before SIGKILL */
+#define EXEC_AGENT_KILL_TIMEOUT	5
+
+struct exec_agent_req {
+	int mode;	/* MODE_EXEC, MODE_BASH or EXEC_AGENT_QUIT */
+	int argc;
+	int envc;
+	int size;	/* size of strings block following the header */
+};
+
+static char *envp_agent[] = {"HOME=/", "TERM=linux", ENV_PATH, NULL};
+static volatile sig_atomic_t agent_child_exited;
+static int agent_sigpipe[2] = {-1, -1};
+static int agent_enabled;
+
+static void get_exec_agent_sock(envid_t veid, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path),
+			VEPIDDIR "/%d.exec-agent", veid);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int agent_connect(envid_t veid)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	get_exec_agent_sock(veid, &addr);
+	if (stat_file(addr.sun_path) != 1)
+		return -1;
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		/* Agent died together with the CT, remove its socket */
+		if (errno == ECONNREFUSED)
+			unlink(addr.sun_path);
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* Send request header along with the descriptors for the command */
+static int send_req(int sock, struct exec_agent_req *req, int *fds, int nfds)
+{
+	struct msghdr msg = {};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	while (sendmsg(sock, &msg, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	return 0;
+}
+
+static int recv_req(int sock, struct exec_agent_req *req, int *fds)
+{
+	struct msghdr msg = {};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	ssize_t n;
+
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	while ((n = recvmsg(sock, &msg, 0)) < 0)
+		if (errno != EINTR)
+			return -1;
+	if (n != sizeof(*req))
+		return -1;
+	fds[0] = fds[1] = fds[2] = -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL &&
+	    cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+		memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+	return 0;
+}
+
+/* Pack argv and envp into a block of zero-terminated strings */
+static char *pack_args(char *const argv[], char *const envp[],
+		struct exec_agent_req *req)
+{
+	char *buf, *p;
+	int i;
+
+	req->size = req->argc = req->envc = 0;
+	for (i = 0; argv && argv[i]; i++, req->argc++)
+		req->size += strlen(argv[i]) + 1;
+	for (i = 0; envp && envp[i]; i++, req->envc++)
+		req->size += strlen(envp[i]) + 1;
+	if ((buf = malloc(req->size + 1)) == NULL)
+		return NULL;
+	p = buf;
+	for (i = 0; i < req->argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+	for (i = 0; i < req->envc; i++)
+		p = stpcpy(p, envp[i]) + 1;
+	return buf;
+}
+
+static char **unpack_args(char **p, char *end, int n)
+{
+	char **arr;
+	int i;
+
+	if ((arr = calloc(n + 1, sizeof(char *))) == NULL)
+		return NULL;
+	for (i = 0; i < n && *p < end; i++) {
+		arr[i] = *p;
+		*p += strlen(*p) + 1;
+	}
+	return arr;
+}
+
+/** Enable or disable use of exec agents by vps_exec().
+ *
+ * @param enable	1 to use a running agent, 0 to always enter the CT.
+ */
+void vps_exec_agent_enable(int enable)
+{
+	agent_enabled = enable;
+}
+
+/** Execute command inside CT via its exec agent.
+ *
+ * The command gets pipes, never the caller's own descriptors (which
+ * may be a host terminal), and its I/O is relayed here in the same way
+ * vps_real_exec() does it.
+ *
+ * @param veid		CT ID.
+ * @param exec_mode	execution mode (MODE_EXEC, MODE_BASH).
+ * @param argv		argv array.
+ * @param envp		command environment array.
+ * @param std_in	read command from buffer stdin point to.
+ * @param timeout	execution timeout, 0 - unlimited.
+ * @return		command exit status, or -1 if agent is not used.
+ */
+int vps_exec_agent_run(envid_t veid, int exec_mode, char *argv[],
+		char *const envp[], char *std_in, int timeout)
+{
+	struct exec_agent_req req;
+	struct pollfd pfd[4];
+	struct sigaction act, oldact;
+	int in[2] = {-1, -1}, out[2] = {-1, -1}, err[2] = {-1, -1};
+	int fds[3];
+	int sock, ret, n;
+	time_t left, end = 0;
+	char *buf = NULL;
+
+	if (!agent_enabled || (sock = agent_connect(veid)) < 0)
+		return -1;
+	/* The command may exit without reading all of its stdin */
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	act.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &act, &oldact);
+	ret = VZ_RESOURCE_ERROR;
+	req.mode = exec_mode;
+	if ((buf = pack_args(argv, envp, &req)) == NULL)
+		goto out;
+	if (pipe(in) < 0 || pipe(out) < 0 || pipe(err) < 0) {
+		logger(-1, errno, "Unable to create pipe");
+		goto out;
+	}
+	fds[0] = in[0];
+	fds[1] = out[1];
+	fds[2] = err[1];
+	logger(2, 0, "Using exec agent of CT %d", veid);
+	fflush(stdout);
+	fflush(stderr);
+	if (send_req(sock, &req, fds, 3) ||
+			write_all(sock, buf, req.size))
+	{
+		logger(-1, errno, "Unable to send request to exec agent");
+		ret = VZ_COMMAND_EXECUTION_ERROR;
+		goto out;
+	}
+	close(in[0]); in[0] = -1;
+	close(out[1]); out[1] = -1;
+	close(err[1]); err[1] = -1;
+	set_not_blk(out[0]);
+	set_not_blk(err[0]);
+	if (std_in != NULL) {
+		/* Ignore write error, the command may not read stdin */
+		write_all(in[1], std_in, strlen(std_in));
+		close(in[1]);
+		in[1] = -1;
+	}
+
+	pfd[0].fd = sock;
+	pfd[1].fd = out[0];
+	pfd[2].fd = err[0];
+	pfd[3].fd = in[1] != -1 ? STDIN_FILENO : -1;
+	for (n = 0; n < 4; n++)
+		pfd[n].events = POLLIN;
+	if (timeout)
+		end = time(NULL) + timeout;
+	for (;;) {
+		left = end - time(NULL);
+		if (timeout && left <= 0) {
+			/* Closing the connection makes agent kill the command */
+			logger(-1, 0, "Execution timeout expired");
+			ret = VZ_EXEC_TIMEOUT;
+			break;
+		}
+		n = poll(pfd, 4, timeout ? left * 1000 : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Error in poll()");
+			ret = VZ_SYSTEM_ERROR;
+			break;
+		}
+		if (pfd[1].revents && stdredir(out[0], STDOUT_FILENO) < 0)
+			pfd[1].fd = -1;
+		if (pfd[2].revents && stdredir(err[0], STDERR_FILENO) < 0)
+			pfd[2].fd = -1;
+		if (pfd[3].revents && stdredir(STDIN_FILENO, in[1]) < 0) {
+			pfd[3].fd = -1;
+			close(in[1]);
+			in[1] = -1;
+		}
+		if (pfd[0].revents) {
+			/* The command has exited, flush what it has left */
+			while (pfd[1].fd != -1 &&
+				stdredir(out[0], STDOUT_FILENO) == 0);
+			while (pfd[2].fd != -1 &&
+				stdredir(err[0], STDERR_FILENO) == 0);
+			if (read_all(sock, &ret, sizeof(ret))) {
+				logger(-1, 0, "Exec agent of CT %d terminated",
+						veid);
+				ret = VZ_COMMAND_EXECUTION_ERROR;
+			}
+			break;
+		}
+	}
+out:
+	close(in[0]); close(in[1]);
+	close(out[0]); close(out[1]);
+	close(err[0]); close(err[1]);
+	free(buf);
+	close(sock);
+	sigaction(SIGPIPE, &oldact, NULL);
+
+	return ret;
+}
+
+static void agent_sigchld(int sig)
+{
+	int save_errno = errno;
+
+	agent_child_exited = 1;
+	write(agent_sigpipe[1], "", 1);
+	errno = save_errno;
+}
+
+/* Kill the command run by a session along with everything it has
+ * spawned, by force if it does not exit on SIGTERM in time.
+ */
+static void agent_kill(int pid)
+{
+	struct pollfd pfd;
+	time_t end = time(NULL) + EXEC_AGENT_KILL_TIMEOUT;
+
+	kill(-pid, SIGTERM);
+	pfd.fd = agent_sigpipe[0];
+	pfd.events = POLLIN;
+	while (!agent_child_exited && time(NULL) < end)
+		poll(&pfd, 1, 1000);
+	/* The group is there until its leader is reaped */
+	kill(-pid, SIGKILL);
+}
+
+/* Serve one request, runs in a separate process per connection */
+static int agent_session(int sock, struct exec_agent_req *req, int *fds)
+{
+	struct sigaction act;
+	struct pollfd pfd[2];
+	char *buf, *p, **argv, **envp;
+	char *def_argv[] = { NULL, NULL };
+	int ret, status, pid;
+
+	if (req->argc < 0 || req->envc < 0 || req->size < 0 ||
+			(buf = malloc(req->size + 1)) == NULL ||
+			read_all(sock, buf, req->size))
+		return VZ_COMMAND_EXECUTION_ERROR;
+	buf[req->size] = '\0';
+	p = buf;
+	argv = unpack_args(&p, buf + req->size, req->argc);
+	envp = unpack_args(&p, buf + req->size, req->envc);
+	if (argv == NULL || envp == NULL || pipe(agent_sigpipe) < 0) {
+		ret = VZ_RESOURCE_ERROR;
+		goto reply;
+	}
+	set_not_blk(agent_sigpipe[0]);
+	set_not_blk(agent_sigpipe[1]);
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_NOCLDSTOP;
+	act.sa_handler = agent_sigchld;
+	sigaction(SIGCHLD, &act, NULL);
+
+	if ((pid = fork()) < 0) {
+		ret = VZ_RESOURCE_ERROR;
+		goto reply;
+	} else if (pid == 0) {
+		/* Own process group, so that it can be killed as a whole */
+		setpgid(0, 0);
+		dup2(fds[0], STDIN_FILENO);
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(fds[2], STDERR_FILENO);
+		close_fds(0, -1);
+		act.sa_handler = SIG_DFL;
+		sigaction(SIGCHLD, &act, NULL);
+		if (req->envc == 0)
+			envp = envp_agent;
+		if (req->mode == MODE_EXEC && req->argc) {
+			execvep(argv[0], argv, envp);
+		} else {
+			if (req->argc == 0)
+				argv = def_argv;
+			argv[0] = "/bin/bash";
+			execve(argv[0], argv, envp);
+			argv[0] = "/bin/sh";
+			execve(argv[0], argv, envp);
+		}
+		exit(VZ_FS_BAD_TMPL);
+	}
+	setpgid(pid, pid);
+	close(fds[0]);
+	close(fds[1]);
+	close(fds[2]);
+
+	/* Wait for the command, or for the client to go away */
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = agent_sigpipe[0];
+	pfd[1].events = POLLIN;
+	while (!agent_child_exited) {
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+			break;
+		/* Client went away, i.e. execution timeout expired */
+		if (pfd[0].revents) {
+			agent_kill(pid);
+			break;
+		}
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			break;
+	ret = VZ_SYSTEM_ERROR;
+	if (WIFEXITED(status))
+		ret = WEXITSTATUS(status);
+reply:
+	write_all(sock, &ret, sizeof(ret));
+	return 0;
+}
+
+static void agent_loop(int lsock)
+{
+	struct exec_agent_req req;
+	struct sigaction act;
+	int sock, pid;
+	int fds[3];
+
+	/* Sessions are reaped automatically */
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_NOCLDWAIT;
+	act.sa_handler = SIG_DFL;
+	sigaction(SIGCHLD, &act, NULL);
+
+	for (;;) {
+		if ((sock = accept(lsock, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			exit(VZ_SYSTEM_ERROR);
+		}
+		/* Status check just connects and closes */
+		if (recv_req(sock, &req, fds)) {
+			close(sock);
+			continue;
+		}
+		if (req.mode == EXEC_AGENT_QUIT)
+			exit(0);
+		if ((pid = fork()) == 0) {
+			close(lsock);
+			exit(agent_session(sock, &req, fds));
+		}
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+		close(sock);
+	}
+}
+
+/** Start exec agent inside a running CT.
+ *
+ * @param h		CT handler.
+ * @param veid		CT ID.
+ * @param root		CT root.
+ * @return		0 on success.
+ */
+int vps_exec_agent_start(vps_handler *h, envid_t veid, const char *root)
+{
+	struct sockaddr_un addr;
+	int lsock, pid, ret;
+	int st[2];
+
+	if (check_var(root, "Container root (VE_ROOT) is not set"))
+		return VZ_VE_ROOT_NOTSET;
+	if (!vps_is_run(h, veid)) {
+		logger(-1, 0, "Container is not running");
+		return VZ_VE_NOT_RUNNING;
+	}
+	if (vps_exec_agent_status(veid)) {
+		logger(0, 0, "Exec agent is already running");
+		return 0;
+	}
+	make_dir(VEPIDDIR, 1);
+	get_exec_agent_sock(veid, &addr);
+	unlink(addr.sun_path);
+	if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return vzctl_err(VZ_RESOURCE_ERROR, errno,
+				"Unable to create socket");
+	if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) ||
+			chmod(addr.sun_path, 0600) ||
+			listen(lsock, 16))
+	{
+		logger(-1, errno, "Unable to bind %s", addr.sun_path);
+		close(lsock);
+		return VZ_RESOURCE_ERROR;
+	}
+	if (pipe(st) < 0) {
+		close(lsock);
+		return vzctl_err(VZ_RESOURCE_ERROR, errno,
+				"Unable to create pipe");
+	}
+	fflush(stdout);
+	fflush(stderr);
+	if ((pid = fork()) < 0) {
+		logger(-1, errno, "Unable to fork");
+		ret = VZ_RESOURCE_ERROR;
+		goto err;
+	} else if (pid == 0) {
+		close(st[0]);
+		setsid();
+		fcntl(st[1], F_SETFD, FD_CLOEXEC);
+		close_fds(1, lsock, st[1], h->vzfd, -1);
+		if ((ret = h->setcontext(veid)) ||
+				(ret = h->enter(h, veid, root, 0)))
+		{
+			write(st[1], &ret, sizeof(ret));
+			exit(ret);
+		}
+		write(st[1], &ret, sizeof(ret));
+		close(st[1]);
+		agent_loop(lsock);
+		exit(0);
+	}
+	close(st[1]);
+	st[1] = -1;
+	if (read_all(st[0], &ret, sizeof(ret)))
+		ret = VZ_SYSTEM_ERROR;
+	if (ret == 0)
+		logger(0, 0, "Exec agent started");
+err:
+	if (ret)
+		unlink(addr.sun_path);
+	close(st[0]);
+	if (st[1] != -1)
+		close(st[1]);
+	close(lsock);
+
+	return ret;
+}
+
+/** Stop CT exec agent.
+ *
+ * @param veid		CT ID.
+ * @return		0 if the agent was stopped, 1 if it was not running.
+ */
+int vps_exec_agent_stop(envid_t veid)
+{
+	struct sockaddr_un addr;
+	struct exec_agent_req req = {};
+	int sock;
+	char c;
+
+	if ((sock = agent_connect(veid)) < 0)
+		return 1;
+	req.mode = EXEC_AGENT_QUIT;
+	send_req(sock, &req, NULL, 0);
+	/* Wait for the agent to close the connection */
+	while (read(sock, &c, 1) < 0 && errno == EINTR);
+	close(sock);
+	get_exec_agent_sock(veid, &addr);
+	unlink(addr.sun_path);
+
+	return 0;
+}
+
+/** Check whether CT exec agent is running.
+ *
+ * @param veid		CT ID.
+ * @return		1 if running, 0 otherwise.
+ */
+int vps_exec_agent_status(envid_t veid)
+{
+	int sock;
+
+	if ((sock = agent_connect(veid)) < 0)
+		return 0;
+	close(sock);
+	return 1;
+}
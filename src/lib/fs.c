@@ -32,6 +32,7 @@
 #include "quota.h"
 #include "image.h"
 #include "list.h"
+#include "stats.h"
 
 int vps_is_run(vps_handler *h, envid_t veid);
 
@@ -65,8 +66,11 @@ int fsmount(envid_t veid, fs_param *fs, dq_param *dq, int fsck)
 #endif
 	}
 	else {
+		uint64_t start = vz_stats_now();
+
 		if ((ret = vps_quotaon(veid, fs->private, dq)))
 			return ret;
+		vz_stats_add(VZ_STAT_QUOTA_ON, start);
 		if ((ret = vz_mount(fs, 0)))
 			vps_quotaoff(veid, dq);
 	}
@@ -150,6 +154,7 @@ int vps_mount(vps_handler *h, envid_t veid, fs_param *fs, dq_param *dq,
 	char buf[PATH_LEN];
 	int ret, i;
 	int fsck = ! (skip & SKIP_FSCK);
+	uint64_t start = vz_stats_now();
 
 	if (check_var(fs->root, "VE_ROOT is not set"))
 		return VZ_VE_ROOT_NOTSET;
@@ -198,6 +203,7 @@ int vps_mount(vps_handler *h, envid_t veid, fs_param *fs, dq_param *dq,
 		}
 	}
 	logger(0, 0, "Container is mounted");
+	vz_stats_add(VZ_STAT_MOUNT, start);
 
 	return 0;
 }
@@ -207,6 +213,7 @@ int vps_umount(vps_handler *h, envid_t veid, const fs_param *fs,
 {
 	char buf[PATH_LEN];
 	int ret, i;
+	uint64_t start = vz_stats_now();
 
 	if (vps_is_mounted(fs) == 0) {
 		logger(-1, 0, "CT is not mounted");
@@ -244,6 +251,8 @@ int vps_umount(vps_handler *h, envid_t veid, const fs_param *fs,
 				POST_UMOUNT_PREFIX);
 		}
 	}
+	if (ret == 0)
+		vz_stats_add(VZ_STAT_UMOUNT, start);
 
 	return ret;
 }
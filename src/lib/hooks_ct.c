@@ -23,8 +23,6 @@
 #include "cpt.h"
 #include "linux/vzctl_venet.h"
 
-#define NETNS_RUN_DIR "/var/run/netns"
-
 #ifndef HAVE_SETNS
 
 #ifndef __NR_setns
@@ -852,12 +850,22 @@ static int ct_chkpnt(vps_handler *h, envid_t veid,
 {
 	char dumpfile[PATH_MAX];
 	char statefile[STR_SIZE], buf[STR_SIZE];
-	char *arg[2], *env[4];
+	char *arg[2], *env[5];
 	FILE *sfile;
 	pid_t pid;
 	int ret;
 
+	if (is_stdio_dump(param->dumpfile)) {
+		logger(-1, 0, "Dumping to stdout is not supported with CRIU");
+		return VZ_CHKPNT_ERROR;
+	}
 	get_dump_file(veid, param->dumpdir, dumpfile, sizeof(dumpfile));
+	if (param->compress)
+		logger(0, 0, "Warning: dump compression is not supported "
+				"with CRIU, ignored");
+	if (param->dedup == YES)
+		logger(0, 0, "Warning: dump deduplication is not supported "
+				"with CRIU, ignored");
 
 	arg[0] = SCRIPTDIR "/vps-cpt";
 	arg[1] = NULL;
@@ -883,7 +891,9 @@ static int ct_chkpnt(vps_handler *h, envid_t veid,
 	env[1] = strdup(buf);
 	snprintf(buf, sizeof(buf), "VE_DUMP_DIR=%s", dumpfile);
 	env[2] = strdup(buf);
-	env[3] = NULL;
+	snprintf(buf, sizeof(buf), "VE_PRE_DUMP_ITER=%d", param->pre_dump_iter);
+	env[3] = strdup(buf);
+	env[4] = NULL;
 
 	ret = run_script(arg[0], arg, env, 0);
 	free_arg(env);
@@ -896,7 +906,7 @@ static int ct_chkpnt(vps_handler *h, envid_t veid,
 static int ct_restore_fn(vps_handler *h, envid_t veid, const vps_res *res,
 			  int wait_p, int old_wait_p, int err_p, void *data)
 {
-	char *argv[2], *env[9];
+	char *argv[2], *env[10];
 	char *dumpfile = NULL;
 	char *statefile = NULL;
 	cpt_param *param = data;
@@ -937,7 +947,10 @@ static int ct_restore_fn(vps_handler *h, envid_t veid, const vps_res *res,
 	env[6] = strdup(buf);
 	snprintf(buf, sizeof(buf), "VE_NETNS_FILE=%s/%d", NETNS_RUN_DIR, veid);
 	env[7] = strdup(buf);
-	env[8] = NULL;
+	snprintf(buf, sizeof(buf), "VE_LAZY_PAGES=%s",
+			param->lazy ? "yes" : "no");
+	env[8] = strdup(buf);
+	env[9] = NULL;
 
 	ret = run_script(argv[0], argv, env, 0);
 	free_arg(env);
@@ -952,6 +965,10 @@ static int ct_restore_fn(vps_handler *h, envid_t veid, const vps_res *res,
 static int ct_restore(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 	cpt_param *param, skipFlags skip)
 {
+	if (is_stdio_dump(param->dumpfile)) {
+		logger(-1, 0, "Restoring from stdin is not supported with CRIU");
+		return VZ_RESTORE_ERROR;
+	}
 	return vps_start_custom(h, veid, vps_p,
 			SKIP_CONFIGURE | SKIP_VETH_CREATE | skip,
 			NULL, ct_restore_fn, param);
@@ -37,6 +37,7 @@
 #include "env.h"
 #include "exec.h"
 #include "cpt.h"
+#include "cptstream.h"
 #include "util.h"
 #include "types.h"
 #include "logger.h"
@@ -637,13 +638,7 @@ static int real_chkpnt(int cpt_fd, envid_t veid, const char *root,
 			goto err_out;
 		}
 	}
-	if (cmd == CMD_CHKPNT) {
-		logger(0, 0, "\tkill...");
-		if (ioctl(cpt_fd, CPT_KILL, 0) < 0) {
-			logger(-1, errno, "Can not kill container");
-			goto err_out;
-		}
-	}
+	/* CMD_CHKPNT kill is done by vz_chkpnt(), once the dump is saved */
 	if (cmd == CMD_SUSPEND && !param->ctx) {
 		logger(0, 0, "\tget context...");
 		if (ioctl(cpt_fd, CPT_GET_CONTEXT, veid) < 0) {
@@ -686,11 +681,12 @@ do {										\
 static int vz_chkpnt(vps_handler *h, envid_t veid,
 		     const fs_param *fs, int cmd, cpt_param *param)
 {
-	int dump_fd = -1;
+	int dump_fd = -1, pipe_fd, streamed = param->compress;
 	char buf[PATH_LEN];
-	const char *dumpfile = NULL;
-	int cpt_fd, pid, ret;
+	const char *dumpfile = NULL, *chunks = NULL;
+	int cpt_fd, pid, ret, dumped;
 	const char *root = fs->root;
+	struct cpt_stream *stream = NULL;
 
 	ret = VZ_CHKPNT_ERROR;
 
@@ -703,10 +699,27 @@ static int vz_chkpnt(vps_handler *h, envid_t veid,
 			logger(-1, errno, "Unable to open " PROC_CPT);
 		return VZ_CHKPNT_ERROR;
 	}
+	if (param->pre_dump_iter)
+		logger(0, 0, "Warning: memory pre-dump is only supported "
+				"with CRIU, ignored");
 	if ((cmd == CMD_CHKPNT || cmd == CMD_DUMP)) {
 		GET_DUMP_FILE(CMD_DUMP);
-		make_dir(dumpfile, 0);
-		dump_fd = open(dumpfile, O_CREAT|O_TRUNC|O_RDWR, 0600);
+		if (is_stdio_dump(dumpfile)) {
+			/* Always framed, so that the reader can verify it */
+			dump_fd = param->dumpfd;
+			dumpfile = NULL;
+			streamed = 1;
+			if (param->dedup == YES)
+				logger(0, 0, "Warning: dump deduplication "
+						"needs a dump file, ignored");
+		} else {
+			if (param->dedup == YES) {
+				chunks = dumpfile;
+				streamed = 1;
+			}
+			make_dir(dumpfile, 0);
+			dump_fd = open(dumpfile, O_CREAT|O_TRUNC|O_RDWR, 0600);
+		}
 		if (dump_fd < 0) {
 			logger(-1, errno, "Can not create dump file %s",
 					dumpfile);
@@ -725,7 +738,20 @@ static int vz_chkpnt(vps_handler *h, envid_t veid,
 			goto err;
 		}
 	}
-	if (dump_fd != -1) {
+	if (dump_fd != -1 && streamed) {
+		/* The kernel writes to a pipe, we compress */
+		stream = cpt_stream_open(1, dump_fd, param->compress, chunks,
+				&pipe_fd);
+		if (stream == NULL)
+			goto err;
+		ret = ioctl(cpt_fd, CPT_SET_DUMPFD, pipe_fd);
+		close(pipe_fd);
+		if (ret < 0) {
+			ret = VZ_CHKPNT_ERROR;
+			logger(-1, errno, "Can not set dump file");
+			goto err;
+		}
+	} else if (dump_fd != -1) {
 		if (ioctl(cpt_fd, CPT_SET_DUMPFD, dump_fd) < 0) {
 			logger(-1, errno, "Can not set dump file");
 			goto err;
@@ -743,6 +769,8 @@ static int vz_chkpnt(vps_handler *h, envid_t veid,
 		ret = VZ_RESOURCE_ERROR;
 		goto err;
 	} else if (pid == 0) {
+		if (stream != NULL)
+			cpt_stream_close_fds(stream);
 		if ((ret = h->setcontext(veid)))
 			exit(ret);
 		if ((pid = fork()) < 0) {
@@ -755,26 +783,50 @@ static int vz_chkpnt(vps_handler *h, envid_t veid,
 		ret = env_wait(pid);
 		exit(ret);
 	}
-	close(cpt_fd);
-	cpt_fd = -1;
 	ret = env_wait(pid);
+	dumped = (ret == 0);
+	/* The dump must be complete and on disk before the CT is killed */
+	if (stream != NULL) {
+		if (cpt_stream_close(stream, ret != 0) && !ret)
+			ret = VZ_CHKPNT_ERROR;
+		stream = NULL;
+	}
+	if (!ret && dumpfile != NULL && fsync(dump_fd)) {
+		logger(-1, errno, "Unable to sync dump file %s", dumpfile);
+		ret = VZ_CHKPNT_ERROR;
+	}
+	if (cmd == CMD_CHKPNT && dumped) {
+		if (ret == 0) {
+			logger(0, 0, "\tkill...");
+			if (ioctl(cpt_fd, CPT_KILL, 0) < 0) {
+				logger(-1, errno, "Can not kill container");
+				ret = VZ_CHKPNT_ERROR;
+			}
+		} else {
+			logger(0, 0, "\tresume...");
+			clean_hardlink_dir(root);
+			if (ioctl(cpt_fd, CPT_RESUME, 0) < 0)
+				logger(-1, errno, "Can not resume container");
+		}
+	}
 	if (ret)
 		goto err;
-	ret = 0;
 	logger(0, 0, "Checkpointing completed successfully");
 err:
+	if (stream != NULL)
+		cpt_stream_close(stream, 1);
 	if (ret) {
 		ret = VZ_CHKPNT_ERROR;
 		logger(-1, 0, "Checkpointing failed");
 		if (cmd == CMD_CHKPNT || cmd == CMD_DUMP)
-			if (dumpfile)
+			if (dumpfile) {
 				unlink(dumpfile);
+				if (chunks)
+					cpt_chunks_remove(dumpfile);
+			}
 	}
-	if (dump_fd != -1) {
-		if (ret == 0)
-			fsync(dump_fd);
+	if (dump_fd != -1)
 		close(dump_fd);
-	}
 	if (cpt_fd != -1)
 		close(cpt_fd);
 
@@ -881,11 +933,15 @@ static int vz_restore(vps_handler *h, envid_t veid, vps_param *vps_p,
 			int cmd, cpt_param *param, skipFlags skip)
 {
 	int ret, rst_fd;
-	int dump_fd = -1;
+	int dump_fd = -1, pipe_fd = -1;
 	char buf[PATH_LEN];
 	const char *dumpfile = NULL;
+	struct cpt_stream *stream = NULL;
 
 	logger(0, 0, "Restoring container ...");
+	if (param->lazy)
+		logger(0, 0, "Warning: lazy restore is only supported "
+				"with CRIU, ignored");
 	ret = VZ_RESTORE_ERROR;
 	if ((rst_fd = open(PROC_RST, O_RDWR)) < 0) {
 		if (errno == ENOENT)
@@ -902,15 +958,34 @@ static int vz_restore(vps_handler *h, envid_t veid, vps_param *vps_p,
 		}
 	}
 	GET_DUMP_FILE(CMD_UNDUMP);
-	if (cmd == CMD_RESTORE || cmd == CMD_UNDUMP) {
+	if ((cmd == CMD_RESTORE || cmd == CMD_UNDUMP) &&
+			is_stdio_dump(dumpfile)) {
+		dump_fd = param->dumpfd;
+		dumpfile = NULL;
+		stream = cpt_stream_open(0, dump_fd, 0, NULL, &pipe_fd);
+		if (stream == NULL)
+			goto err;
+	} else if (cmd == CMD_RESTORE || cmd == CMD_UNDUMP) {
 		dump_fd = open(dumpfile, O_RDONLY);
 		if (dump_fd < 0) {
 			logger(-1, errno, "Unable to open %s", dumpfile);
 			goto err;
 		}
+		/* Compressed dump is fed to the kernel through a pipe */
+		if (is_cpt_stream(dump_fd)) {
+			stream = cpt_stream_open(0, dump_fd, 0, dumpfile,
+					&pipe_fd);
+			if (stream == NULL)
+				goto err;
+		}
 	}
 	if (dump_fd != -1) {
-		if (ioctl(rst_fd, CPT_SET_DUMPFD, dump_fd)) {
+		ret = ioctl(rst_fd, CPT_SET_DUMPFD,
+				pipe_fd != -1 ? pipe_fd : dump_fd);
+		if (pipe_fd != -1)
+			close(pipe_fd);
+		if (ret) {
+			ret = VZ_RESTORE_ERROR;
 			logger(-1, errno, "Can't set dumpfile");
 			goto err;
 		}
@@ -921,14 +996,28 @@ static int vz_restore(vps_handler *h, envid_t veid, vps_param *vps_p,
 			SKIP_CONFIGURE | skip,
 			NULL, restore_fn, param);
 err:
+	/* The kernel has read all it needs by now, check the rest of the
+	 * dump is intact, up to its trailer */
+	if (stream != NULL && cpt_stream_close(stream, ret != 0) && !ret) {
+		logger(-1, 0, "The dump is corrupted, killing the container");
+		if (cmd == CMD_UNDUMP)
+			cpt_cmd(h, veid, vps_p->res.fs.root, CMD_RESTORE,
+					CMD_KILL, param->ctx);
+		else
+			vps_stop(h, veid, vps_p, M_KILL,
+					SKIP_ACTION_SCRIPT | skip, NULL);
+		ret = VZ_RESTORE_ERROR;
+	}
 	close(rst_fd);
 	if (dump_fd != -1)
 		close(dump_fd);
 	if (!ret) {
 		logger(0, 0, "Restoring completed successfully");
 		if ((cmd == CMD_RESTORE) && (dumpfile) &&
-				!(skip & SKIP_DUMPFILE_UNLINK))
+				!(skip & SKIP_DUMPFILE_UNLINK)) {
 			unlink(dumpfile);
+			cpt_chunks_remove(dumpfile);
+		}
 	}
 	return ret;
 }
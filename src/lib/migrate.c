@@ -0,0 +1,1101 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "migrate.h"
+#include "dirsnap.h"
+#include "logger.h"
+#include "util.h"
+#include "exec.h"
+#include "vzerror.h"
+
+/* ploop copy data and feedback channel fd */
+#define PLOOP_COPY_FD		5
+/* rsync: partial transfer due to vanished source files */
+#define RSYNC_VANISHED		24
+
+struct mig_ctx {
+	struct mig_param *p;
+	struct mig_times *tm;
+	int suspended;		/* CT is suspended (stopped, unmounted) */
+	int undumped;		/* CT is undumped on destination */
+	int dumpfile;		/* dump file is copied to destination */
+	struct dir_snap *snap;	/* private area before the first sync */
+};
+
+/* A child process we wait for */
+struct mig_job {
+	pid_t pid;
+	int ret;
+	struct timespec *end;	/* filled on exit, may be NULL */
+};
+
+static void now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static int cmd_add(struct mig_cmd *c, const char *arg)
+{
+	if (c->argc >= MIG_MAX_ARGS) {
+		logger(-1, 0, "Too many arguments for %s", c->argv[0]);
+		return -1;
+	}
+	if ((c->argv[c->argc] = strdup(arg)) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		return -1;
+	}
+	c->argv[++c->argc] = NULL;
+
+	return 0;
+}
+
+static int cmd_addf(struct mig_cmd *c, const char *fmt, ...)
+{
+	char buf[PATH_MAX];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	return cmd_add(c, buf);
+}
+
+/* Add whitespace separated arguments, no quoting is supported */
+static int cmd_add_str(struct mig_cmd *c, const char *str)
+{
+	char *buf, *tok, *sp;
+	int ret = 0;
+
+	if (str == NULL)
+		return 0;
+	if ((buf = strdup(str)) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		return -1;
+	}
+	for (tok = strtok_r(buf, " \t\n", &sp); tok != NULL;
+			tok = strtok_r(NULL, " \t\n", &sp))
+		if ((ret = cmd_add(c, tok)))
+			break;
+	free(buf);
+
+	return ret;
+}
+
+static void cmd_free(struct mig_cmd *c)
+{
+	int i;
+
+	for (i = 0; i < c->argc; i++)
+		free(c->argv[i]);
+	c->argc = 0;
+	c->argv[0] = NULL;
+}
+
+/* Quote arguments for a remote shell */
+static char *shell_quote(char *argv[])
+{
+	char *buf, *p;
+	const char *s;
+	size_t len = 1;
+	int i;
+
+	for (i = 0; argv[i] != NULL; i++)
+		len += strlen(argv[i]) * 4 + 3;
+	if ((buf = malloc(len)) == NULL)
+		return NULL;
+	p = buf;
+	for (i = 0; argv[i] != NULL; i++) {
+		if (i)
+			*p++ = ' ';
+		*p++ = '\'';
+		for (s = argv[i]; *s; s++) {
+			if (*s == '\'') {
+				memcpy(p, "'\\''", 4);
+				p += 4;
+			} else {
+				*p++ = *s;
+			}
+		}
+		*p++ = '\'';
+	}
+	*p = '\0';
+
+	return buf;
+}
+
+/* Run a program with stdin and stdout redirected to in and out,
+ * and extra descriptor available as PLOOP_COPY_FD (-1 for none).
+ */
+static int spawn(char *argv[], int in, int out, int extra, pid_t *pid)
+{
+	char *cmd;
+
+	if ((cmd = arg2str(argv)) != NULL) {
+		logger(2, 0, "Running: %s", cmd);
+		free(cmd);
+	}
+	if ((*pid = fork()) < 0) {
+		logger(-1, errno, "Unable to fork");
+		return -1;
+	} else if (*pid == 0) {
+		if (in != -1)
+			dup2(in, STDIN_FILENO);
+		if (out != -1)
+			dup2(out, STDOUT_FILENO);
+		if (extra == PLOOP_COPY_FD) {
+			fcntl(extra, F_SETFD, 0);
+			close_fds(0, PLOOP_COPY_FD, -1);
+		} else if (extra != -1) {
+			dup2(extra, PLOOP_COPY_FD);
+			close_fds(0, PLOOP_COPY_FD, -1);
+		} else {
+			close_fds(0, -1);
+		}
+		execvp(argv[0], argv);
+		logger(-1, errno, "Unable to exec %s", argv[0]);
+		_exit(127);
+	}
+
+	return 0;
+}
+
+/* Wait for all jobs to finish, recording the time each one is done */
+static void wait_jobs(struct mig_job *jobs, int n)
+{
+	int i, left = 0, status;
+	pid_t pid;
+
+	for (i = 0; i < n; i++)
+		if (jobs[i].pid > 0)
+			left++;
+	while (left > 0) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Error in waitpid()");
+			break;
+		}
+		for (i = 0; i < n && jobs[i].pid != pid; i++);
+		if (i == n || WIFSTOPPED(status) || WIFCONTINUED(status))
+			continue;
+		if (jobs[i].end != NULL)
+			now(jobs[i].end);
+		if (WIFEXITED(status))
+			jobs[i].ret = WEXITSTATUS(status);
+		else
+			jobs[i].ret = VZ_SYSTEM_ERROR;
+		jobs[i].pid = 0;
+		left--;
+	}
+	/* Should not happen, but do not leave anything behind */
+	for (i = 0; i < n; i++)
+		if (jobs[i].pid > 0)
+			jobs[i].ret = env_wait(jobs[i].pid);
+}
+
+/* Local transport: "remote" commands are run on this node */
+static int local_exec(struct mig_transport *t, char *argv[], int flags,
+		int *fd, pid_t *pid)
+{
+	int sp[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp)) {
+		logger(-1, errno, "Unable to create socket pair");
+		return -1;
+	}
+	if (spawn(argv, sp[1], flags & MIG_EXEC_INPUT ? STDERR_FILENO : sp[1],
+				-1, pid))
+	{
+		close(sp[0]);
+		close(sp[1]);
+		return -1;
+	}
+	close(sp[1]);
+	*fd = sp[0];
+
+	return 0;
+}
+
+static int local_rsync(struct mig_transport *t, struct mig_cmd *cmd,
+		const char *src, const char *dst)
+{
+	if (cmd_add(cmd, src) || cmd_add(cmd, dst))
+		return -1;
+
+	return 0;
+}
+
+static void local_destroy(struct mig_transport *t)
+{
+	free(t);
+}
+
+struct mig_transport *mig_local_transport(void)
+{
+	struct mig_transport *t;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		return NULL;
+	}
+	t->name = "local";
+	t->exec = local_exec;
+	t->rsync = local_rsync;
+	t->destroy = local_destroy;
+
+	return t;
+}
+
+/* ssh transport: remote stdin and stdout are the ssh ones, so one
+ * ssh session gives a two-way channel, no port forwarding is needed.
+ */
+struct ssh_transport {
+	struct mig_transport t;
+	char *dest;		/* root@host */
+	char *opts;
+};
+
+static int ssh_cmd(struct ssh_transport *s, struct mig_cmd *c)
+{
+	if (cmd_add(c, "ssh") || cmd_add_str(c, s->opts))
+		return -1;
+
+	return 0;
+}
+
+static int ssh_exec(struct mig_transport *t, char *argv[], int flags,
+		int *fd, pid_t *pid)
+{
+	struct ssh_transport *s = (struct ssh_transport *)t;
+	struct mig_cmd c = {};
+	char *cmd;
+	int ret = -1;
+
+	if ((cmd = shell_quote(argv)) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		return -1;
+	}
+	if (!ssh_cmd(s, &c) && !cmd_add(&c, s->dest) && !cmd_add(&c, cmd))
+		ret = local_exec(t, c.argv, flags, fd, pid);
+	cmd_free(&c);
+	free(cmd);
+
+	return ret;
+}
+
+static int ssh_rsync(struct mig_transport *t, struct mig_cmd *cmd,
+		const char *src, const char *dst)
+{
+	struct ssh_transport *s = (struct ssh_transport *)t;
+	char *rsh;
+	int ret;
+
+	rsh = arg2str((char *[]){ "ssh", s->opts ? : "", NULL });
+	if (rsh == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		return -1;
+	}
+	ret = cmd_add(cmd, "-e") || cmd_add(cmd, rsh) || cmd_add(cmd, src) ||
+		cmd_addf(cmd, "%s:%s", s->dest, dst);
+	free(rsh);
+
+	return ret ? -1 : 0;
+}
+
+static void ssh_destroy(struct mig_transport *t)
+{
+	struct ssh_transport *s = (struct ssh_transport *)t;
+
+	free(s->dest);
+	free(s->opts);
+	free(s);
+}
+
+struct mig_transport *mig_ssh_transport(const char *host,
+		const char *ssh_opts)
+{
+	struct ssh_transport *s;
+	char buf[STR_SIZE];
+
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		return NULL;
+	}
+	snprintf(buf, sizeof(buf), "root@%s", host);
+	s->dest = strdup(buf);
+	if (ssh_opts != NULL)
+		s->opts = strdup(ssh_opts);
+	if (s->dest == NULL || (ssh_opts != NULL && s->opts == NULL)) {
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		ssh_destroy(&s->t);
+		return NULL;
+	}
+	s->t.name = "ssh";
+	s->t.exec = ssh_exec;
+	s->t.rsync = ssh_rsync;
+	s->t.destroy = ssh_destroy;
+
+	return &s->t;
+}
+
+static int vzctl_cmd(struct mig_cmd *c, const char *vzctl, const char *cmd,
+		envid_t veid, const char *args)
+{
+	if (cmd_add_str(c, vzctl) || cmd_add(c, cmd) ||
+			cmd_addf(c, "%d", veid) || cmd_add_str(c, args))
+		return -1;
+
+	return 0;
+}
+
+static int run_local(struct mig_cmd *c)
+{
+	pid_t pid;
+
+	if (spawn(c->argv, -1, -1, -1, &pid))
+		return -1;
+
+	return env_wait(pid);
+}
+
+static int run_vzctl(struct mig_param *p, const char *cmd, const char *args)
+{
+	struct mig_cmd c = {};
+	int ret = -1;
+
+	if (!vzctl_cmd(&c, p->vzctl, cmd, p->veid, args))
+		ret = run_local(&c);
+	cmd_free(&c);
+
+	return ret;
+}
+
+static int run_remote(struct mig_param *p, struct mig_cmd *c)
+{
+	pid_t pid;
+	int fd;
+
+	if (p->t->exec(p->t, c->argv, MIG_EXEC_INPUT, &fd, &pid))
+		return -1;
+	close(fd);
+
+	return env_wait(pid);
+}
+
+static int run_vzctl_remote(struct mig_param *p, const char *cmd,
+		const char *args)
+{
+	struct mig_cmd c = {};
+	int ret = -1;
+
+	if (!vzctl_cmd(&c, p->vzctl_remote, cmd, p->veid, args))
+		ret = run_remote(p, &c);
+	cmd_free(&c);
+
+	return ret;
+}
+
+/* Add source and destination to an rsync command, and run it */
+static int spawn_rsync(struct mig_param *p, struct mig_cmd *c, pid_t *pid)
+{
+	char src[PATH_MAX], dst[PATH_MAX];
+
+	snprintf(src, sizeof(src), "%s/", p->private);
+	snprintf(dst, sizeof(dst), "%s/", p->private_remote);
+	if (p->t->rsync(p->t, c, src, dst))
+		return -1;
+
+	return spawn(c->argv, -1, -1, -1, pid);
+}
+
+static int start_sync(struct mig_param *p, int first, pid_t *pid)
+{
+	struct mig_cmd c = {};
+	int ret = -1;
+
+	if (cmd_add(&c, "rsync") || cmd_add_str(&c, p->rsync_opts))
+		goto out;
+	if (first && p->ploop_dev == NULL && cmd_add(&c, "--sparse"))
+		goto out;
+	/* The top delta is copied by ploop copy */
+	if (first && p->ploop_dev != NULL && p->state == MIG_RUNNING &&
+			(cmd_add(&c, "--exclude") || cmd_add(&c, p->top_delta)))
+		goto out;
+	if (spawn_rsync(p, &c, pid))
+		goto out;
+	ret = 0;
+out:
+	cmd_free(&c);
+
+	return ret;
+}
+
+static int sync_result(int ret, int first)
+{
+	/* Files can only vanish while the CT is running */
+	if (first && ret == RSYNC_VANISHED)
+		ret = 0;
+	if (ret)
+		logger(-1, 0, "Failed to sync container private area");
+
+	return ret;
+}
+
+/* Run rsync for files listed (NUL-separated) in a file */
+static int start_list_sync(struct mig_param *p, const char *list,
+		const char *args, pid_t *pid)
+{
+	struct mig_cmd c = {};
+	int ret = -1;
+
+	if (cmd_add(&c, "rsync") || cmd_add_str(&c, p->rsync_opts) ||
+			cmd_add_str(&c, args) || cmd_add(&c, "--from0") ||
+			cmd_addf(&c, "--files-from=%s", list) ||
+			spawn_rsync(p, &c, pid))
+		goto out;
+	ret = 0;
+out:
+	cmd_free(&c);
+
+	return ret;
+}
+
+static int run_list_sync(struct mig_param *p, const char *list,
+		const char *args)
+{
+	pid_t pid;
+
+	if (start_list_sync(p, list, args, &pid))
+		return -1;
+
+	return env_wait(pid);
+}
+
+static int write_path(FILE *fp, const char *path)
+{
+	return fwrite(path, strlen(path) + 1, 1, fp) == 1 ? 0 : -1;
+}
+
+/* Per-file overhead, in bytes, when balancing files between jobs */
+#define SYNC_FILE_COST		4096
+
+/* Write file lists for delta sync: "meta" has directories and deleted
+ * entries, "files.N" have files, spread evenly between jobs. Hard
+ * linked files all go to the same job, so that rsync -H sees them.
+ * Returns the number of files lists.
+ */
+static int write_sync_lists(struct dir_delta *d, const char *dir, int jobs)
+{
+	unsigned long long load[MIG_MAX_SYNC_JOBS] = {};
+	FILE *fp[MIG_MAX_SYNC_JOBS + 1] = {};
+	char path[PATH_MAX];
+	int i, j, k, n, ret = -1;
+
+	n = jobs < d->nfiles ? jobs : d->nfiles;
+	snprintf(path, sizeof(path), "%s/meta", dir);
+	if ((fp[n] = fopen(path, "w")) == NULL)
+		goto err;
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/files.%d", dir, i);
+		if ((fp[i] = fopen(path, "w")) == NULL)
+			goto err;
+	}
+	for (i = 0; i < d->n; i++) {
+		switch (d->ch[i].type) {
+		case DS_DIR:
+		case DS_DELETED:
+			j = n;
+			break;
+		case DS_HLINK:
+			j = 0;
+			break;
+		default:
+			/* The least loaded one */
+			for (j = 0, k = 1; k < n; k++)
+				if (load[k] < load[j])
+					j = k;
+			break;
+		}
+		if (j < n)
+			load[j] += d->ch[i].size + SYNC_FILE_COST;
+		if (write_path(fp[j], d->ch[i].path))
+			goto err;
+	}
+	ret = n;
+err:
+	if (ret < 0)
+		logger(-1, errno, "Unable to write file list in %s", dir);
+	for (i = 0; i <= n; i++)
+		if (fp[i] != NULL && fclose(fp[i]) && ret >= 0) {
+			logger(-1, errno, "Unable to write file list in %s",
+					dir);
+			ret = -1;
+		}
+
+	return ret;
+}
+
+/* Second sync of a simfs private area, sending only what was changed
+ * since the snapshot taken before the first sync: create directories
+ * and remove deleted entries, copy files on several jobs in parallel,
+ * then fix directory times spoiled by the copy.
+ * Returns rsync exit code.
+ */
+static int delta_sync(struct mig_ctx *ctx)
+{
+	struct mig_param *p = ctx->p;
+	struct mig_job jobs[MIG_MAX_SYNC_JOBS] = {};
+	struct dir_delta d;
+	char dir[] = "/tmp/vzmigrate.XXXXXX";
+	char meta[PATH_MAX], buf[PATH_MAX];
+	int i, n, ret;
+
+	if (dir_snap_diff(ctx->snap, p->private, p->sync_jobs, &d)) {
+		logger(0, 0, "Falling back to full sync");
+		return start_sync(p, 0, &jobs[0].pid) ? -1 :
+			env_wait(jobs[0].pid);
+	}
+	logger(1, 0, "Changed since first sync: %d files (%llu bytes), "
+			"%d directories, %d deleted", d.nfiles, d.bytes,
+			d.ndirs, d.ndeleted);
+	if (d.n == 0) {
+		dir_delta_free(&d);
+		return 0;
+	}
+	if (mkdtemp(dir) == NULL) {
+		logger(-1, errno, "Unable to create temporary directory");
+		dir_delta_free(&d);
+		return -1;
+	}
+	snprintf(meta, sizeof(meta), "%s/meta", dir);
+	ret = -1;
+	if ((n = write_sync_lists(&d, dir, p->sync_jobs)) < 0)
+		goto out;
+	if (d.ndirs + d.ndeleted > 0 &&
+			(ret = run_list_sync(p, meta, "--delete-missing-args")))
+		goto out;
+	for (i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), "%s/files.%d", dir, i);
+		if (start_list_sync(p, buf, NULL, &jobs[i].pid))
+			break;
+	}
+	ret = i < n ? -1 : 0;
+	wait_jobs(jobs, i);
+	for (i = 0; i < n && !ret; i++)
+		ret = jobs[i].ret;
+	if (!ret && n > 0 && d.ndirs > 0)
+		ret = run_list_sync(p, meta, "--delete-missing-args");
+out:
+	unlink(meta);
+	for (i = 0; i < MIG_MAX_SYNC_JOBS; i++) {
+		snprintf(buf, sizeof(buf), "%s/files.%d", dir, i);
+		unlink(buf);
+	}
+	rmdir(dir);
+	dir_delta_free(&d);
+
+	return ret;
+}
+
+/* Start the second sync, a delta one if there is a snapshot */
+static int start_sync2(struct mig_ctx *ctx, pid_t *pid)
+{
+	int ret;
+
+	if (ctx->snap == NULL)
+		return start_sync(ctx->p, 0, pid);
+	if ((*pid = fork()) < 0) {
+		logger(-1, errno, "Unable to fork");
+		return -1;
+	} else if (*pid == 0) {
+		ret = delta_sync(ctx);
+		_exit(ret < 0 || ret > 255 ? 1 : ret);
+	}
+
+	return 0;
+}
+
+/* Copy the top delta with ploop copy while the first sync goes on.
+ * Once ploop copy converges, it runs a command that waits for the sync
+ * to finish, then suspends (stops) the CT, and copies the rest.
+ * The command talks to us via two FIFOs: "gate" to get a go-ahead, and
+ * "mark" to report the exact moment the CT is about to be suspended.
+ */
+static int ploop_copy(struct mig_ctx *ctx, pid_t sync_pid)
+{
+	struct mig_param *p = ctx->p;
+	struct mig_times *tm = ctx->tm;
+	struct mig_cmd rc = {}, lc = {};
+	struct mig_job jobs[2] = {};
+	struct pollfd pfd;
+	siginfo_t info;
+	char dir[] = "/tmp/vzmigrate.XXXXXX";
+	char gate[PATH_MAX], mark[PATH_MAX], buf[PATH_MAX];
+	int gate_fd = -1, mark_fd = -1, fd, sync_ret, ret = -1;
+
+	if (mkdtemp(dir) == NULL) {
+		logger(-1, errno, "Unable to create temporary directory");
+		wait_jobs(&(struct mig_job){ .pid = sync_pid }, 1);
+		return -1;
+	}
+	snprintf(gate, sizeof(gate), "%s/gate", dir);
+	snprintf(mark, sizeof(mark), "%s/mark", dir);
+	if (mkfifo(gate, 0600) || mkfifo(mark, 0600)) {
+		logger(-1, errno, "Unable to create FIFO in %s", dir);
+		goto err;
+	}
+	/* Opened read-write, so writing never blocks and data is kept */
+	if ((gate_fd = open(gate, O_RDWR | O_CLOEXEC)) < 0 ||
+			(mark_fd = open(mark, O_RDONLY | O_NONBLOCK |
+					O_CLOEXEC)) < 0)
+	{
+		logger(-1, errno, "Unable to open FIFO in %s", dir);
+		goto err;
+	}
+
+	if (cmd_add(&rc, "ploop") ||
+			(p->verbose > 1 && cmd_add(&rc, "-vvvv")) ||
+			cmd_add(&rc, "copy") || cmd_add(&rc, "-d") ||
+			cmd_addf(&rc, "%s/%s", p->private_remote,
+				p->top_delta) ||
+			cmd_add(&rc, "-i0") || cmd_add(&rc, "-f1"))
+		goto err;
+	if (p->online)
+		snprintf(buf, sizeof(buf), "%s chkpnt %d --suspend %s",
+				p->vzctl, p->veid, p->suspend_opts ? : "");
+	else
+		snprintf(buf, sizeof(buf), "%s stop %d --skip-umount",
+				p->vzctl, p->veid);
+	if (cmd_add(&lc, "ploop") ||
+			(p->verbose > 1 && cmd_add(&lc, "-vvvv")) ||
+			cmd_add(&lc, "copy") ||
+			cmd_add(&lc, "-s") ||
+			cmd_addf(&lc, "/dev/%s", p->ploop_dev) ||
+			cmd_add(&lc, "-F") ||
+			cmd_addf(&lc, "read go < %s && [ \"$go\" = go ] && "
+				"echo > %s && %s 1>&2", gate, mark, buf) ||
+			cmd_addf(&lc, "-o%d", PLOOP_COPY_FD) ||
+			cmd_addf(&lc, "-f%d", PLOOP_COPY_FD))
+		goto err;
+
+	logger(0, 0, "Copying top ploop delta");
+	if (p->t->exec(p->t, rc.argv, 0, &fd, &jobs[0].pid))
+		goto err;
+	if (spawn(lc.argv, -1, -1, fd, &jobs[1].pid)) {
+		close(fd);
+		goto err;
+	}
+	close(fd);
+
+	sync_ret = env_wait(sync_pid);
+	now(&tm->phase[MIG_PH_SYNC][1]);
+	sync_ret = sync_result(sync_ret, 1);
+	/* Let ploop copy finish, but not suspend the CT on error */
+	if (write(gate_fd, sync_ret ? "stop\n" : "go\n",
+				sync_ret ? 5 : 3) < 0)
+		logger(-1, errno, "Unable to write to %s", gate);
+
+	/* Catch the suspend moment while ploop copy is running */
+	while (mark_fd != -1) {
+		pfd.fd = mark_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0 ||
+				(waitid(P_PID, jobs[1].pid, &info, WEXITED |
+					WNOHANG | WNOWAIT) == 0 &&
+				 info.si_pid == jobs[1].pid))
+		{
+			if (read(mark_fd, buf, sizeof(buf)) > 0) {
+				now(&tm->suspend);
+				tm->phase[MIG_PH_PCOPY][0] = tm->suspend;
+				ctx->suspended = 1;
+			}
+			close(mark_fd);
+			mark_fd = -1;
+		}
+	}
+	jobs[1].end = &tm->phase[MIG_PH_PCOPY][1];
+	wait_jobs(jobs, 2);
+	if (sync_ret)
+		goto err;
+	if (jobs[1].ret || jobs[0].ret) {
+		logger(-1, 0, "Failed to copy top ploop delta");
+		goto err;
+	}
+	if (!ctx->suspended) {
+		logger(-1, 0, "Container was not suspended by ploop copy");
+		goto err;
+	}
+	ret = 0;
+err:
+	if (gate_fd != -1)
+		close(gate_fd);
+	if (mark_fd != -1)
+		close(mark_fd);
+	unlink(gate);
+	unlink(mark);
+	rmdir(dir);
+	cmd_free(&rc);
+	cmd_free(&lc);
+
+	return ret;
+}
+
+/* Stream the dump to destination, either into vzctl restore directly,
+ * or into a dump file. Runs concurrently with the second sync, if any.
+ */
+static int dump(struct mig_ctx *ctx, int to_file, pid_t sync_pid)
+{
+	struct mig_param *p = ctx->p;
+	struct mig_times *tm = ctx->tm;
+	struct mig_cmd rc = {}, lc = {};
+	struct mig_job jobs[3] = {};
+	char buf[PATH_MAX];
+	int fd, ret = MIG_ERR_COPY;
+
+	jobs[2].pid = sync_pid;
+	jobs[2].end = &tm->phase[MIG_PH_SYNC2][1];
+	if (to_file) {
+		snprintf(buf, sizeof(buf), "cat > %s", p->dumpfile_remote);
+		if (cmd_add(&rc, "sh") || cmd_add(&rc, "-c") ||
+				cmd_add(&rc, buf))
+			goto err;
+	} else if (vzctl_cmd(&rc, p->vzctl_remote, "restore", p->veid,
+				"--undump --dumpfile - --skip_arpdetect")) {
+		goto err;
+	}
+	if (vzctl_cmd(&lc, p->vzctl, "chkpnt", p->veid,
+				"--dump --dumpfile -"))
+		goto err;
+
+	logger(0, 0, to_file ? "Dumping container" :
+			"Dumping and undumping container");
+	if (p->t->exec(p->t, rc.argv, MIG_EXEC_INPUT, &fd, &jobs[0].pid))
+		goto err;
+	if (to_file)
+		ctx->dumpfile = 1;
+	if (spawn(lc.argv, -1, fd, -1, &jobs[1].pid)) {
+		close(fd);
+		goto err;
+	}
+	close(fd);
+	jobs[0].end = &tm->phase[MIG_PH_DUMP][1];
+	wait_jobs(jobs, 3);
+	jobs[2].pid = 0;
+
+	if (jobs[1].ret) {
+		logger(-1, 0, "Failed to dump container");
+		ret = MIG_ERR_STOP_SOURCE;
+	} else if (jobs[0].ret) {
+		logger(-1, 0, to_file ? "Failed to copy dump" :
+				"Failed to undump container");
+		ret = to_file ? MIG_ERR_COPY : MIG_ERR_START_VPS;
+	} else {
+		if (!to_file)
+			ctx->undumped = 1;
+		ret = 0;
+	}
+	if (sync_pid > 0 && sync_result(jobs[2].ret, 0) && !ret)
+		ret = MIG_ERR_COPY;
+err:
+	/* Do not leave the second sync behind on error */
+	if (jobs[2].pid > 0)
+		wait_jobs(&jobs[2], 1);
+	cmd_free(&rc);
+	cmd_free(&lc);
+
+	return ret;
+}
+
+static int run_quota(struct mig_ctx *ctx)
+{
+	struct mig_param *p = ctx->p;
+	struct mig_cmd c = {};
+	int ret = 0;
+
+	if (p->quota_cmd == NULL)
+		return 0;
+	logger(0, 0, "Syncing 2nd level quota");
+	now(&ctx->tm->phase[MIG_PH_QUOTA][0]);
+	if (cmd_add(&c, "/bin/sh") || cmd_add(&c, "-c") ||
+			cmd_add(&c, p->quota_cmd) || run_local(&c))
+	{
+		logger(-1, 0, "Failed to sync 2nd level quota");
+		ret = MIG_ERR_QUOTA;
+	}
+	now(&ctx->tm->phase[MIG_PH_QUOTA][1]);
+	cmd_free(&c);
+
+	return ret;
+}
+
+static void remove_dumpfile(struct mig_ctx *ctx)
+{
+	struct mig_cmd c = {};
+
+	if (!ctx->dumpfile)
+		return;
+	if (!cmd_add(&c, "rm") && !cmd_add(&c, "-f") &&
+			!cmd_add(&c, ctx->p->dumpfile_remote))
+		run_remote(ctx->p, &c);
+	cmd_free(&c);
+	ctx->dumpfile = 0;
+}
+
+/* Return the CT on source to its original state */
+static void rollback(struct mig_ctx *ctx)
+{
+	struct mig_param *p = ctx->p;
+
+	if (ctx->undumped)
+		run_vzctl_remote(p, "restore", "--kill");
+	remove_dumpfile(ctx);
+	if (!ctx->suspended)
+		return;
+	if (p->online)
+		run_vzctl(p, "chkpnt", "--resume");
+	else if (p->state == MIG_RUNNING)
+		run_vzctl(p, "start", NULL);
+	else if (p->state == MIG_MOUNTED)
+		run_vzctl(p, "mount", NULL);
+}
+
+static int suspend(struct mig_ctx *ctx)
+{
+	struct mig_param *p = ctx->p;
+	char buf[STR_SIZE];
+	int ret;
+
+	now(&ctx->tm->suspend);
+	if (p->state == MIG_MOUNTED) {
+		logger(0, 0, "Unmounting container");
+		ret = run_vzctl(p, "umount", NULL);
+	} else if (p->online) {
+		logger(0, 0, "Suspending container");
+		snprintf(buf, sizeof(buf), "--suspend %s",
+				p->suspend_opts ? : "");
+		ret = run_vzctl(p, "chkpnt", buf);
+	} else {
+		logger(0, 0, "Stopping container");
+		ret = run_vzctl(p, "stop", NULL);
+	}
+	if (ret) {
+		logger(-1, 0, "Failed to stop container");
+		return MIG_ERR_STOP_SOURCE;
+	}
+	ctx->suspended = 1;
+
+	return 0;
+}
+
+static int restore(struct mig_ctx *ctx, int sync2)
+{
+	struct mig_param *p = ctx->p;
+	struct mig_times *tm = ctx->tm;
+	/* Nothing to do between dump and undump, so do both at once */
+	int direct = !sync2 && p->quota_cmd == NULL;
+	char buf[PATH_MAX];
+	pid_t sync_pid = 0;
+	int ret;
+
+	now(&tm->phase[MIG_PH_DUMP][0]);
+	if (sync2) {
+		now(&tm->phase[MIG_PH_SYNC2][0]);
+		if (start_sync2(ctx, &sync_pid))
+			return MIG_ERR_COPY;
+	}
+	if ((ret = dump(ctx, !direct, sync_pid)))
+		return ret;
+	if ((ret = run_quota(ctx)))
+		return ret;
+	if (!direct) {
+		logger(0, 0, "Undumping container");
+		now(&tm->phase[MIG_PH_UNDUMP][0]);
+		snprintf(buf, sizeof(buf), "--undump --dumpfile %s "
+				"--skip_arpdetect", p->dumpfile_remote);
+		ret = run_vzctl_remote(p, "restore", buf);
+		now(&tm->phase[MIG_PH_UNDUMP][1]);
+		if (ret) {
+			logger(-1, 0, "Failed to undump container");
+			return MIG_ERR_START_VPS;
+		}
+		ctx->undumped = 1;
+	}
+
+	logger(0, 0, "Resuming container");
+	now(&tm->phase[MIG_PH_START][0]);
+	ret = run_vzctl_remote(p, "restore", "--resume");
+	now(&tm->phase[MIG_PH_START][1]);
+	if (ret) {
+		logger(-1, 0, "Failed to resume container");
+		return MIG_ERR_START_VPS;
+	}
+	tm->finish = tm->phase[MIG_PH_START][1];
+
+	return 0;
+}
+
+static int start(struct mig_ctx *ctx, int sync2)
+{
+	struct mig_param *p = ctx->p;
+	struct mig_times *tm = ctx->tm;
+	struct mig_job job = {};
+	int ret;
+
+	if (sync2) {
+		logger(0, 0, "Syncing private area (2nd pass)");
+		now(&tm->phase[MIG_PH_SYNC2][0]);
+		if (start_sync2(ctx, &job.pid))
+			return MIG_ERR_COPY;
+		job.end = &tm->phase[MIG_PH_SYNC2][1];
+		wait_jobs(&job, 1);
+		if (sync_result(job.ret, 0))
+			return MIG_ERR_COPY;
+	}
+	if ((ret = run_quota(ctx)))
+		return ret;
+	if (p->state == MIG_STOPPED)
+		return 0;
+
+	logger(0, 0, p->state == MIG_RUNNING ? "Starting container" :
+			"Mounting container");
+	now(&tm->phase[MIG_PH_START][0]);
+	ret = run_vzctl_remote(p, p->state == MIG_RUNNING ?
+			"start" : "mount", NULL);
+	now(&tm->phase[MIG_PH_START][1]);
+	if (ret) {
+		logger(-1, 0, "Failed to start container");
+		return MIG_ERR_START_VPS;
+	}
+	tm->finish = tm->phase[MIG_PH_START][1];
+
+	return 0;
+}
+
+int vz_migrate(struct mig_param *p, struct mig_times *times)
+{
+	struct mig_times tmp;
+	struct mig_ctx ctx = {
+		.p = p,
+		.tm = times != NULL ? times : &tmp,
+	};
+	struct mig_times *tm = ctx.tm;
+	int pcopy = p->ploop_dev != NULL && p->state == MIG_RUNNING;
+	int sync2 = p->ploop_dev == NULL && p->state == MIG_RUNNING;
+	pid_t sync_pid;
+	int ret;
+
+	memset(tm, 0, sizeof(*tm));
+	logger(0, 0, "Syncing private area (%s transport)", p->t->name);
+	now(&tm->phase[MIG_PH_SYNC][0]);
+	/* Remember what the first sync is to copy, so that
+	 * the second one only sends the difference */
+	if (sync2 && p->sync_jobs > 0) {
+		logger(1, 0, "Taking snapshot of private area");
+		if ((ctx.snap = dir_snap_take(p->private,
+						p->sync_jobs)) == NULL)
+			logger(0, 0, "Second sync will be a full one");
+		else
+			logger(1, 0, "%d entries in snapshot",
+					dir_snap_size(ctx.snap));
+	}
+	if (start_sync(p, 1, &sync_pid)) {
+		ret = MIG_ERR_COPY;
+		goto out;
+	}
+	if (pcopy) {
+		ret = ploop_copy(&ctx, sync_pid) ? MIG_ERR_COPY : 0;
+		if (!ret && !p->online && run_vzctl(p, "umount", NULL)) {
+			logger(-1, 0, "Failed to umount container");
+			ret = MIG_ERR_STOP_SOURCE;
+		}
+	} else {
+		ret = env_wait(sync_pid);
+		now(&tm->phase[MIG_PH_SYNC][1]);
+		if (sync_result(ret, 1)) {
+			ret = MIG_ERR_COPY;
+			goto out;
+		}
+		ret = p->state != MIG_STOPPED ? suspend(&ctx) : 0;
+	}
+	if (!ret)
+		ret = p->online ? restore(&ctx, sync2) : start(&ctx, sync2);
+	if (ret) {
+		rollback(&ctx);
+		goto out;
+	}
+
+	logger(0, 0, "Cleaning up");
+	if (p->online) {
+		run_vzctl(p, "chkpnt", "--kill");
+		run_vzctl(p, "umount", NULL);
+	}
+	remove_dumpfile(&ctx);
+out:
+	dir_snap_free(ctx.snap);
+
+	return ret;
+}
+
+static double elapsed(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+		(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+void mig_print_times(struct mig_times *tm)
+{
+	static const char *names[MIG_PH_MAX] = {
+		[MIG_PH_SYNC]	= "First sync",
+		[MIG_PH_PCOPY]	= "Pcopy after suspend",
+		[MIG_PH_DUMP]	= "Dump + copy",
+		[MIG_PH_SYNC2]	= "Second sync",
+		[MIG_PH_QUOTA]	= "2nd level quota",
+		[MIG_PH_UNDUMP]	= "Undump",
+		[MIG_PH_START]	= "Resume (start)",
+	};
+	const char *fmt = "  %20s: %6.2f\n";
+	int i;
+
+	printf("\n");
+	for (i = 0; i < MIG_PH_MAX; i++)
+		if (tm->phase[i][1].tv_sec || tm->phase[i][1].tv_nsec)
+			printf(fmt, names[i],
+				elapsed(&tm->phase[i][0], &tm->phase[i][1]));
+	printf("  %20s  ------\n", " ");
+	if (tm->suspend.tv_sec || tm->suspend.tv_nsec)
+		printf(fmt, "Total suspended time",
+				elapsed(&tm->suspend, &tm->finish));
+	printf(fmt, "Total time",
+			elapsed(&tm->phase[MIG_PH_SYNC][0], &tm->finish));
+	printf("\n");
+}
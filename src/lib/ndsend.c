@@ -0,0 +1,147 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+
+#include "ndsend.h"
+#include "logger.h"
+
+#define ND_BATCH	64
+
+struct nd_packet {
+	struct nd_neighbor_advert na;
+	struct nd_opt_hdr opt;
+	unsigned char hwaddr[ETH_ALEN];
+} __attribute__((packed));
+
+static int get_iface(int sock, const char *name, int *ifindex,
+		unsigned char *hwaddr)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+	if (ioctl(sock, SIOCGIFINDEX, &ifr)) {
+		logger(-1, errno, "Unknown network interface %s", name);
+		return -1;
+	}
+	*ifindex = ifr.ifr_ifindex;
+	if (ioctl(sock, SIOCGIFHWADDR, &ifr)) {
+		logger(-1, errno, "Can not get the MAC address of "
+				"network interface %s", name);
+		return -1;
+	}
+	memcpy(hwaddr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	return 0;
+}
+
+static int send_batch(int sock, struct sockaddr_in6 *to,
+		struct nd_packet *pkts, int n)
+{
+	struct mmsghdr msgs[ND_BATCH];
+	struct iovec iov[ND_BATCH];
+	int i, rc, sent = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = &pkts[i];
+		iov[i].iov_len = sizeof(pkts[i]);
+		msgs[i].msg_hdr.msg_name = to;
+		msgs[i].msg_hdr.msg_namelen = sizeof(*to);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (sent < n) {
+		rc = sendmmsg(sock, msgs + sent, n - sent, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Unable to send Neighbor "
+					"Advertisement");
+			return -1;
+		}
+		sent += rc;
+	}
+
+	return 0;
+}
+
+int vz_ndsend(const struct in6_addr *addrs, int naddrs,
+		const char *const *ifaces, int nifaces)
+{
+	struct nd_packet pkts[ND_BATCH];
+	struct sockaddr_in6 to;
+	unsigned char hwaddr[ETH_ALEN];
+	int sock, hops = 255, ret = 0;
+	int i, j, n, ifindex;
+
+	if (naddrs == 0 || nifaces == 0)
+		return 0;
+	sock = socket(PF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+	if (sock < 0) {
+		logger(-1, errno, "Unable to create ICMPv6 socket");
+		return -1;
+	}
+	setsockopt(sock, SOL_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+
+	/* All-nodes multicast address */
+	memset(&to, 0, sizeof(to));
+	to.sin6_family = AF_INET6;
+	inet_pton(AF_INET6, "ff02::1", &to.sin6_addr);
+
+	memset(pkts, 0, sizeof(pkts));
+	for (i = 0; i < nifaces; i++) {
+		if (get_iface(sock, ifaces[i], &ifindex, hwaddr)) {
+			ret = -1;
+			continue;
+		}
+		to.sin6_scope_id = ifindex;
+		for (j = 0; j < naddrs; j += n) {
+			for (n = 0; n < ND_BATCH && j + n < naddrs; n++) {
+				struct nd_packet *p = &pkts[n];
+
+				p->na.nd_na_type = ND_NEIGHBOR_ADVERT;
+				p->na.nd_na_flags_reserved =
+					ND_NA_FLAG_OVERRIDE;
+				p->na.nd_na_target = addrs[j + n];
+				p->opt.nd_opt_type = ND_OPT_TARGET_LINKADDR;
+				p->opt.nd_opt_len = 1;
+				memcpy(p->hwaddr, hwaddr, ETH_ALEN);
+			}
+			if (send_batch(sock, &to, pkts, n)) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+	close(sock);
+
+	return ret;
+}
@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <net/if.h>
 #include <linux/vzcalluser.h>
 #include <linux/vzctl_venet.h>
 
@@ -41,6 +42,8 @@
 #include "script.h"
 #include "util.h"
 #include "vps_configure.h"
+#include "rtnl.h"
+#include "ndsend.h"
 
 
 char *find_ip(list_head_t *ip_h, const char *ipaddr)
@@ -99,28 +102,550 @@ static int ip_ctl(vps_handler *h, envid_t veid, int op, char *str)
 	return h->ip_ctl(h, veid, op, ip);
 }
 
+/* Host side routing for CT IP addresses: a venet0 route and proxy
+ * ARP/NDP entries on neighbour devices for every address. This is what
+ * vps-net_add and vps-net_del scripts do with a few ip(8) calls per
+ * address; here it is done with batched rtnetlink requests, and the
+ * scripts are only left with ARP detection and announcement.
+ */
+#define VENET_DEV	"venet0"
+
+struct host_ip {
+	int family;
+	int alen;
+	unsigned char addr[16];
+	char *str;
+	int dev;	/* neighbour device for NEIGHBOUR_DEVS=detect */
+	int exists;	/* route add returned EEXIST */
+};
+
+struct host_route {
+	struct rtnl_handle rth;
+	int venet;
+	int force;
+	int detect;
+	char nb_devs[STR_SIZE];
+	char src_dev[IFNAMSIZ];
+	int src_idx;
+	struct in_addr src;
+	int has_src;
+	int *devs;	/* all suitable host devices (NETDEVICES) */
+	int ndevs;
+	int *nb;	/* neighbour devices for NEIGHBOUR_DEVS=all|list */
+	int nnb;
+	struct host_ip *ips;
+	int nips;
+	int *req;	/* request index -> ips[] index, -1 for neighbours */
+	int nreq;
+};
+
+static void read_route_conf(struct host_route *hr)
+{
+	FILE *fp;
+	char str[STR_SIZE];
+	char name[STR_SIZE];
+	char *val, *err;
+
+	strcpy(hr->nb_devs, "all");
+	if ((fp = fopen(GLOBAL_CFG, "r")) == NULL)
+		return;
+	while (fgets(str, sizeof(str), fp) != NULL) {
+		if ((val = parse_line(str, name, sizeof(name), &err)) == NULL)
+			continue;
+		if (!strcmp(name, "NEIGHBOUR_DEVS") && *val)
+			snprintf(hr->nb_devs, sizeof(hr->nb_devs), "%s", val);
+		else if (!strcmp(name, "VE_ROUTE_SRC_DEV"))
+			snprintf(hr->src_dev, sizeof(hr->src_dev), "%s", val);
+		else if (!strcmp(name, "FORCE_ROUTE"))
+			hr->force = (yesno2id(val) == YES);
+	}
+	fclose(fp);
+}
+
+static int add_int(int **arr, int *n, int val)
+{
+	int *tmp;
+
+	if ((tmp = realloc(*arr, (*n + 1) * sizeof(int))) == NULL)
+		return -1;
+	tmp[(*n)++] = val;
+	*arr = tmp;
+
+	return 0;
+}
+
+static int in_list(const int *arr, int n, int val)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (arr[i] == val)
+			return 1;
+	return 0;
+}
+
+/* Collect devices vzgetnetdev() would: up, with an address of
+ * non-link scope, not loopback, slave, noarp or vethN.
+ */
+static int get_link_cb(int idx, int err, struct nlmsghdr *nlh, void *data)
+{
+	struct host_route *hr = data;
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	struct rtattr *tb[IFLA_MAX + 1];
+	const char *name;
+
+	if (nlh->nlmsg_type != RTM_NEWLINK)
+		return 0;
+	if (!(ifi->ifi_flags & IFF_UP) ||
+			(ifi->ifi_flags & (IFF_LOOPBACK | IFF_SLAVE | IFF_NOARP)))
+		return 0;
+	rtnl_parse_attr(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(nlh));
+	if (tb[IFLA_IFNAME] == NULL)
+		return 0;
+	name = RTA_DATA(tb[IFLA_IFNAME]);
+	if (!strncmp(name, "veth", 4) && isdigit(name[4]))
+		return 0;
+	/* Use negative index until the device is known to have an address */
+	return add_int(&hr->devs, &hr->ndevs, -ifi->ifi_index);
+}
+
+static int get_addr_cb(int idx, int err, struct nlmsghdr *nlh, void *data)
+{
+	struct host_route *hr = data;
+	struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+	struct rtattr *tb[IFA_MAX + 1];
+	struct rtattr *a;
+	int i;
+
+	if (nlh->nlmsg_type != RTM_NEWADDR)
+		return 0;
+	if (ifa->ifa_scope != RT_SCOPE_LINK)
+		for (i = 0; i < hr->ndevs; i++)
+			if (hr->devs[i] == -(int)ifa->ifa_index)
+				hr->devs[i] = ifa->ifa_index;
+	if (ifa->ifa_family != AF_INET || hr->has_src ||
+			hr->src_idx != (int)ifa->ifa_index)
+		return 0;
+	rtnl_parse_attr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(nlh));
+	a = tb[IFA_LOCAL] ? tb[IFA_LOCAL] : tb[IFA_ADDRESS];
+	if (a == NULL)
+		return 0;
+	memcpy(&hr->src, RTA_DATA(a), sizeof(hr->src));
+	if ((ntohl(hr->src.s_addr) >> 24) != 127)
+		hr->has_src = 1;
+
+	return 0;
+}
+
+static int get_host_devs(struct host_route *hr)
+{
+	int i, n;
+
+	if (rtnl_dump(&hr->rth, RTM_GETLINK, AF_UNSPEC, get_link_cb, hr) ||
+	    rtnl_dump(&hr->rth, RTM_GETADDR, AF_UNSPEC, get_addr_cb, hr))
+		return -1;
+	for (i = n = 0; i < hr->ndevs; i++)
+		if (hr->devs[i] > 0)
+			hr->devs[n++] = hr->devs[i];
+	hr->ndevs = n;
+
+	return 0;
+}
+
+static int get_neighbour_devs(struct host_route *hr)
+{
+	char *list, *tok, *sp;
+	int idx;
+
+	if (hr->ndevs == 0) {
+		logger(0, 0, "WARNING: Device list is empty");
+		return 0;
+	}
+	if (!strcmp(hr->nb_devs, "detect")) {
+		hr->detect = 1;
+		return 0;
+	}
+	if (strncmp(hr->nb_devs, "list:", 5)) {
+		if (strcmp(hr->nb_devs, "all"))
+			logger(0, 0, "WARNING: unknown value for "
+				"NEIGHBOUR_DEVS: %s, assuming \"all\"",
+				hr->nb_devs);
+		hr->nb = hr->devs;
+		hr->nnb = hr->ndevs;
+		return 0;
+	}
+	list = strdupa(hr->nb_devs + 5);
+	for (tok = strtok_r(list, " \t", &sp); tok != NULL;
+			tok = strtok_r(NULL, " \t", &sp))
+	{
+		if ((idx = if_nametoindex(tok)) == 0) {
+			logger(1, errno, "Neighbour device %s", tok);
+			continue;
+		}
+		if (add_int(&hr->nb, &hr->nnb, idx))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int add_req(struct host_route *hr, int idx, int ip)
+{
+	if (idx < 0)
+		return -1;
+	return add_int(&hr->req, &hr->nreq, ip);
+}
+
+static int add_route_req(struct host_route *hr, int type, int flags, int i)
+{
+	struct host_ip *ip = &hr->ips[i];
+	struct rtmsg rtm;
+
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = ip->family;
+	rtm.rtm_dst_len = ip->alen * 8;
+	if (type != RTM_GETROUTE) {
+		rtm.rtm_table = RT_TABLE_MAIN;
+		rtm.rtm_scope = RT_SCOPE_NOWHERE;
+	}
+	if (type == RTM_NEWROUTE) {
+		rtm.rtm_protocol = RTPROT_BOOT;
+		rtm.rtm_scope = RT_SCOPE_LINK;
+		rtm.rtm_type = RTN_UNICAST;
+	}
+	if (add_req(hr, rtnl_add_msg(&hr->rth, type, flags,
+					&rtm, sizeof(rtm)), i) ||
+	    rtnl_add_attr(&hr->rth, RTA_DST, ip->addr, ip->alen))
+		return -1;
+	if (type == RTM_GETROUTE)
+		return 0;
+	if (rtnl_add_attr(&hr->rth, RTA_OIF, &hr->venet, sizeof(int)))
+		return -1;
+	if (type == RTM_NEWROUTE && hr->has_src && ip->family == AF_INET &&
+	    rtnl_add_attr(&hr->rth, RTA_PREFSRC, &hr->src, sizeof(hr->src)))
+		return -1;
+
+	return 0;
+}
+
+static int add_neigh_req(struct host_route *hr, int type, int i, int dev)
+{
+	struct host_ip *ip = &hr->ips[i];
+	struct ndmsg ndm;
+
+	memset(&ndm, 0, sizeof(ndm));
+	ndm.ndm_family = ip->family;
+	ndm.ndm_ifindex = dev;
+	ndm.ndm_state = NUD_PERMANENT;
+	ndm.ndm_flags = NTF_PROXY;
+	if (add_req(hr, rtnl_add_msg(&hr->rth, type,
+			type == RTM_NEWNEIGH ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+			&ndm, sizeof(ndm)), -1) ||
+	    rtnl_add_attr(&hr->rth, NDA_DST, ip->addr, ip->alen))
+		return -1;
+
+	return 0;
+}
+
+static int add_neigh_reqs(struct host_route *hr, int type)
+{
+	int i, j;
+
+	for (i = 0; i < hr->nips; i++) {
+		if (hr->detect) {
+			if (hr->ips[i].dev &&
+			    add_neigh_req(hr, type, i, hr->ips[i].dev))
+				return -1;
+			continue;
+		}
+		for (j = 0; j < hr->nnb; j++)
+			if (add_neigh_req(hr, type, i, hr->nb[j]))
+				return -1;
+	}
+
+	return 0;
+}
+
+/* Same as vz_get_neighbour_devs() for NEIGHBOUR_DEVS=detect: use the
+ * device of a direct route to the IP, or of a route via the IP itself.
+ */
+static int detect_cb(int idx, int err, struct nlmsghdr *nlh, void *data)
+{
+	struct host_route *hr = data;
+	struct host_ip *ip;
+	struct rtmsg *rtm;
+	struct rtattr *tb[RTA_MAX + 1];
+	int oif;
+
+	if (nlh == NULL || nlh->nlmsg_type != RTM_NEWROUTE)
+		return 0;
+	ip = &hr->ips[hr->req[idx]];
+	rtm = NLMSG_DATA(nlh);
+	rtnl_parse_attr(tb, RTA_MAX, RTM_RTA(rtm), RTM_PAYLOAD(nlh));
+	if (tb[RTA_OIF] == NULL || tb[RTA_PREFSRC] == NULL)
+		return 0;
+	if (tb[RTA_GATEWAY] != NULL &&
+	    memcmp(RTA_DATA(tb[RTA_GATEWAY]), ip->addr, ip->alen))
+		return 0;
+	oif = *(int *)RTA_DATA(tb[RTA_OIF]);
+	if (in_list(hr->devs, hr->ndevs, oif))
+		ip->dev = oif;
+
+	return 0;
+}
+
+static int detect_neighbour_devs(struct host_route *hr)
+{
+	int i;
+
+	if (!hr->detect)
+		return 0;
+	hr->nreq = 0;
+	for (i = 0; i < hr->nips; i++)
+		if (add_route_req(hr, RTM_GETROUTE, 0, i))
+			return -1;
+	return rtnl_flush(&hr->rth, detect_cb, hr) == -1 ? -1 : 0;
+}
+
+static int route_add_cb(int idx, int err, struct nlmsghdr *nlh, void *data)
+{
+	struct host_route *hr = data;
+	struct host_ip *ip;
+
+	if (nlh != NULL || err == 0 || hr->req[idx] < 0)
+		return 0;
+	ip = &hr->ips[hr->req[idx]];
+	if (err == EEXIST) {
+		ip->exists = 1;
+		return 0;
+	}
+	logger(-1, err, "Unable to add route %s dev " VENET_DEV, ip->str);
+	return VZ_CANT_ADDIP;
+}
+
+/* Route add failed with EEXIST, fine if it is our route already */
+static int route_check_cb(int idx, int err, struct nlmsghdr *nlh, void *data)
+{
+	struct host_route *hr = data;
+	struct host_ip *ip = &hr->ips[hr->req[idx]];
+	struct rtmsg *rtm;
+	struct rtattr *tb[RTA_MAX + 1];
+
+	if (nlh == NULL) {
+		if (err == 0 && ip->exists)
+			return 0;
+		logger(-1, err, "Unable to add route %s dev " VENET_DEV,
+				ip->str);
+		return VZ_CANT_ADDIP;
+	}
+	if (nlh->nlmsg_type != RTM_NEWROUTE)
+		return 0;
+	rtm = NLMSG_DATA(nlh);
+	rtnl_parse_attr(tb, RTA_MAX, RTM_RTA(rtm), RTM_PAYLOAD(nlh));
+	if (tb[RTA_OIF] == NULL ||
+	    *(int *)RTA_DATA(tb[RTA_OIF]) != hr->venet)
+		ip->exists = 0;
+
+	return 0;
+}
+
+static int route_del_cb(int idx, int err, struct nlmsghdr *nlh, void *data)
+{
+	struct host_route *hr = data;
+
+	if (nlh != NULL || err == 0 || hr->req[idx] < 0 ||
+			err == ESRCH || err == ENOENT)
+		return 0;
+	logger(0, err, "WARNING: Unable to delete route %s dev " VENET_DEV,
+			hr->ips[hr->req[idx]].str);
+	return 0;
+}
+
+static int host_route_add(struct host_route *hr)
+{
+	int i, ret;
+
+	if (hr->src_dev[0] && !hr->has_src) {
+		logger(-1, 0, "Unable to get source ip [%s]", hr->src_dev);
+		return VZ_CANT_ADDIP;
+	}
+	if (detect_neighbour_devs(hr))
+		return -1;
+	hr->nreq = 0;
+	for (i = 0; i < hr->nips; i++)
+		if (add_route_req(hr, RTM_NEWROUTE, NLM_F_CREATE |
+				(hr->force ? NLM_F_REPLACE : NLM_F_EXCL), i))
+			return -1;
+	if (add_neigh_reqs(hr, RTM_NEWNEIGH))
+		return -1;
+	if ((ret = rtnl_flush(&hr->rth, route_add_cb, hr)))
+		return ret;
+
+	hr->nreq = 0;
+	for (i = 0; i < hr->nips; i++)
+		if (hr->ips[i].exists &&
+		    add_route_req(hr, RTM_GETROUTE, 0, i))
+			return -1;
+	if (hr->nreq == 0)
+		return 0;
+	return rtnl_flush(&hr->rth, route_check_cb, hr);
+}
+
+static int host_route_del(struct host_route *hr)
+{
+	int i;
+
+	hr->nreq = 0;
+	for (i = 0; i < hr->nips; i++)
+		if (add_route_req(hr, RTM_DELROUTE, 0, i))
+			return -1;
+	if (rtnl_flush(&hr->rth, route_del_cb, hr) == -1)
+		return -1;
+	/* Neighbour devices are detected after our routes are gone */
+	if (detect_neighbour_devs(hr))
+		return -1;
+	hr->nreq = 0;
+	if (add_neigh_reqs(hr, RTM_DELNEIGH))
+		return -1;
+	/* Missing entries are fine */
+	return rtnl_flush(&hr->rth, NULL, NULL) == -1 ? -1 : 0;
+}
+
+static int get_host_ips(struct host_route *hr, list_head_t *ip_h)
+{
+	ip_param *ip;
+	struct host_ip *hip;
+	char *p;
+	int n = 0;
+
+	list_for_each(ip, ip_h, list)
+		n++;
+	if ((hr->ips = calloc(n, sizeof(*hr->ips))) == NULL)
+		return -1;
+	list_for_each(ip, ip_h, list) {
+		hip = &hr->ips[hr->nips];
+		if ((hip->str = strdup(ip->val)) == NULL)
+			return -1;
+		hr->nips++;
+		if ((p = strchr(hip->str, '/')) != NULL)
+			*p = '\0';
+		hip->family = get_netaddr(hip->str, hip->addr);
+		if (hip->family < 0) {
+			logger(-1, 0, "Invalid IP address %s", hip->str);
+			return -1;
+		}
+		hip->alen = hip->family == AF_INET ? 4 : 16;
+	}
+
+	return 0;
+}
+
+static void free_host_route(struct host_route *hr)
+{
+	int i;
+
+	rtnl_close(&hr->rth);
+	for (i = 0; i < hr->nips; i++)
+		free(hr->ips[i].str);
+	free(hr->ips);
+	if (hr->nb != hr->devs)
+		free(hr->nb);
+	free(hr->devs);
+	free(hr->req);
+}
+
+/* Send unsolicited Neighbor Advertisements for CT IPv6 addresses on
+ * neighbour devices, which vps-net_add leaves to us with SKIP_ROUTING.
+ */
+static void host_route_announce6(struct host_route *hr)
+{
+	struct in6_addr *addrs;
+	char (*names)[IF_NAMESIZE];
+	const char **ifaces;
+	int i, n = 0, nifaces = 0;
+
+	if (hr->nips <= 0)
+		return;
+	addrs = calloc(hr->nips, sizeof(*addrs));
+	names = calloc(hr->nnb + 1, sizeof(*names));
+	ifaces = calloc(hr->nnb + 1, sizeof(*ifaces));
+	if (addrs == NULL || names == NULL || ifaces == NULL)
+		goto out;
+	for (i = 0; i < hr->nips; i++) {
+		if (hr->ips[i].family != AF_INET6)
+			continue;
+		if (!hr->detect) {
+			memcpy(&addrs[n++], hr->ips[i].addr, sizeof(*addrs));
+			continue;
+		}
+		/* Device is detected per address */
+		if (hr->ips[i].dev == 0 ||
+				if_indextoname(hr->ips[i].dev, names[0]) == NULL)
+			continue;
+		ifaces[0] = names[0];
+		if (vz_ndsend((struct in6_addr *)hr->ips[i].addr, 1,
+					ifaces, 1))
+			logger(0, 0, "Warning: unable to announce %s",
+					hr->ips[i].str);
+	}
+	if (n == 0)
+		goto out;
+	for (i = 0; i < hr->nnb; i++)
+		if (if_indextoname(hr->nb[i], names[nifaces]) != NULL) {
+			ifaces[nifaces] = names[nifaces];
+			nifaces++;
+		}
+	if (nifaces && vz_ndsend(addrs, n, ifaces, nifaces))
+		logger(0, 0, "Warning: unable to announce CT IPv6 addresses");
+out:
+	free(addrs);
+	free(names);
+	free(ifaces);
+}
+
+/** Prepare to set up or remove host routing for CT IPs with rtnetlink.
+ *
+ * @param hr		host routing context, to be freed
+ *			with free_host_route().
+ * @param ip_h		list of CT IPs.
+ * @return		0 on success, -1 if it can not be done (and
+ *			the scripts are to be used).
+ */
+static int init_host_route(struct host_route *hr, list_head_t *ip_h)
+{
+	memset(hr, 0, sizeof(*hr));
+	hr->rth.fd = -1;
+	if ((hr->venet = if_nametoindex(VENET_DEV)) == 0)
+		return -1;
+	read_route_conf(hr);
+	if (hr->src_dev[0])
+		hr->src_idx = if_nametoindex(hr->src_dev);
+	if (rtnl_open(&hr->rth) ||
+	    get_host_ips(hr, ip_h) ||
+	    get_host_devs(hr) ||
+	    get_neighbour_devs(hr))
+	{
+		logger(1, 0, "Falling back to scripts for CT routing setup");
+		return -1;
+	}
+
+	return 0;
+}
+
 int run_net_script(envid_t veid, int op, list_head_t *ip_h, int state,
 	int skip_arpdetect)
 {
 	char *argv[3];
 	char *envp[10];
 	char *script;
-	int ret;
+	int ret, routed;
 	char buf[STR_SIZE];
 	int i = 0;
 	char *skip_str = "SKIP_ARPDETECT=yes";
+	struct host_route hr;
 
 	if (list_empty(ip_h))
 		return 0;
-	snprintf(buf, sizeof(buf), "VEID=%d", veid);
-	envp[i++] = strdup(buf);
-	snprintf(buf, sizeof(buf), "VE_STATE=%s", state2str(state));
-	envp[i++] = strdup(buf);
-	envp[i++] = list2str("IP_ADDR", ip_h);
-	envp[i++] = strdup(ENV_PATH);
-	if (skip_arpdetect)
-		envp[i++] = strdup(skip_str);
-	envp[i] = NULL;
 	switch (op) {
 		case ADD:
 			script = VPS_NET_ADD;
@@ -131,10 +656,39 @@ int run_net_script(envid_t veid, int op, list_head_t *ip_h, int state,
 		default:
 			return 0;
 	}
+	routed = init_host_route(&hr, ip_h);
+	if (routed == 0 && op == DEL)
+		routed = host_route_del(&hr);
+	snprintf(buf, sizeof(buf), "VEID=%d", veid);
+	envp[i++] = strdup(buf);
+	snprintf(buf, sizeof(buf), "VE_STATE=%s", state2str(state));
+	envp[i++] = strdup(buf);
+	envp[i++] = list2str("IP_ADDR", ip_h);
+	envp[i++] = strdup(ENV_PATH);
+	if (skip_arpdetect)
+		envp[i++] = strdup(skip_str);
+	if (routed == 0)
+		envp[i++] = strdup("SKIP_ROUTING=yes");
+	envp[i] = NULL;
 	argv[0] = script;
 	argv[1] = NULL;
 	ret = run_script(script, argv, envp, 0);
 	free_arg(envp);
+	/* Routes and proxy ARP entries are added once the script has done
+	 * ARP duplicate detection and announcement, same as it does itself
+	 * without SKIP_ROUTING: NEIGHBOUR_DEVS=detect must not see our venet0
+	 * routes yet, and an IP used elsewhere must not be published.
+	 */
+	if (ret == 0 && routed == 0 && op == ADD) {
+		if ((ret = host_route_add(&hr))) {
+			host_route_del(&hr);
+			if (ret == -1)
+				ret = VZ_CANT_ADDIP;
+		} else {
+			host_route_announce6(&hr);
+		}
+	}
+	free_host_route(&hr);
 
 	return ret;
 }
@@ -322,8 +876,12 @@ int vps_net_ctl(vps_handler *h, envid_t veid, int op, net_param *net,
 	} else if (op == DEL) {
 		ret = vps_del_ip(h, veid, net, state);
 	}
-	if (!ret && !(skip & SKIP_CONFIGURE))
+	if (!ret && !(skip & SKIP_CONFIGURE)) {
+		int nonfatal = vps_exec_batch_nonfatal(1);
+
 		vps_ip_configure(h, veid, actions, root, op, net, state);
+		vps_exec_batch_nonfatal(nonfatal);
+	}
 	return ret;
 }
 
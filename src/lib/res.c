@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <linux/vzcalluser.h>
 
 #include "vzerror.h"
@@ -38,6 +39,8 @@
 #include "io.h"
 #include "image.h"
 #include "script.h"
+#include "stats.h"
+#include "meminfo.h"
 
 static int fill_2quota_param(struct setup_env_quota_param *p,
 		const struct fs_param *fs)
@@ -91,13 +94,186 @@ static int vps_2quota_perm(vps_handler *h, int veid, dev_t device,
 	return h->setdevperm(h, veid, &dev);
 }
 
+/* Host-side setup steps which do not depend on each other nor on
+ * the rest of vps_setup_res(), and can be run concurrently.
+ */
+struct setup_ctx {
+	vps_handler *h;
+	envid_t veid;
+	fs_param *fs;
+	vps_param *param;
+	int state;
+};
+
+struct setup_step {
+	const char *name;
+	int (*need)(struct setup_ctx *ctx);
+	int (*run)(struct setup_ctx *ctx);
+};
+
+static int need_netdev(struct setup_ctx *ctx)
+{
+	return !list_empty(&ctx->param->res.net.dev) ||
+		!list_empty(&ctx->param->del_res.net.dev);
+}
+
+static int run_netdev(struct setup_ctx *ctx)
+{
+	return vps_set_netdev(ctx->h, ctx->veid, &ctx->param->res.ub,
+			&ctx->param->res.net, &ctx->param->del_res.net);
+}
+
+static int need_cpu(struct setup_ctx *ctx)
+{
+	cpu_param *cpu = &ctx->param->res.cpu;
+
+	return cpu->limit || cpu->units || cpu->weight || cpu->vcpus ||
+		cpu->mask || cpu->nodemask || cpu->cpumask_auto;
+}
+
+static int run_cpu(struct setup_ctx *ctx)
+{
+	return vps_set_cpu(ctx->h, ctx->veid, &ctx->param->res.cpu);
+}
+
+static int need_devperm(struct setup_ctx *ctx)
+{
+	return !list_empty(&ctx->param->res.dev.dev);
+}
+
+static int run_devperm(struct setup_ctx *ctx)
+{
+	return vps_set_devperm(ctx->h, ctx->veid, ctx->fs->root,
+			&ctx->param->res.dev);
+}
+
+static int need_pci(struct setup_ctx *ctx)
+{
+	return !list_empty(&ctx->param->res.pci.list) ||
+		!list_empty(&ctx->param->del_res.pci.list);
+}
+
+static int run_pci(struct setup_ctx *ctx)
+{
+	int ret;
+
+	if ((ret = vps_set_pci(ctx->h, ctx->veid, ADD, ctx->fs->root,
+					&ctx->param->res.pci)))
+		return ret;
+	return vps_set_pci(ctx->h, ctx->veid, DEL, ctx->fs->root,
+			&ctx->param->del_res.pci);
+}
+
+static int need_meminfo(struct setup_ctx *ctx)
+{
+	return is_vz_kernel(ctx->h) && !is_vswap_config(&ctx->param->res.ub);
+}
+
+static int run_meminfo(struct setup_ctx *ctx)
+{
+	return vps_meminfo_set(ctx->h, ctx->veid, &ctx->param->res.meminfo,
+			ctx->param, ctx->state);
+}
+
+static int need_io(struct setup_ctx *ctx)
+{
+	io_param *io = &ctx->param->res.io;
+
+	return io->ioprio >= 0 || io->iolimit >= 0 || io->iopslimit >= 0;
+}
+
+static int run_io(struct setup_ctx *ctx)
+{
+	return vps_set_io(ctx->h, ctx->veid, &ctx->param->res.io);
+}
+
+static struct setup_step setup_steps[] = {
+	{"netdev",	need_netdev,	run_netdev},
+	{"cpu",		need_cpu,	run_cpu},
+	{"devperm",	need_devperm,	run_devperm},
+	{"pci",		need_pci,	run_pci},
+	{"meminfo",	need_meminfo,	run_meminfo},
+	{"io",		need_io,	run_io},
+};
+
+static int run_setup_step(struct setup_ctx *ctx, struct setup_step *step)
+{
+	uint64_t start = vz_stats_now();
+	int ret;
+
+	ret = step->run(ctx);
+	logger(2, 0, "Setup step %s done in %llu ms, ret=%d", step->name,
+		(unsigned long long)(vz_stats_now() - start) / 1000, ret);
+
+	return ret;
+}
+
+/* Start the steps which are needed: if there are several, each one
+ * in a child process, otherwise just run it. pids[] is filled with
+ * the children pids, 0 for steps not run in a child.
+ */
+static int start_setup_steps(struct setup_ctx *ctx, pid_t *pids)
+{
+	unsigned int i, n = 0;
+	int need[ARRAY_SIZE(setup_steps)];
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(setup_steps); i++) {
+		pids[i] = 0;
+		need[i] = setup_steps[i].need(ctx);
+		n += need[i];
+	}
+	if (n < 2) {
+		for (i = 0; i < ARRAY_SIZE(setup_steps); i++)
+			if (need[i] && (ret = run_setup_step(ctx,
+						&setup_steps[i])))
+				return ret;
+		return 0;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < ARRAY_SIZE(setup_steps); i++) {
+		if (!need[i])
+			continue;
+		if ((pids[i] = fork()) < 0) {
+			logger(-1, errno, "Can not fork");
+			pids[i] = 0;
+			return VZ_RESOURCE_ERROR;
+		} else if (pids[i] == 0) {
+			exit(run_setup_step(ctx, &setup_steps[i]));
+		}
+	}
+	return 0;
+}
+
+/* Wait for all the steps started, return the first error */
+static int wait_setup_steps(pid_t *pids)
+{
+	unsigned int i;
+	int ret = 0, r;
+
+	for (i = 0; i < ARRAY_SIZE(setup_steps); i++) {
+		if (pids[i] == 0)
+			continue;
+		r = env_wait(pids[i]);
+		if (r && !ret) {
+			logger(-1, 0, "Failed to setup %s",
+					setup_steps[i].name);
+			ret = r;
+		}
+	}
+	return ret;
+}
+
 int vps_setup_res(vps_handler *h, envid_t veid, dist_actions *actions,
 	fs_param *fs, ub_param *ub, vps_param *param,
 	int vps_state, skipFlags skip,
 	struct mod_action *action)
 {
-	int ret;
+	int ret, r;
 	vps_res *res = &param->res;
+	struct setup_ctx ctx = {h, veid, fs, param, vps_state};
+	pid_t pids[ARRAY_SIZE(setup_steps)];
 
 	if (skip & SKIP_SETUP)
 		return 0;
@@ -105,33 +281,21 @@ int vps_setup_res(vps_handler *h, envid_t veid, dist_actions *actions,
 		if ((ret = vps_set_ublimit(h, veid, ub ? : &res->ub)))
 			return ret;
 	}
-	if ((ret = vps_net_ctl(h, veid, DEL, &param->del_res.net, actions,
-		fs->root, vps_state, skip)))
-	{
-		return ret;
-	}
-	if ((ret = vps_net_ctl(h, veid, ADD, &res->net, actions, fs->root,
-		vps_state, skip)))
-	{
-		return ret;
-	}
-	if ((ret = vps_set_netdev(h, veid, &res->ub,
-					&res->net, &param->del_res.net)))
-		return ret;
-	if ((ret = vps_set_cpu(h, veid, &res->cpu)))
-		return ret;
-	if ((ret = vps_set_devperm(h, veid, fs->root, &res->dev)))
-		return ret;
-	if ((ret = vps_set_pci(h, veid, ADD, fs->root, &res->pci)))
-		return ret;
-	if ((ret = vps_set_pci(h, veid, DEL, fs->root, &param->del_res.pci)))
+	/* Independent steps are run in background, while IP addresses
+	 * (which usually take longest because of ARP detection) are set up.
+	 */
+	ret = start_setup_steps(&ctx, pids);
+	if (!ret)
+		ret = vps_net_ctl(h, veid, DEL, &param->del_res.net, actions,
+				fs->root, vps_state, skip);
+	if (!ret)
+		ret = vps_net_ctl(h, veid, ADD, &res->net, actions, fs->root,
+				vps_state, skip);
+	r = wait_setup_steps(pids);
+	if (ret || (ret = r))
 		return ret;
 	if ((ret = vps_set_fs(fs, &res->fs)))
 		return ret;
-	if ((ret = vps_meminfo_set(h, veid, &res->meminfo, param, vps_state)))
-		return ret;
-	if ((ret = vps_set_io(h, veid, &res->io)))
-		return ret;
 	/* Setup 2nd-level quota */
 	if (is_2nd_level_quota_on(&res->dq)) {
 		struct setup_env_quota_param qp;
@@ -155,10 +319,24 @@ int vps_setup_res(vps_handler *h, envid_t veid, dist_actions *actions,
 		return VZ_ACTIONSCRIPT_ERROR;
 	}
 
-	if (!(skip & SKIP_CONFIGURE))
+	if (!(skip & SKIP_CONFIGURE)) {
+		int nonfatal = vps_exec_batch_nonfatal(1);
+
+		/* Configuration inside CT is about to be changed, so the
+		 * one applied on start is no longer there
+		 */
+		if (vps_state != STATE_STARTING &&
+				(need_configure(res) ||
+				 !list_empty(&param->del_res.net.ip)))
+			vps_config_fp_remove(veid);
+
 		vps_configure(h, veid, actions, fs, param, vps_state);
-	/* Setup quota limits after configure steps */
-	if (!ve_private_is_ploop(fs)) {
+		vps_exec_batch_nonfatal(nonfatal);
+	}
+	/* Setup quota limits after configure steps. If these are
+	 * batched, it is done by the caller after running the batch.
+	 */
+	if (!ve_private_is_ploop(fs) && !vps_exec_batch_active()) {
 		if ((ret = vps_set_quota(veid, &res->dq)))
 			return ret;
 	}
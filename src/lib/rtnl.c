@@ -0,0 +1,320 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "rtnl.h"
+#include "logger.h"
+
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE	33
+#endif
+
+#define RTNL_BUFSIZE	(1024 * 1024)
+#define RTNL_RCVSIZE	32768
+
+int rtnl_open(struct rtnl_handle *rth)
+{
+	struct sockaddr_nl sa;
+	int size = RTNL_BUFSIZE;
+
+	memset(rth, 0, sizeof(*rth));
+	rth->fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (rth->fd < 0) {
+		logger(-1, errno, "Unable to open rtnetlink socket");
+		return -1;
+	}
+	/* Replies to a whole batch must fit into the receive queue */
+	if (setsockopt(rth->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+				&size, sizeof(size)))
+		setsockopt(rth->fd, SOL_SOCKET, SO_RCVBUF,
+				&size, sizeof(size));
+	setsockopt(rth->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (bind(rth->fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		logger(-1, errno, "Unable to bind rtnetlink socket");
+		close(rth->fd);
+		rth->fd = -1;
+		return -1;
+	}
+	rth->seq = time(NULL);
+
+	return 0;
+}
+
+void rtnl_close(struct rtnl_handle *rth)
+{
+	if (rth->fd >= 0)
+		close(rth->fd);
+	rth->fd = -1;
+	free(rth->buf);
+	rth->buf = NULL;
+	rth->len = rth->size = 0;
+	rth->nmsg = 0;
+}
+
+static int rtnl_reserve(struct rtnl_handle *rth, size_t len)
+{
+	char *buf;
+	size_t size;
+
+	if (rth->len + len <= rth->size)
+		return 0;
+	size = rth->size ? rth->size * 2 : 16384;
+	while (size < rth->len + len)
+		size *= 2;
+	if ((buf = realloc(rth->buf, size)) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate rtnetlink buffer");
+		return -1;
+	}
+	rth->buf = buf;
+	rth->size = size;
+
+	return 0;
+}
+
+int rtnl_add_msg(struct rtnl_handle *rth, int type, int flags,
+		const void *hdr, int hdrlen)
+{
+	struct nlmsghdr *nlh;
+	size_t len = NLMSG_SPACE(hdrlen);
+
+	if (rtnl_reserve(rth, len))
+		return -1;
+	nlh = (struct nlmsghdr *)(rth->buf + rth->len);
+	memset(nlh, 0, len);
+	nlh->nlmsg_len = NLMSG_LENGTH(hdrlen);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nlh->nlmsg_seq = rth->seq + rth->nmsg;
+	memcpy(NLMSG_DATA(nlh), hdr, hdrlen);
+	rth->last = rth->len;
+	rth->len += len;
+
+	return rth->nmsg++;
+}
+
+int rtnl_add_attr(struct rtnl_handle *rth, int type, const void *data,
+		int len)
+{
+	struct nlmsghdr *nlh;
+	struct rtattr *rta;
+	size_t alen = RTA_SPACE(len);
+
+	if (rth->nmsg == 0 || rtnl_reserve(rth, alen))
+		return -1;
+	nlh = (struct nlmsghdr *)(rth->buf + rth->last);
+	rta = (struct rtattr *)(rth->buf + rth->len);
+	memset(rta, 0, alen);
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	rth->len += alen;
+	/* Computed from the buffer end rather than incremented, so that
+	 * it is right for attributes added inside a nest, too.
+	 */
+	nlh->nlmsg_len = rth->len - rth->last;
+
+	return 0;
+}
+
+int rtnl_nest_start(struct rtnl_handle *rth, int type, const void *hdr,
+		int hdrlen)
+{
+	struct nlmsghdr *nlh;
+	struct rtattr *rta;
+	size_t off = rth->len;
+	size_t alen = RTA_SPACE(hdrlen);
+
+	if (rth->nmsg == 0 || rtnl_reserve(rth, alen))
+		return -1;
+	nlh = (struct nlmsghdr *)(rth->buf + rth->last);
+	rta = (struct rtattr *)(rth->buf + off);
+	memset(rta, 0, alen);
+	rta->rta_type = type;
+	if (hdrlen)
+		memcpy(RTA_DATA(rta), hdr, hdrlen);
+	rth->len += alen;
+	nlh->nlmsg_len = rth->len - rth->last;
+
+	return off;
+}
+
+void rtnl_nest_end(struct rtnl_handle *rth, int off)
+{
+	struct rtattr *rta;
+
+	if (off < 0)
+		return;
+	rta = (struct rtattr *)(rth->buf + off);
+	rta->rta_len = rth->len - off;
+}
+
+void rtnl_parse_attr(struct rtattr *tb[], int max, struct rtattr *rta,
+		int len)
+{
+	memset(tb, 0, sizeof(struct rtattr *) * (max + 1));
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if (rta->rta_type <= max && tb[rta->rta_type] == NULL)
+			tb[rta->rta_type] = rta;
+}
+
+static int rtnl_send(struct rtnl_handle *rth, const char *buf, size_t len)
+{
+	struct sockaddr_nl sa;
+	ssize_t n;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	do {
+		n = sendto(rth->fd, buf, len, 0,
+				(struct sockaddr *)&sa, sizeof(sa));
+	} while (n < 0 && errno == EINTR);
+	if (n != (ssize_t)len) {
+		logger(-1, errno, "Unable to send rtnetlink request");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Read replies for requests with sequence numbers [seq, seq + n),
+ * which are messages [base, base + n) of the batch, as the callback
+ * sees them. For dumps (dump != 0) wait for NLMSG_DONE instead.
+ */
+static int rtnl_recv(struct rtnl_handle *rth, unsigned int seq, int base,
+		int n, int dump, rtnl_reply_f cb, void *data)
+{
+	char buf[RTNL_RCVSIZE];
+	struct sockaddr_nl sa;
+	struct iovec iov = { buf, sizeof(buf) };
+	struct msghdr msg = {
+		.msg_name = &sa,
+		.msg_namelen = sizeof(sa),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *e;
+	int done = 0, ret = 0, rc, err, idx;
+	ssize_t len;
+
+	while (done < n) {
+		len = recvmsg(rth->fd, &msg, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Unable to receive rtnetlink reply");
+			return -1;
+		}
+		if (msg.msg_flags & MSG_TRUNC) {
+			logger(-1, 0, "Truncated rtnetlink reply");
+			return -1;
+		}
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+				nlh = NLMSG_NEXT(nlh, len))
+		{
+			if (sa.nl_pid != 0 ||
+					nlh->nlmsg_seq - seq >= (unsigned)n)
+				continue;
+			idx = base + (nlh->nlmsg_seq - seq);
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				done++;
+				continue;
+			}
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				e = NLMSG_DATA(nlh);
+				err = -e->error;
+				if (dump) {
+					logger(-1, err, "rtnetlink dump failed");
+					return -1;
+				}
+				done++;
+				rc = cb != NULL ? cb(idx, err, NULL, data) : 0;
+			} else {
+				rc = cb != NULL ? cb(idx, 0, nlh, data) : 0;
+			}
+			/* Keep on reading to drain the replies */
+			if (rc && !ret)
+				ret = rc;
+		}
+	}
+
+	return ret;
+}
+
+int rtnl_flush(struct rtnl_handle *rth, rtnl_reply_f cb, void *data)
+{
+	struct nlmsghdr *nlh;
+	size_t off = 0, start;
+	int idx = 0, n, ret = 0, rc;
+
+	while (off < rth->len) {
+		start = off;
+		for (n = 0; off < rth->len && n < RTNL_BATCH_MAX; n++) {
+			nlh = (struct nlmsghdr *)(rth->buf + off);
+			off += NLMSG_ALIGN(nlh->nlmsg_len);
+		}
+		if (rtnl_send(rth, rth->buf + start, off - start)) {
+			ret = -1;
+			break;
+		}
+		rc = rtnl_recv(rth, rth->seq + idx, idx, n, 0, cb, data);
+		if (rc == -1) {
+			ret = -1;
+			break;
+		}
+		if (rc && !ret)
+			ret = rc;
+		idx += n;
+	}
+	rth->seq += rth->nmsg;
+	rth->nmsg = 0;
+	rth->len = 0;
+
+	return ret;
+}
+
+int rtnl_dump(struct rtnl_handle *rth, int type, int family,
+		rtnl_reply_f cb, void *data)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct rtgenmsg g;
+	} req;
+
+	if (rth->nmsg != 0)
+		return -1;
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = type;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = rth->seq;
+	req.g.rtgen_family = family;
+	if (rtnl_send(rth, (char *)&req, sizeof(req)))
+		return -1;
+
+	return rtnl_recv(rth, rth->seq++, 0, 1, 1, cb, data);
+}
@@ -26,6 +26,9 @@
 #include <string.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <utime.h>
 #include <sys/stat.h>
 
 #include "types.h"
@@ -40,7 +43,6 @@
 #include "exec.h"
 #include "cleanup.h"
 
-volatile sig_atomic_t alarm_flag;
 static char *envp_bash[] = {"HOME=/", "TERM=linux", ENV_PATH, NULL};
 
 int read_script(const char *fname, char *include, char **buf)
@@ -269,8 +271,6 @@ int setup_env_quota(const struct setup_env_quota_param *param)
 	"\n"								\
 	"exec touch " VZFIFO_FILE "\n"
 
-#define MAX_WAIT_TIMEOUT	60 * 60
-
 int add_reach_runlevel_mark()
 {
 	int fd, found, ret;
@@ -285,6 +285,10 @@ int add_reach_runlevel_mark()
 			strerror(errno));
 		return -1;
 	}
+	/* Zero mtime means the mark is not reached yet,
+	 * see vps_wait_started()
+	 */
+	utime(VZFIFO_FILE, &(struct utimbuf){0, 0});
 	/* Create upstart specific script */
 	if (!stat(EVENTS_DIR_UBUNTU, &st)) {
 		is_upstart = 1;
@@ -381,40 +385,105 @@ int add_reach_runlevel_mark()
 	return ret;
 }
 
-static void alarm_handler(int sig)
+static void close_wait_fd(struct pollfd *pfd, const char *root)
 {
-	alarm_flag = 1;
+	char path[PATH_LEN];
+
+	close(pfd->fd);
+	pfd->fd = -1;
+	snprintf(path, sizeof(path), "%s" VZFIFO_FILE, root);
+	unlink(path);
 }
 
-int wait_on_fifo(void *data)
+/** Wait for containers to reach their default runlevel.
+ *
+ * The mark set by add_reach_runlevel_mark() is watched from the host
+ * side through CT root, so any number of CTs can be waited for from
+ * a single process without entering them.
+ *
+ * @param h		CT handler.
+ * @param veids		array of CT IDs.
+ * @param roots		array of CT roots.
+ * @param n		number of CTs.
+ * @param timeout	timeout in seconds, 0 - unlimited.
+ * @param ready		array filled with 1 for CTs started, 0 for CTs
+ *			not started in time, -1 on error.
+ * @return		0 if all CTs are started.
+ */
+int vps_wait_started(vps_handler *h, const envid_t *veids,
+	const char *const *roots, int n, int timeout, int *ready)
 {
-	int fd, buf, ret;
-	struct sigaction act, actold;
-
-	ret = 0;
-	alarm_flag = 0;
-	act.sa_flags = 0;
-	act.sa_handler = alarm_handler;
-	sigemptyset(&act.sa_mask);
-	sigaction(SIGALRM, &act, &actold);
+	struct pollfd *pfd;
+	struct stat st;
+	char path[PATH_LEN];
+	time_t end = time(NULL) + timeout;
+	int i, pending = 0, ret = 0;
 
-	alarm(MAX_WAIT_TIMEOUT);
-	fd = open(VZFIFO_FILE, O_RDONLY);
-	if (fd == -1) {
-		fprintf(stderr, "Unable to open " VZFIFO_FILE " %s\n",
-			strerror(errno));
-		ret = -1;
-		goto err;
+	if ((pfd = calloc(n, sizeof(*pfd))) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		return VZ_RESOURCE_ERROR;
 	}
-	if (read(fd, &buf, sizeof(buf)) == -1)
-		ret = -1;
-err:
-	if (alarm_flag)
-		ret = VZ_EXEC_TIMEOUT;
-	alarm(0);
-	sigaction(SIGALRM, &actold, NULL);
-	unlink(VZFIFO_FILE);
-	if (fd >= 0)
-		close(fd);
+	for (i = 0; i < n; i++) {
+		ready[i] = -1;
+		pfd[i].events = POLLIN;
+		snprintf(path, sizeof(path), "%s" VZFIFO_FILE, roots[i]);
+		/* The file is under CT control, do not follow symlinks */
+		pfd[i].fd = open(path, O_RDONLY | O_NONBLOCK | O_NOFOLLOW);
+		if (pfd[i].fd < 0) {
+			logger(-1, errno, "Unable to open %s", path);
+			continue;
+		}
+		if (fstat(pfd[i].fd, &st) || !S_ISFIFO(st.st_mode)) {
+			logger(-1, 0, "%s is not a FIFO", path);
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			continue;
+		}
+		ready[i] = 0;
+		pending++;
+	}
+	while (pending) {
+		/* A writer closing the FIFO makes it readable (POLLHUP).
+		 * Also check the mtime: the mark is a touch(1), which
+		 * only updates it if nobody was reading at that moment.
+		 */
+		for (i = 0; i < n; i++) {
+			if (pfd[i].fd < 0)
+				continue;
+			if ((pfd[i].revents & (POLLIN | POLLHUP)) ||
+				(fstat(pfd[i].fd, &st) == 0 &&
+					st.st_mtime != 0))
+			{
+				ready[i] = 1;
+			} else if (!h->is_run(h, veids[i])) {
+				logger(-1, 0, "Container %d is not running",
+						veids[i]);
+				ready[i] = -1;
+			} else {
+				continue;
+			}
+			close_wait_fd(&pfd[i], roots[i]);
+			pending--;
+		}
+		if (!pending)
+			break;
+		if (timeout && time(NULL) >= end) {
+			ret = VZ_EXEC_TIMEOUT;
+			break;
+		}
+		if (poll(pfd, n, 1000) < 0 && errno != EINTR) {
+			logger(-1, errno, "Error in poll()");
+			ret = VZ_SYSTEM_ERROR;
+			break;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (pfd[i].fd >= 0)
+			close_wait_fd(&pfd[i], roots[i]);
+		if (ready[i] < 0 && !ret)
+			ret = VZ_WAIT_FAILED;
+	}
+	free(pfd);
+
 	return ret;
 }
@@ -16,6 +16,149 @@ static void remove_data_from_array(void **array, int nelem, int id)
 		array[i] = array[i + 1];
 }
 
+/* Snapshot tree index. It is extended by vzctl_add_snapshot_tree_entry(),
+ * other tree changes drop it to be rebuilt on the next lookup.
+ */
+struct vzctl_snapshot_index {
+	int *hash;		/* snapshot numbers, -1 for a free slot */
+	unsigned int mask;
+	int *parent;		/* -1 for the base */
+	int *child;		/* first child */
+	int *last;		/* last child */
+	int *next;		/* next sibling */
+	int base_child;		/* first and last child of the base */
+	int base_last;
+	int size;		/* length of per-snapshot arrays */
+	int orphans;		/* snapshots with no parent found */
+};
+
+static unsigned int guid_hash(const char *guid)
+{
+	unsigned int h = 2166136261U;
+
+	for (; *guid != '\0'; guid++)
+		h = (h ^ (unsigned char)*guid) * 16777619U;
+
+	return h;
+}
+
+static void free_index(struct vzctl_snapshot_tree *tree)
+{
+	struct vzctl_snapshot_index *x = tree->idx;
+
+	if (x == NULL)
+		return;
+	free(x->hash);
+	free(x->parent);
+	free(x->child);
+	free(x->last);
+	free(x->next);
+	free(x);
+	tree->idx = NULL;
+}
+
+static int index_lookup(struct vzctl_snapshot_tree *tree, const char *guid)
+{
+	struct vzctl_snapshot_index *x = tree->idx;
+	unsigned int i;
+	int id;
+
+	for (i = guid_hash(guid) & x->mask; (id = x->hash[i]) != -1;
+			i = (i + 1) & x->mask)
+		if (strcmp(tree->snapshots[id]->guid, guid) == 0)
+			return id;
+	return -1;
+}
+
+static void index_hash(struct vzctl_snapshot_tree *tree, int id)
+{
+	struct vzctl_snapshot_index *x = tree->idx;
+	unsigned int i;
+
+	for (i = guid_hash(tree->snapshots[id]->guid) & x->mask;
+			x->hash[i] != -1; i = (i + 1) & x->mask)
+		;
+	x->hash[i] = id;
+}
+
+/* Append a snapshot to its parent children list */
+static void index_link(struct vzctl_snapshot_tree *tree, int id)
+{
+	struct vzctl_snapshot_index *x = tree->idx;
+	const char *parent_guid = tree->snapshots[id]->parent_guid;
+	int p = -1, *head, *tail;
+
+	x->child[id] = x->last[id] = x->next[id] = -1;
+	if (*parent_guid != '\0') {
+		p = index_lookup(tree, parent_guid);
+		if (p == -1) {
+			x->parent[id] = -1;
+			x->orphans++;
+			return;
+		}
+	}
+	x->parent[id] = p;
+	head = p == -1 ? &x->base_child : &x->child[p];
+	tail = p == -1 ? &x->base_last : &x->last[p];
+	if (*tail == -1)
+		*head = id;
+	else
+		x->next[*tail] = id;
+	*tail = id;
+}
+
+static struct vzctl_snapshot_index *get_index(struct vzctl_snapshot_tree *tree)
+{
+	struct vzctl_snapshot_index *x;
+	unsigned int nslots;
+	int i;
+
+	if (tree->idx != NULL)
+		return tree->idx;
+	if ((x = calloc(1, sizeof(*x))) == NULL)
+		return NULL;
+	/* Room to add as many snapshots with the hash half full */
+	x->size = tree->nsnapshots < 8 ? 16 : 2 * tree->nsnapshots;
+	for (nslots = 32; nslots < 2U * x->size; nslots *= 2)
+		;
+	x->mask = nslots - 1;
+	x->hash = malloc(nslots * sizeof(int));
+	x->parent = malloc(x->size * sizeof(int));
+	x->child = malloc(x->size * sizeof(int));
+	x->last = malloc(x->size * sizeof(int));
+	x->next = malloc(x->size * sizeof(int));
+	tree->idx = x;
+	if (x->hash == NULL || x->parent == NULL || x->child == NULL ||
+			x->last == NULL || x->next == NULL) {
+		free_index(tree);
+		return NULL;
+	}
+	memset(x->hash, 0xff, nslots * sizeof(int));
+	x->base_child = x->base_last = -1;
+	for (i = 0; i < tree->nsnapshots; i++)
+		index_hash(tree, i);
+	for (i = 0; i < tree->nsnapshots; i++)
+		index_link(tree, i);
+
+	return x;
+}
+
+/* Index a snapshot just appended to the tree */
+static void index_add(struct vzctl_snapshot_tree *tree, int id)
+{
+	struct vzctl_snapshot_index *x = tree->idx;
+
+	if (x == NULL)
+		return;
+	/* Full, or a new snapshot may be a parent of an indexed one */
+	if (id >= x->size || x->orphans) {
+		free_index(tree);
+		return;
+	}
+	index_hash(tree, id);
+	index_link(tree, id);
+}
+
 static void free_snapshot_data(struct vzctl_snapshot_data *data)
 {
 	free(data->guid);
@@ -33,6 +176,7 @@ void vzctl_free_snapshot_tree(struct vzctl_snapshot_tree *tree)
 	for (i = 0; i < tree->nsnapshots; i++)
 		free_snapshot_data(tree->snapshots[i]);
 	free(tree->snapshots);
+	free_index(tree);
 	free(tree);
 }
 
@@ -45,12 +189,52 @@ int vzctl_find_snapshot_by_guid(struct vzctl_snapshot_tree *tree, const char *gu
 {
 	int i;
 
+	if (get_index(tree) != NULL)
+		return index_lookup(tree, guid);
 	for (i = 0; i < tree->nsnapshots; i++)
 		if (strcmp(tree->snapshots[i]->guid, guid) == 0)
 			return i;
 	return -1;
 }
 
+/* Without an index (out of memory), the tree is searched */
+int vzctl_snapshot_parent(struct vzctl_snapshot_tree *tree, int id)
+{
+	const char *parent_guid = tree->snapshots[id]->parent_guid;
+
+	if (get_index(tree) != NULL)
+		return tree->idx->parent[id];
+	if (*parent_guid == '\0')
+		return -1;
+	return vzctl_find_snapshot_by_guid(tree, parent_guid);
+}
+
+int vzctl_snapshot_first_child(struct vzctl_snapshot_tree *tree, int id)
+{
+	const char *guid = id == -1 ? "" : tree->snapshots[id]->guid;
+	int i;
+
+	if (get_index(tree) != NULL)
+		return id == -1 ? tree->idx->base_child : tree->idx->child[id];
+	for (i = 0; i < tree->nsnapshots; i++)
+		if (strcmp(tree->snapshots[i]->parent_guid, guid) == 0)
+			return i;
+	return -1;
+}
+
+int vzctl_snapshot_next_sibling(struct vzctl_snapshot_tree *tree, int id)
+{
+	const char *parent_guid = tree->snapshots[id]->parent_guid;
+	int i;
+
+	if (get_index(tree) != NULL)
+		return tree->idx->next[id];
+	for (i = id + 1; i < tree->nsnapshots; i++)
+		if (strcmp(tree->snapshots[i]->parent_guid, parent_guid) == 0)
+			return i;
+	return -1;
+}
+
 static int find_snapshot_current(struct vzctl_snapshot_tree *tree)
 {
 	int i;
@@ -74,7 +258,7 @@ void vzctl_snapshot_tree_set_current(struct vzctl_snapshot_tree *tree, const cha
 
 void vzctl_del_snapshot_tree_entry(struct vzctl_snapshot_tree *tree, const char *guid)
 {
-	int id, i;
+	int id, i, n;
 	struct vzctl_snapshot_data *snap;
 
 	id = vzctl_find_snapshot_by_guid(tree, guid);
@@ -82,23 +266,23 @@ void vzctl_del_snapshot_tree_entry(struct vzctl_snapshot_tree *tree, const char
 		return;
 	snap = tree->snapshots[id];
 
-	for (i = 0; i < tree->nsnapshots; i++) {
-		if (snap->current) {
-			// set new current
-			if (strcmp(tree->snapshots[i]->guid, snap->parent_guid) == 0) {
-				tree->snapshots[i]->current = 1;
-				break;
-			}
-		} else {
-			// update parent
-			if (strcmp(tree->snapshots[i]->parent_guid, guid) == 0)
-				strcpy(tree->snapshots[i]->parent_guid, snap->parent_guid);
+	if (snap->current) {
+		// set new current
+		i = vzctl_snapshot_parent(tree, id);
+		if (i != -1)
+			tree->snapshots[i]->current = 1;
+	} else {
+		// update parent
+		for (i = vzctl_snapshot_first_child(tree, id); i != -1; i = n) {
+			n = vzctl_snapshot_next_sibling(tree, i);
+			strcpy(tree->snapshots[i]->parent_guid, snap->parent_guid);
 		}
 	}
 
 	free_snapshot_data(snap);
 	remove_data_from_array((void**)tree->snapshots, tree->nsnapshots, id);
 	tree->nsnapshots--;
+	free_index(tree);
 }
 
 int vzctl_add_snapshot_tree_entry(struct vzctl_snapshot_tree *tree, int current, const char *guid,
@@ -142,6 +326,7 @@ int vzctl_add_snapshot_tree_entry(struct vzctl_snapshot_tree *tree, int current,
 
 	tree->snapshots[tree->nsnapshots] = data;
 	tree->nsnapshots++;
+	index_add(tree, tree->nsnapshots - 1);
 
 	return 0;
 }
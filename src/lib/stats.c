@@ -0,0 +1,202 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+#include "logger.h"
+#include "vzerror.h"
+
+static const char *phase_names[VZ_STAT_MAX] = {
+	[VZ_STAT_START]		= "start",
+	[VZ_STAT_STOP]		= "stop",
+	[VZ_STAT_CHKPNT]	= "chkpnt",
+	[VZ_STAT_RESTORE]	= "restore",
+	[VZ_STAT_MOUNT]		= "mount",
+	[VZ_STAT_UMOUNT]	= "umount",
+	[VZ_STAT_QUOTA_ON]	= "quota_on",
+	[VZ_STAT_ENV_CREATE]	= "env_create",
+	[VZ_STAT_SETUP_RES]	= "setup_res",
+	[VZ_STAT_SCRIPT]	= "script",
+	[VZ_STAT_INIT_EXEC]	= "init_exec",
+	[VZ_STAT_ENV_STOP]	= "env_stop",
+};
+
+static struct vz_stats *g_stats;
+static int g_stats_failed;
+
+static void init_stats(struct vz_stats *st)
+{
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < VZ_STAT_MAX; i++)
+		snprintf(st->phase[i].name, sizeof(st->phase[i].name),
+				"%s", phase_names[i]);
+	st->nphases = VZ_STAT_MAX;
+	st->version = VZ_STATS_VERSION;
+	st->magic = VZ_STATS_MAGIC;
+}
+
+static struct vz_stats *map_stats(int create, int reset)
+{
+	struct vz_stats *st;
+	struct stat sb;
+	int fd;
+
+	fd = open(STATSFILE, O_RDWR | (create ? O_CREAT : 0), 0644);
+	if (fd < 0)
+		return NULL;
+	/* Serialize initialization between concurrent vzctl processes */
+	if (flock(fd, LOCK_EX) || fstat(fd, &sb))
+		goto err;
+	if (sb.st_size < (off_t)sizeof(*st) &&
+			ftruncate(fd, sizeof(*st)))
+		goto err;
+	st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (st == MAP_FAILED)
+		goto err;
+	if (reset || st->magic != VZ_STATS_MAGIC ||
+			st->version != VZ_STATS_VERSION)
+		init_stats(st);
+	close(fd);
+
+	return st;
+err:
+	close(fd);
+	return NULL;
+}
+
+uint64_t vz_stats_now(void)
+{
+	struct timespec ts;
+
+	/* Not affected by the wall clock being set or stepped by NTP */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void vz_stats_add(int phase, uint64_t start)
+{
+	struct vz_stats_phase *p;
+	uint64_t us, max;
+	int i;
+
+	if (phase < 0 || phase >= VZ_STAT_MAX || g_stats_failed)
+		return;
+	if (g_stats == NULL) {
+		if ((g_stats = map_stats(1, 0)) == NULL) {
+			logger(2, errno, "Unable to use statistics file %s",
+					STATSFILE);
+			g_stats_failed = 1;
+			return;
+		}
+	}
+	us = vz_stats_now() - start;
+	for (i = 0; i < VZ_STATS_NBUCKETS - 1; i++)
+		if (us < (1ULL << (i + VZ_STATS_MIN_SHIFT)))
+			break;
+	p = &g_stats->phase[phase];
+	/* The region is shared, so update it atomically */
+	__sync_fetch_and_add(&p->bucket[i], 1);
+	__sync_fetch_and_add(&p->sum_us, us);
+	__sync_fetch_and_add(&p->count, 1);
+	do {
+		max = p->max_us;
+		if (us <= max)
+			break;
+	} while (!__sync_bool_compare_and_swap(&p->max_us, max, us));
+}
+
+/* Upper bound of the bucket containing the given percentile, in ms */
+static double percentile(const struct vz_stats_phase *p, int pct)
+{
+	uint64_t n = 0, want;
+	int i;
+
+	want = (p->count * pct + 99) / 100;
+	for (i = 0; i < VZ_STATS_NBUCKETS - 1; i++) {
+		n += p->bucket[i];
+		if (n >= want && (1ULL << (i + VZ_STATS_MIN_SHIFT)) < p->max_us)
+			return (1ULL << (i + VZ_STATS_MIN_SHIFT)) / 1000.0;
+		if (n >= want)
+			break;
+	}
+	return p->max_us / 1000.0;
+}
+
+/** Print latency statistics for all phases.
+ *
+ * @return		0 on success.
+ */
+int vz_stats_print(void)
+{
+	struct vz_stats *st;
+	struct vz_stats_phase *p;
+	int i;
+
+	if ((st = map_stats(0, 0)) == NULL) {
+		if (errno == ENOENT) {
+			logger(0, 0, "No statistics collected yet");
+			return 0;
+		}
+		logger(-1, errno, "Unable to open %s", STATSFILE);
+		return VZ_SYSTEM_ERROR;
+	}
+	printf("%-12s %10s %10s %10s %10s %10s\n", "PHASE", "COUNT",
+			"AVG_MS", "P50_MS", "P99_MS", "MAX_MS");
+	for (i = 0; i < VZ_STAT_MAX; i++) {
+		p = &st->phase[i];
+		printf("%-12s %10llu %10.1f %10.1f %10.1f %10.1f\n",
+			p->name, (unsigned long long)p->count,
+			p->count ? p->sum_us / 1000.0 / p->count : 0,
+			p->count ? percentile(p, 50) : 0,
+			p->count ? percentile(p, 99) : 0,
+			p->max_us / 1000.0);
+	}
+	munmap(st, sizeof(*st));
+
+	return 0;
+}
+
+/** Reset latency statistics.
+ *
+ * @return		0 on success.
+ */
+int vz_stats_reset(void)
+{
+	struct vz_stats *st;
+
+	/* Reinitialized under the file lock */
+	if ((st = map_stats(1, 1)) == NULL) {
+		logger(-1, errno, "Unable to open %s", STATSFILE);
+		return VZ_SYSTEM_ERROR;
+	}
+	munmap(st, sizeof(*st));
+
+	return 0;
+}
@@ -25,9 +25,12 @@
 #include <sys/ioctl.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <net/if.h>
 
 #include <linux/vzcalluser.h>
 #include <linux/vzctl_veth.h>
+#include <linux/veth.h>
 
 #include "vzerror.h"
 #include "util.h"
@@ -35,6 +38,7 @@
 #include "env.h"
 #include "logger.h"
 #include "script.h"
+#include "rtnl.h"
 
 void free_veth_dev(veth_dev *dev)
 {
@@ -79,6 +83,214 @@ static int run_vznetcfg(envid_t veid, veth_dev *dev)
 	return ret;
 }
 
+/* vznetcfg only brings a device up, unless vznet.conf
+ * points it to an external script (such as vznetaddbr).
+ */
+static int vznet_external_script(void)
+{
+	FILE *fp;
+	char str[STR_SIZE];
+	char name[STR_SIZE];
+	char *val, *err;
+	int ret = 0;
+
+	if ((fp = fopen(VZNET_CFG, "r")) == NULL)
+		return 0;
+	while (fgets(str, sizeof(str), fp) != NULL) {
+		if ((val = parse_line(str, name, sizeof(name), &err)) == NULL)
+			continue;
+		if (!strcmp(name, "EXTERNAL_SCRIPT"))
+			ret = (*val != 0 && access(val, X_OK) == 0);
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+struct veth_req {
+	veth_dev *dev;
+	int create;
+};
+
+static int veth_reply_cb(int idx, int err, struct nlmsghdr *nlh, void *data)
+{
+	struct veth_req *req = (struct veth_req *)data + idx;
+
+	if (nlh != NULL)
+		return 0;
+	if (err == 0) {
+		/* Remove it on rollback */
+		if (req->create)
+			req->dev->flags = 1;
+		return 0;
+	}
+	if (req->create)
+		logger(-1, err, "Unable to create veth pair %s/%s",
+				req->dev->dev_name, req->dev->dev_name_ve);
+	else
+		logger(-1, err, "Unable to configure veth device %s",
+				req->dev->dev_name);
+
+	return VZ_VETH_ERROR;
+}
+
+/* Whether a veth pair for an upstream kernel CT can be created here.
+ * Moving a host device into CT, reconfiguring an existing pair and
+ * creating the venet0 bridge are left to vps-netns_dev_add.
+ */
+static int veth_can_create(veth_dev *dev)
+{
+	if (dev->dev_name[0] == 0 ||
+			!strcmp(dev->dev_name, dev->dev_name_ve) ||
+			if_nametoindex(dev->dev_name) != 0)
+		return 0;
+	if (!strcmp(dev->dev_bridge, "venet0") &&
+			if_nametoindex("venet0") == 0)
+		return 0;
+
+	return 1;
+}
+
+/* Create a veth pair with the CT end in the network namespace nsfd */
+static int add_veth_create_req(struct rtnl_handle *rth, veth_dev *dev,
+		int nsfd)
+{
+	struct ifinfomsg ifi;
+	static const char kind[] = "veth";
+	int linkinfo, data, peer;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	if (rtnl_add_msg(rth, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL,
+				&ifi, sizeof(ifi)) < 0 ||
+			rtnl_add_attr(rth, IFLA_IFNAME, dev->dev_name,
+				strlen(dev->dev_name) + 1))
+		return -1;
+	if (dev->addrlen &&
+			rtnl_add_attr(rth, IFLA_ADDRESS, dev->dev_addr, ETH_ALEN))
+		return -1;
+	if ((linkinfo = rtnl_nest_start(rth, IFLA_LINKINFO, NULL, 0)) < 0 ||
+			rtnl_add_attr(rth, IFLA_INFO_KIND, kind,
+				sizeof(kind) - 1) ||
+			(data = rtnl_nest_start(rth, IFLA_INFO_DATA,
+				NULL, 0)) < 0 ||
+			(peer = rtnl_nest_start(rth, VETH_INFO_PEER,
+				&ifi, sizeof(ifi))) < 0 ||
+			rtnl_add_attr(rth, IFLA_IFNAME, dev->dev_name_ve,
+				strlen(dev->dev_name_ve) + 1) ||
+			rtnl_add_attr(rth, IFLA_NET_NS_FD, &nsfd, sizeof(nsfd)))
+		return -1;
+	if (dev->addrlen_ve && rtnl_add_attr(rth, IFLA_ADDRESS,
+				dev->dev_addr_ve, ETH_ALEN))
+		return -1;
+	rtnl_nest_end(rth, peer);
+	rtnl_nest_end(rth, data);
+	rtnl_nest_end(rth, linkinfo);
+
+	return 0;
+}
+
+/* Bring the host end up and, if bridge is set, add it to its bridge.
+ * On vz kernels, vznetcfg only brings it up, leaving bridging to an
+ * external script; upstream kernel CTs get bridged, same as done by
+ * vps-netns_dev_add.
+ */
+static int add_veth_up_req(struct rtnl_handle *rth, veth_dev *dev,
+		int bridge)
+{
+	struct ifinfomsg ifi;
+	unsigned int master;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_flags = IFF_UP;
+	ifi.ifi_change = IFF_UP;
+	if (rtnl_add_msg(rth, RTM_NEWLINK, 0, &ifi, sizeof(ifi)) < 0 ||
+			rtnl_add_attr(rth, IFLA_IFNAME, dev->dev_name,
+				strlen(dev->dev_name) + 1))
+		return -1;
+	if (!bridge || dev->dev_bridge[0] == 0)
+		return 0;
+	if ((master = if_nametoindex(dev->dev_bridge)) == 0) {
+		logger(0, 0, "Warning: bridge %s does not exist, "
+				"%s is not added to it",
+				dev->dev_bridge, dev->dev_name);
+		return 0;
+	}
+
+	return rtnl_add_attr(rth, IFLA_MASTER, &master, sizeof(master));
+}
+
+/* Create host and CT ends for all devices and bring them up.
+ * Whatever can be done with rtnetlink is done in a single batch per
+ * step; the rest falls back to the hooks and vznetcfg per device.
+ */
+static int veth_setup(vps_handler *h, envid_t veid, list_head_t *dev_h)
+{
+	struct rtnl_handle rth;
+	struct veth_req *req;
+	veth_dev *tmp;
+	char path[STR_SIZE];
+	int ret = 0, n = 0, nsfd = -1, native;
+
+	list_for_each(tmp, dev_h, list)
+		n++;
+	if ((req = calloc(n, sizeof(*req))) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate veth requests");
+		return VZ_RESOURCE_ERROR;
+	}
+	native = (rtnl_open(&rth) == 0);
+	if (native && !is_vz_kernel(h)) {
+		snprintf(path, sizeof(path), "%s/%d", NETNS_RUN_DIR, veid);
+		nsfd = open(path, O_RDONLY);
+	}
+	n = 0;
+	/* req[] is indexed as rtnl_add_msg() counts requests:
+	 * one per device, across all RTNL_BATCH_MAX chunks.
+	 */
+	list_for_each(tmp, dev_h, list) {
+		if (nsfd >= 0 && veth_can_create(tmp)) {
+			if (add_veth_create_req(&rth, tmp, nsfd))
+				goto err;
+			req[n].dev = tmp;
+			req[n++].create = 1;
+		} else if ((ret = h->veth_ctl(h, veid, ADD, tmp))) {
+			goto out;
+		}
+	}
+	if (n && (ret = rtnl_flush(&rth, veth_reply_cb, req)))
+		goto err;
+
+	if (!native || vznet_external_script()) {
+		list_for_each(tmp, dev_h, list)
+			if ((ret = run_vznetcfg(veid, tmp)))
+				goto out;
+		goto out;
+	}
+	n = 0;
+	list_for_each(tmp, dev_h, list) {
+		if (tmp->dev_name[0] == 0)
+			continue;
+		if (add_veth_up_req(&rth, tmp, !is_vz_kernel(h)))
+			goto err;
+		req[n].dev = tmp;
+		req[n++].create = 0;
+	}
+	if (n && (ret = rtnl_flush(&rth, veth_reply_cb, req)))
+		goto err;
+out:
+	if (nsfd >= 0)
+		close(nsfd);
+	if (native)
+		rtnl_close(&rth);
+	free(req);
+
+	return ret;
+err:
+	ret = VZ_VETH_ERROR;
+	goto out;
+}
+
 /** Create/remove veth devices for CT.
  *
  * @param h		CT handler.
@@ -112,15 +324,12 @@ static int veth_ctl(vps_handler *h, envid_t veid, int op, veth_param *list,
 	}
 	logger(0, 0, "%s veth devices: %s",
 		(op == ADD || op == CFG) ? "Configure" : "Deleting", buf);
-	list_for_each(tmp, dev_h, list) {
-		if (op == ADD || op == CFG) {
-			if ((ret = h->veth_ctl(h, veid, ADD, tmp)))
+	if (op == ADD || op == CFG) {
+		ret = veth_setup(h, veid, dev_h);
+	} else {
+		list_for_each(tmp, dev_h, list)
+			if ((ret = h->veth_ctl(h, veid, DEL, tmp)))
 				break;
-			if ((ret = run_vznetcfg(veid, tmp)))
-				break;
-		} else if ((ret = h->veth_ctl(h, veid, DEL, tmp))) {
-				break;
-		}
 	}
 	/* If operation failed remove added devices.
 	 * Remove devices from list to skip saving.
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <sys/utsname.h>
 #include <netinet/in.h>
 #include <linux/vzcalluser.h>
 
@@ -461,3 +462,159 @@ int vps_configure(vps_handler *h, envid_t veid, dist_actions *actions,
 	}
 	return 0;
 }
+
+/* Configuration fingerprint.
+ *
+ * A hash of everything the in-CT configure steps run on start
+ * (IP, hostname, DNS, 2nd-level quota, console) depend on, saved after
+ * these steps succeeded. If it is the same on next start, the CT
+ * already has this configuration applied and the steps are skipped.
+ */
+#define FP_FILE		VEFPDIR "/%d"
+
+static void fp_add(unsigned long long *h, const char *str)
+{
+	/* FNV-1a, including the terminating '\0' as a separator */
+	do {
+		*h ^= (unsigned char)*str;
+		*h *= 0x100000001b3ULL;
+	} while (*str++ != '\0');
+}
+
+static void fp_add_num(unsigned long long *h, unsigned long long num)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%llu", num);
+	fp_add(h, buf);
+}
+
+static void fp_add_list(unsigned long long *h, list_head_t *head)
+{
+	str_param *p;
+
+	list_for_each(p, head, list)
+		fp_add(h, p->val);
+	fp_add(h, "");
+}
+
+static void fp_add_file(unsigned long long *h, const char *file)
+{
+	struct stat st;
+
+	if (file == NULL)
+		return;
+	fp_add(h, file);
+	if (stat(file, &st) == 0) {
+		fp_add_num(h, st.st_mtime);
+		fp_add_num(h, st.st_size);
+	}
+}
+
+static int is_inherit(list_head_t *head)
+{
+	return !list_empty(head) && !strcmp(list_first_entry(head,
+				str_param, list)->val, "inherit");
+}
+
+/** Calculate CT configuration fingerprint.
+ *
+ * @param actions	distribution action scripts.
+ * @param fs		CT file system parameters.
+ * @param param		CT parameters.
+ * @param buf		buffer to store fingerprint string to.
+ * @param len		buffer size.
+ */
+void vps_config_fp_get(dist_actions *actions, const fs_param *fs,
+	vps_param *param, char *buf, int len)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	vps_res *res = &param->res;
+	struct utsname uts;
+	struct stat st;
+
+	fp_add(&h, res->misc.hostname ? : "");
+	fp_add_list(&h, &res->net.ip);
+	fp_add_num(&h, res->net.ipv6_net);
+	fp_add_list(&h, &res->misc.nameserver);
+	fp_add_list(&h, &res->misc.searchdomain);
+	if (is_inherit(&res->misc.nameserver) ||
+			is_inherit(&res->misc.searchdomain))
+		fp_add_file(&h, "/etc/resolv.conf");
+	if (res->dq.enable != NO && res->dq.ugidlimit != NULL) {
+		fp_add_num(&h, *res->dq.ugidlimit);
+		if (stat(fs->root, &st) == 0)
+			fp_add_num(&h, st.st_dev);
+	}
+	/* Changes if private area is replaced */
+	if (stat(fs->private, &st) == 0) {
+		fp_add_num(&h, st.st_dev);
+		fp_add_num(&h, st.st_ino);
+	}
+	if (uname(&uts) == 0)
+		fp_add(&h, uts.release);
+	fp_add_file(&h, actions->add_ip);
+	fp_add_file(&h, actions->set_hostname);
+	fp_add_file(&h, actions->set_dns);
+	fp_add_file(&h, actions->set_ugid_quota);
+	fp_add_file(&h, actions->set_console);
+
+	snprintf(buf, len, "%016llx", h);
+}
+
+/** Check whether CT configuration fingerprint is the same as saved.
+ *
+ * @param veid		CT ID.
+ * @param fp		fingerprint from vps_config_fp_get().
+ * @return		1 if it is the same, 0 otherwise.
+ */
+int vps_config_fp_check(envid_t veid, const char *fp)
+{
+	char file[STR_SIZE];
+	char buf[STR_SIZE];
+	FILE *f;
+	int ret = 0;
+
+	snprintf(file, sizeof(file), FP_FILE, veid);
+	if ((f = fopen(file, "r")) == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), f) != NULL) {
+		buf[strcspn(buf, "\n")] = '\0';
+		ret = !strcmp(buf, fp);
+	}
+	fclose(f);
+
+	return ret;
+}
+
+int vps_config_fp_save(envid_t veid, const char *fp)
+{
+	char file[STR_SIZE];
+	FILE *f;
+
+	snprintf(file, sizeof(file), FP_FILE, veid);
+	if ((f = fopen(file, "w")) == NULL) {
+		logger(1, errno, "Unable to create %s", file);
+		return -1;
+	}
+	fprintf(f, "%s\n", fp);
+	if (fclose(f)) {
+		unlink(file);
+		return -1;
+	}
+	return 0;
+}
+
+/** Forget CT configuration fingerprint, so all configure steps
+ * are run on next start. To be called whenever the configuration
+ * inside CT is changed other than by start.
+ *
+ * @param veid		CT ID.
+ */
+void vps_config_fp_remove(envid_t veid)
+{
+	char file[STR_SIZE];
+
+	snprintf(file, sizeof(file), FP_FILE, veid);
+	unlink(file);
+}
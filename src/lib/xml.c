@@ -7,6 +7,10 @@
 #include <libxml/xmlwriter.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "snapshot.h"
 #include "vzerror.h"
@@ -192,16 +196,15 @@ static int parse_xml(const char *basedir, xmlNode *root_node, struct vzctl_snaps
 	return ret;
 }
 
-static int update_child_by_guid(struct vzctl_snapshot_tree *tree, list_head_t *head, const char *guid)
+static int update_child_by_id(struct vzctl_snapshot_tree *tree, list_head_t *head, int id)
 {
 	int i, cnt = 0;
 	struct xml_node_param *it;
 	list_head_t childs;
 
 	list_head_init(&childs);
-	for (i = 0; i < tree->nsnapshots; i++) {
-		if (strcmp(tree->snapshots[i]->parent_guid, guid) != 0)
-			continue;
+	for (i = vzctl_snapshot_first_child(tree, id); i != -1;
+			i = vzctl_snapshot_next_sibling(tree, i)) {
 		if (add_xml_node(&childs, tree->snapshots[i]->guid, 1) == NULL)
 			return -1;
 		cnt++;
@@ -249,30 +252,21 @@ static int write_SavedStateItem(xmlTextWriterPtr writer, struct vzctl_snapshot_d
 
 static int is_last_in_subtree(struct vzctl_snapshot_tree *tree, int snap_idx)
 {
-	int i, max = -1;
-
-	for (i = 0; i < tree->nsnapshots; i++) {
-		if (strcmp(tree->snapshots[i]->parent_guid,
-				tree->snapshots[snap_idx]->parent_guid) == 0)
-			max = i;
-	}
-	return (max == snap_idx);
+	return vzctl_snapshot_next_sibling(tree, snap_idx) == -1;
 }
 
 static void write_close_tag(xmlTextWriterPtr writer,
-		struct vzctl_snapshot_tree *tree, const char *guid)
+		struct vzctl_snapshot_tree *tree, int id)
 {
 	int i;
 
 	do {
 		if (xmlTextWriterEndElement(writer) < 0)
 			vzctl_err(-1, 0, "Error at xmlTextWriterEndElement");
-		if (strcmp(guid, "") == 0)
-			break;
-		i = vzctl_find_snapshot_by_guid(tree, guid);
-		if (i == -1)
+		if (id == -1)
 			break;
-		guid = tree->snapshots[i]->parent_guid;
+		i = id;
+		id = vzctl_snapshot_parent(tree, i);
 	} while (is_last_in_subtree(tree, i));
 }
 
@@ -317,7 +311,7 @@ int vzctl_store_snapshot_tree(const char *fname, struct vzctl_snapshot_tree *tre
 		goto out;
 	}
 	// add initial entry
-	if (update_child_by_guid(tree, &pool, "") == -1) {
+	if (update_child_by_id(tree, &pool, -1) == -1) {
 		rc = VZ_RESOURCE_ERROR;
 		goto err;
 	}
@@ -352,11 +346,11 @@ int vzctl_store_snapshot_tree(const char *fname, struct vzctl_snapshot_tree *tre
 			rc = write_SavedStateItem(writer, snapshot);
 			if (rc)
 				goto err;
-			rc = update_child_by_guid(tree, &pool, guid);
+			rc = update_child_by_id(tree, &pool, i);
 			if (rc == -1)
 				goto err;
 			else if (rc == 0)// no more child
-				write_close_tag(writer, tree, guid);
+				write_close_tag(writer, tree, i);
 
 			list_del(&it->list);
 			free(it);
@@ -396,11 +390,211 @@ err:
 	return rc;
 }
 
+/* Snapshots.xml cache: the parsed tree in a binary form, valid as long
+ * as the XML file is the same (inode, size and mtime match).
+ */
+#define CACHE_MAGIC	"VZSNAPC1"
+#define CACHE_MAX_SIZE	(64 * 1024 * 1024)
+#define CACHE_NSTR	5
+
+struct cache_hdr {
+	char magic[8];
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+	uint32_t nsnapshots;
+	uint32_t crc;		/* crc32 of records */
+};
+
+/* A record is a uint32_t current flag followed by guid, parent_guid,
+ * name, date and desc, each being a uint32_t length and a string
+ * with its terminating zero.
+ */
+
+static void get_cache_path(const char *fname, char *buf, int size)
+{
+	const char *p;
+
+	p = strrchr(fname, '/');
+	if (p == NULL)
+		snprintf(buf, size, SNAPSHOT_CACHE);
+	else
+		snprintf(buf, size, "%.*s/" SNAPSHOT_CACHE,
+				(int)(p - fname), fname);
+}
+
+static void fill_cache_hdr(struct cache_hdr *hdr, const struct stat *st)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->ino = st->st_ino;
+	hdr->size = st->st_size;
+	hdr->mtime = st->st_mtim.tv_sec;
+	hdr->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static int same_stat(const struct stat *a, const struct stat *b)
+{
+	return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static char *put_str(char *p, const char *s)
+{
+	uint32_t len = strlen(s) + 1;
+
+	memcpy(p, &len, sizeof(len));
+	memcpy(p + sizeof(len), s, len);
+
+	return p + sizeof(len) + len;
+}
+
+static void write_cache(const char *fname, const struct stat *st,
+		struct vzctl_snapshot_tree *tree)
+{
+	struct cache_hdr hdr;
+	struct vzctl_snapshot_data *s;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	char *buf, *p;
+	size_t len = 0;
+	uint32_t current;
+	int i, fd, ret;
+
+	for (i = 0; i < tree->nsnapshots; i++) {
+		s = tree->snapshots[i];
+		len += sizeof(current) + CACHE_NSTR * sizeof(uint32_t) +
+			strlen(s->guid) + strlen(s->parent_guid) +
+			strlen(s->name) + strlen(s->date) +
+			strlen(s->desc) + CACHE_NSTR;
+	}
+	if (len > CACHE_MAX_SIZE || (buf = malloc(len)) == NULL)
+		return;
+	for (i = 0, p = buf; i < tree->nsnapshots; i++) {
+		s = tree->snapshots[i];
+		current = s->current;
+		memcpy(p, &current, sizeof(current));
+		p += sizeof(current);
+		p = put_str(p, s->guid);
+		p = put_str(p, s->parent_guid);
+		p = put_str(p, s->name);
+		p = put_str(p, s->date);
+		p = put_str(p, s->desc);
+	}
+	fill_cache_hdr(&hdr, st);
+	hdr.nsnapshots = tree->nsnapshots;
+	hdr.crc = crc32(0, (Bytef *)buf, len);
+
+	get_cache_path(fname, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		logger(1, errno, "Unable to create %s", tmp);
+		free(buf);
+		return;
+	}
+	ret = write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		write(fd, buf, len) != (ssize_t)len;
+	if (close(fd))
+		ret = 1;
+	if (ret || rename(tmp, path)) {
+		logger(1, errno, "Unable to write %s", path);
+		unlink(tmp);
+	}
+	free(buf);
+}
+
+static const char *get_str(const char **p, const char *end)
+{
+	const char *s;
+	uint32_t len;
+
+	if ((size_t)(end - *p) < sizeof(len))
+		return NULL;
+	memcpy(&len, *p, sizeof(len));
+	s = *p + sizeof(len);
+	if (len == 0 || len > (size_t)(end - s) || s[len - 1] != '\0' ||
+			strlen(s) != len - 1)
+		return NULL;
+	*p = s + len;
+
+	return s;
+}
+
+/* Returns 0 if the tree was read from a valid cache, -1 if there is
+ * no valid cache, or an error adding a snapshot to the tree.
+ */
+static int read_cache(const char *fname, const struct stat *st,
+		struct vzctl_snapshot_tree *tree)
+{
+	struct cache_hdr hdr, key;
+	struct stat cst;
+	char path[PATH_MAX];
+	const char *str[CACHE_NSTR], *p, *end;
+	char *buf = NULL;
+	uint32_t current, i;
+	size_t len;
+	int fd, j, pass, ret = -1;
+
+	get_cache_path(fname, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &cst) || cst.st_size < (off_t)sizeof(hdr) ||
+			cst.st_size > CACHE_MAX_SIZE ||
+			read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto out;
+	fill_cache_hdr(&key, st);
+	if (memcmp(hdr.magic, key.magic, sizeof(hdr.magic)) ||
+			hdr.ino != key.ino || hdr.size != key.size ||
+			hdr.mtime != key.mtime ||
+			hdr.mtime_nsec != key.mtime_nsec)
+		goto out;
+	len = cst.st_size - sizeof(hdr);
+	if ((buf = malloc(len)) == NULL ||
+			read(fd, buf, len) != (ssize_t)len ||
+			crc32(0, (Bytef *)buf, len) != hdr.crc)
+		goto out;
+
+	/* Check all records before adding any */
+	end = buf + len;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0, p = buf; i < hdr.nsnapshots; i++) {
+			if ((size_t)(end - p) < sizeof(current))
+				goto out;
+			memcpy(&current, p, sizeof(current));
+			p += sizeof(current);
+			for (j = 0; j < CACHE_NSTR; j++)
+				if ((str[j] = get_str(&p, end)) == NULL)
+					goto out;
+			if (pass == 1 && (ret = vzctl_add_snapshot_tree_entry(
+						tree, current, str[0], str[1],
+						str[2], str[3], str[4])))
+				goto out;
+		}
+		if (p != end)
+			goto out;
+	}
+	logger(1, 0, "Read snapshot tree from %s", path);
+	ret = 0;
+out:
+	free(buf);
+	close(fd);
+
+	return ret;
+}
+
 int vzctl_read_snapshot_tree(const char *fname, struct vzctl_snapshot_tree *tree)
 {
 	int ret;
 	xmlDoc *doc = NULL;
 	xmlNode *root_element = NULL;
+	struct stat st, st2;
+	int cache;
+
+	cache = (stat(fname, &st) == 0);
+	if (cache && (ret = read_cache(fname, &st, tree)) != -1)
+		return ret;
 
 	LIBXML_TEST_VERSION
 
@@ -414,5 +608,9 @@ int vzctl_read_snapshot_tree(const char *fname, struct vzctl_snapshot_tree *tree
 
 	xmlFreeDoc(doc);
 
+	/* Do not cache a file replaced while it was parsed */
+	if (ret == 0 && cache && stat(fname, &st2) == 0 && same_stat(&st, &st2))
+		write_cache(fname, &st, tree);
+
 	return ret;
 }
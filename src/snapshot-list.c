@@ -200,13 +200,12 @@ static int build_uuid_list(struct vzctl_snapshot_tree *tree, const char *guid)
 		}
 		return 0;
 	}
+	id = vzctl_find_snapshot_by_guid(tree, guid);
+	if (id == -1) {
+		fprintf(stderr, "Can't find snapshot by uuid %s\n", guid);
+		return VZ_INVALID_PARAMETER_VALUE;
+	}
 	for (n = 0; n < tree->nsnapshots; n++) {
-		id = vzctl_find_snapshot_by_guid(tree, guid);
-		if (id == -1) {
-			fprintf(stderr, "Can't find snapshot by uuid %s\n", guid);
-			return VZ_INVALID_PARAMETER_VALUE;
-		}
-
 		if (add_entry(&g_uuid_list_head, id))
 			return VZ_RESOURCE_ERROR;
 
@@ -215,6 +214,11 @@ static int build_uuid_list(struct vzctl_snapshot_tree *tree, const char *guid)
 			done = 1;
 			break;
 		}
+		id = vzctl_snapshot_parent(tree, id);
+		if (id == -1) {
+			fprintf(stderr, "Can't find snapshot by uuid %s\n", guid);
+			return VZ_INVALID_PARAMETER_VALUE;
+		}
 	}
 	if (!done) {
 		fprintf(stderr, "Inconsistency detected, base image not found\n");
@@ -0,0 +1,452 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * vzctl snapshot-many: snapshot a set of containers at the same point
+ * in time, for consistent backups of applications spread over a few CTs.
+ * Every CT is handled by its own worker process. Workers freeze their
+ * CTs, and only once all CTs are frozen they are told to create ploop
+ * snapshots and dump the CTs, all in parallel. Then all CTs are resumed
+ * and snapshots are committed or, if anything failed, all the snapshots
+ * are rolled back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "vzerror.h"
+#include "vzconfig.h"
+#include "logger.h"
+#include "exec.h"
+#include "env.h"
+#include "lock.h"
+#include "util.h"
+#include "snapshot.h"
+
+/* Commands from the parent to workers */
+#define SNAP_GO		'g'	/* proceed to the next stage */
+#define SNAP_ABORT	'a'	/* roll back */
+
+/* Sent by a worker after every stage */
+struct snap_status {
+	int status;
+	char guid[39];
+};
+
+struct snap_job {
+	envid_t veid;
+	pid_t pid;
+	int fd;		/* socket to the worker, -1 if it failed */
+	int err;	/* error reported by the worker */
+	int status;	/* worker exit status */
+	char guid[39];
+};
+
+struct snapshot_many_param {
+	envid_t *ves;
+	int nves;
+	int skiplock;
+	char guid[39];
+	struct vzctl_snapshot_param snap;
+};
+
+static void usage_snapshot_many(int err)
+{
+	fprintf(err ? stderr : stdout,
+"vzctl snapshot-many --ctids <ctid[,ctid...]>|all [--id <uuid>]\n"
+"   [--name <name>] [--description <desc>] [--skip-suspend] [--skip-config]\n");
+}
+
+static int parse_snapshot_many_opt(vps_handler *h, int argc, char **argv,
+		struct snapshot_many_param *p)
+{
+	int c;
+	char *ctids = NULL;
+	static struct option snapshot_many_options[] = {
+		{"ctids",	required_argument, NULL, 'c'},
+		{"id",		required_argument, NULL, 'i'},
+		{"uuid",	required_argument, NULL, 'i'},
+		{"name",	required_argument, NULL, 'n'},
+		{"description",	required_argument, NULL, 'd'},
+		{"skip-suspend", no_argument, NULL, 'S'},
+		{"skip-config",	no_argument, NULL, 'C'},
+		{"help",	no_argument, NULL, 'h'},
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while (1) {
+		c = getopt_long(argc, argv, "+", snapshot_many_options, NULL);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'c':
+			ctids = optarg;
+			break;
+		case 'i':
+			if (vzctl_get_normalized_guid(optarg, p->guid,
+						sizeof(p->guid)))
+				return vzctl_err(VZ_INVALID_PARAMETER_VALUE, 0,
+					"Invalid value for --id: %s", optarg);
+			p->snap.guid = p->guid;
+			break;
+		case 'n':
+			p->snap.name = optarg;
+			break;
+		case 'd':
+			p->snap.desc = optarg;
+			break;
+		case 'S':
+			p->snap.flags |= SNAPSHOT_SKIP_SUSPEND;
+			break;
+		case 'C':
+			p->snap.flags |= SNAPSHOT_SKIP_CONFIG;
+			break;
+		case 'h':
+			usage_snapshot_many(0);
+			exit(0);
+		default:
+			usage_snapshot_many(1);
+			return VZ_INVALID_PARAMETER_SYNTAX;
+		}
+	}
+
+	if (ctids == NULL) {
+		usage_snapshot_many(1);
+		return vzctl_err(VZ_INVALID_PARAMETER_SYNTAX, 0,
+				"Option --ctids is required");
+	}
+	if (optind < argc) {
+		usage_snapshot_many(1);
+		return vzctl_err(VZ_INVALID_PARAMETER_SYNTAX, 0,
+				"Non-option argument given: %s", argv[optind]);
+	}
+
+	return parse_ve_list(h, ctids, &p->ves, &p->nves);
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (char *)buf + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Runs in a worker process: report the stage status to the parent and,
+ * if it is successful, wait for the command to go on.
+ * Returns 0 if the worker is to proceed.
+ */
+static int sync_parent(int fd, int status, const char *guid)
+{
+	struct snap_status st = {};
+	char cmd;
+
+	st.status = status;
+	if (guid != NULL)
+		snprintf(st.guid, sizeof(st.guid), "%s", guid);
+	if (write(fd, &st, sizeof(st)) != sizeof(st))
+		return -1;
+	if (status)
+		return -1;
+	/* EOF means the parent is gone, roll back */
+	if (read_all(fd, &cmd, sizeof(cmd)) || cmd != SNAP_GO) {
+		logger(1, 0, "Snapshot is aborted");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Runs in a worker process: create a snapshot of a CT
+ * in lockstep with the other workers.
+ */
+static int snapshot_one(envid_t veid, int fd, struct snapshot_many_param *p)
+{
+	vps_handler *h;
+	vps_param *g_p, *vps_p;
+	struct vzctl_snapshot_ctx *ctx;
+	char conf[STR_SIZE];
+	int ret, lock_id;
+
+	set_log_ctid(veid);
+	g_p = init_vps_param();
+	vps_p = init_vps_param();
+
+	get_vps_conf_path(veid, conf, sizeof(conf));
+	if (vps_parse_config(veid, GLOBAL_CFG, g_p, NULL)) {
+		ret = VZ_NOCONFIG;
+		goto out;
+	}
+	if (stat_file(conf) != 1) {
+		ret = vzctl_err(VZ_NOVECONFIG, 0,
+				"Container config file does not exist");
+		goto out;
+	}
+	if (vps_parse_config(veid, conf, vps_p, NULL)) {
+		ret = VZ_NOCONFIG;
+		goto out;
+	}
+	merge_vps_param(g_p, vps_p);
+
+	if (p->skiplock != YES) {
+		lock_id = vps_lock(veid, g_p->opt.lockdir, "");
+		if (lock_id > 0) {
+			ret = vzctl_err(VZ_LOCKED, 0,
+					"Container already locked");
+			goto out;
+		} else if (lock_id < 0) {
+			ret = vzctl_err(VZ_SYSTEM_ERROR, 0,
+					"Unable to lock container");
+			goto out;
+		}
+	}
+	if ((h = vz_open(veid, g_p)) == NULL) {
+		ret = VZ_BAD_KERNEL;
+		goto out_unlock;
+	}
+
+	/* 1 freeze, and wait for all the others to freeze */
+	ret = vzctl_snapshot_begin(h, veid, &g_p->res.fs, &p->snap, &ctx);
+	if (sync_parent(fd, ret, ret ? NULL : vzctl_snapshot_guid(ctx))) {
+		if (ret == 0)
+			ret = vzctl_snapshot_end(ctx, VZCTL_E_CREATE_SNAPSHOT);
+		goto out_close;
+	}
+	/* 2 snapshot and dump, and wait for all the others to finish */
+	ret = vzctl_snapshot_take(ctx);
+	if (sync_parent(fd, ret, NULL) && ret == 0)
+		ret = VZCTL_E_CREATE_SNAPSHOT;
+	/* 3 resume, commit or roll back */
+	ret = vzctl_snapshot_end(ctx, ret);
+
+out_close:
+	vz_close(h);
+out_unlock:
+	if (p->skiplock != YES)
+		vps_unlock(veid, g_p->opt.lockdir);
+out:
+	close(fd);
+	free_vps_param(g_p);
+	free_vps_param(vps_p);
+
+	return ret;
+}
+
+static int start_job(struct snap_job *jobs, int n,
+		struct snapshot_many_param *p)
+{
+	struct snap_job *job = &jobs[n];
+	int sk[2], i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sk) < 0)
+		return vzctl_err(VZ_RESOURCE_ERROR, errno,
+				"Unable to create socket pair");
+	fflush(stdout);
+	fflush(stderr);
+	job->pid = fork();
+	if (job->pid < 0) {
+		close(sk[0]);
+		close(sk[1]);
+		return vzctl_err(VZ_RESOURCE_ERROR, errno, "Unable to fork");
+	} else if (job->pid == 0) {
+		/* Let the worker finish the stage it is in on Ctrl-C;
+		 * it rolls back when it sees the parent is gone.
+		 */
+		signal(SIGINT, SIG_IGN);
+		/* Do not hold the other workers' sockets, or they would
+		 * never see EOF if the parent dies.
+		 */
+		for (i = 0; i < n; i++)
+			if (jobs[i].fd >= 0)
+				close(jobs[i].fd);
+		close(sk[0]);
+		exit(snapshot_one(job->veid, sk[1], p));
+	}
+	close(sk[1]);
+	job->fd = sk[0];
+
+	return 0;
+}
+
+/* Collect the current stage status from all the workers still running.
+ * Returns the number of workers failed.
+ */
+static int wait_stage(struct snap_job *jobs, int n)
+{
+	struct snap_status st;
+	int i, failed = 0;
+
+	for (i = 0; i < n; i++) {
+		if (jobs[i].fd < 0)
+			continue;
+		if (read_all(jobs[i].fd, &st, sizeof(st)))
+			st.status = VZCTL_E_CREATE_SNAPSHOT;
+		if (st.status) {
+			jobs[i].err = st.status;
+			close(jobs[i].fd);
+			jobs[i].fd = -1;
+			failed++;
+			continue;
+		}
+		if (st.guid[0] != '\0')
+			memcpy(jobs[i].guid, st.guid, sizeof(jobs[i].guid));
+	}
+
+	return failed;
+}
+
+static void send_cmd(struct snap_job *jobs, int n, char cmd)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (jobs[i].fd >= 0 && write(jobs[i].fd, &cmd, 1) != 1)
+			logger(-1, errno, "CT %d: unable to send command",
+					jobs[i].veid);
+}
+
+static double tv_diff(struct timeval *a, struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+/** Create snapshots of a number of containers at the same point in time.
+ *
+ * @param g_p		global parameters.
+ * @param argc		number of arguments (argv[0] is program name).
+ * @param argv		snapshot-many options.
+ * @param skiplock	do not lock containers.
+ * @return		0 if snapshots of all CTs are created.
+ */
+int snapshot_many(vps_param *g_p, int argc, char **argv, int skiplock)
+{
+	struct snapshot_many_param p = {};
+	struct snap_job *jobs = NULL;
+	struct timeval tv[4];
+	vps_handler *h;
+	int i, started, failed = 0, ret;
+
+	if ((h = vz_open(0, g_p)) == NULL)
+		return VZ_BAD_KERNEL;
+	ret = parse_snapshot_many_opt(h, argc, argv, &p);
+	vz_close(h);
+	if (ret)
+		goto out;
+	if (p.nves == 0) {
+		logger(0, 0, "No containers to snapshot");
+		goto out;
+	}
+	p.skiplock = skiplock;
+
+	jobs = calloc(p.nves, sizeof(*jobs));
+	if (jobs == NULL) {
+		ret = vzctl_err(VZ_RESOURCE_ERROR, ENOMEM,
+				"Unable to allocate job table");
+		goto out;
+	}
+	for (i = 0; i < p.nves; i++) {
+		jobs[i].veid = p.ves[i];
+		jobs[i].fd = -1;
+	}
+
+	logger(0, 0, "Creating snapshots of %d containers", p.nves);
+	gettimeofday(&tv[0], NULL);
+	/* All the workers are to run at once, since all the CTs
+	 * are to be frozen at the same time.
+	 */
+	for (started = 0; started < p.nves; started++)
+		if (start_job(jobs, started, &p)) {
+			failed++;
+			break;
+		}
+
+	/* 1 all CTs are frozen */
+	failed += wait_stage(jobs, started);
+	gettimeofday(&tv[1], NULL);
+	tv[2] = tv[1];
+	if (!failed) {
+		logger(1, 0, "All containers are frozen in %.3f s",
+				tv_diff(&tv[0], &tv[1]));
+		send_cmd(jobs, started, SNAP_GO);
+		/* 2 all snapshots are taken */
+		failed += wait_stage(jobs, started);
+		gettimeofday(&tv[2], NULL);
+		if (!failed)
+			logger(1, 0, "All snapshots are taken in %.3f s",
+					tv_diff(&tv[1], &tv[2]));
+	}
+	/* 3 resume, and commit or roll back */
+	send_cmd(jobs, started, failed ? SNAP_ABORT : SNAP_GO);
+	for (i = 0; i < started; i++) {
+		if (jobs[i].fd >= 0)
+			close(jobs[i].fd);
+		jobs[i].status = env_wait(jobs[i].pid);
+	}
+	gettimeofday(&tv[3], NULL);
+
+	for (i = 0; i < started; i++) {
+		if (jobs[i].err)
+			logger(-1, 0, "CT %d: failed to create snapshot "
+					"(exit status %d)", jobs[i].veid,
+					jobs[i].status ? : jobs[i].err);
+		else if (jobs[i].status && !failed)
+			/* All stages passed, yet the worker failed */
+			logger(-1, 0, "CT %d: snapshot %s may be incomplete "
+					"(exit status %d)", jobs[i].veid,
+					jobs[i].guid, jobs[i].status);
+	}
+	if (failed) {
+		logger(-1, 0, "Failed to create snapshots, "
+				"all containers are rolled back");
+		ret = VZCTL_E_CREATE_SNAPSHOT;
+		goto out;
+	}
+	for (i = 0; i < started; i++) {
+		if (jobs[i].status)
+			ret = VZCTL_E_CREATE_SNAPSHOT;
+		else
+			logger(0, 0, "CT %d: snapshot %s has been created",
+					jobs[i].veid, jobs[i].guid);
+	}
+	if (!(p.snap.flags & SNAPSHOT_SKIP_SUSPEND))
+		logger(0, 0, "Containers were frozen for %.3f s at most",
+				tv_diff(&tv[0], &tv[3]));
+	logger(1, 0, "Resumed in %.3f s", tv_diff(&tv[2], &tv[3]));
+out:
+	free(jobs);
+	free(p.ves);
+
+	return ret;
+}
@@ -58,31 +58,46 @@ int is_snapshot_supported(const fs_param *fs)
 	return is_ploop_supported();
 }
 
-int vzctl_env_create_snapshot(vps_handler *h, envid_t veid,
-		const fs_param *fs,
-		const struct vzctl_snapshot_param *param)
-{
-	int ret, run = 0;
-	cpt_param cpt = {};
+/* Snapshot being created, see vzctl_snapshot_begin() */
+struct vzctl_snapshot_ctx {
+	vps_handler *h;
+	envid_t veid;
+	const fs_param *fs;
 	char guid[39];
+	char tmp[PATH_MAX];		/* new Snapshots.xml */
+	char snap_ve_conf[PATH_MAX];
+	struct ploop_disk_images_data *di;
+	int run;
+	int taken;			/* ploop snapshot is created */
+};
+
+int vzctl_snapshot_begin(vps_handler *h, envid_t veid, const fs_param *fs,
+		const struct vzctl_snapshot_param *param,
+		struct vzctl_snapshot_ctx **ctx)
+{
+	int ret;
 	char fname[PATH_MAX];
-	char tmp[PATH_MAX];
-	char snap_ve_conf[PATH_MAX] = "";
-	struct ploop_snapshot_param image_param = {};
-	struct ploop_merge_param merge_param = {};
-	struct ploop_disk_images_data *di = NULL;
+	struct vzctl_snapshot_ctx *c;
 	struct vzctl_snapshot_tree *tree = NULL;
 
 	if (!is_snapshot_supported(fs))
 		return VZCTL_E_CREATE_SNAPSHOT;
+	c = calloc(1, sizeof(*c));
 	tree = vzctl_alloc_snapshot_tree();
-	if (tree == NULL)
+	if (c == NULL || tree == NULL) {
+		free(c);
+		free(tree);
 		return VZ_RESOURCE_ERROR;
+	}
+	c->h = h;
+	c->veid = veid;
+	c->fs = fs;
+	*ctx = c;
 	if (param->guid == NULL) {
-		if (ploop.uuid_generate(guid, sizeof(guid)))
+		if (ploop.uuid_generate(c->guid, sizeof(c->guid)))
 			goto err;
 	} else
-		snprintf(guid, sizeof(guid), "%s", param->guid);
+		snprintf(c->guid, sizeof(c->guid), "%s", param->guid);
 	GET_SNAPSHOT_XML(fname, fs->private);
 	if (stat_file(fname) == 1) {
 		ret = vzctl_read_snapshot_tree(fname, tree);
@@ -91,94 +106,151 @@ int vzctl_env_create_snapshot(vps_handler *h, envid_t veid,
 			goto err;
 		}
 	}
-	logger(0, 0, "Creating snapshot %s", guid);
+	logger(0, 0, "Creating snapshot %s", c->guid);
 	GET_DISK_DESCRIPTOR(fname, fs->private);
-	if (ploop.read_disk_descr(&di, fname)) {
+	if (ploop.read_disk_descr(&c->di, fname)) {
 		logger(-1, 0, "Failed to read %s", fname);
 		goto err;
 	}
 	// Store snapshot.xml
-	ret = vzctl_add_snapshot(tree, guid, param);
+	ret = vzctl_add_snapshot(tree, c->guid, param);
 	if (ret)
 		goto err;
-	GET_SNAPSHOT_XML_TMP(tmp, fs->private);
-	ret = vzctl_store_snapshot_tree(tmp, tree);
+	GET_SNAPSHOT_XML_TMP(c->tmp, fs->private);
+	ret = vzctl_store_snapshot_tree(c->tmp, tree);
 	if (ret) {
-		logger(-1, 0, "Failed to store %s", tmp);
+		logger(-1, 0, "Failed to store %s", c->tmp);
 		goto err;
 	}
 	if (!(param->flags & SNAPSHOT_SKIP_CONFIG)) {
 		// Store ve.conf
 		get_vps_conf_path(veid, fname, sizeof(fname));
-		vzctl_get_snapshot_ve_conf(fs->private, guid,
-				snap_ve_conf, sizeof(snap_ve_conf));
-		make_dir(snap_ve_conf, 0);
-		if (cp_file(snap_ve_conf, fname))
-			goto err1;
+		vzctl_get_snapshot_ve_conf(fs->private, c->guid,
+				c->snap_ve_conf, sizeof(c->snap_ve_conf));
+		make_dir(c->snap_ve_conf, 0);
+		if (cp_file(c->snap_ve_conf, fname))
+			goto err;
 	}
 
 	if (!(param->flags & SNAPSHOT_SKIP_SUSPEND))
-		run = vps_is_run(h, veid);
+		c->run = vps_is_run(h, veid);
 	/* 1 freeze */
-	if (run) {
+	if (c->run) {
+		cpt_param cpt = {};
+
 		ret = vps_chkpnt(h, veid, fs, CMD_SUSPEND, &cpt);
 		if (ret)
-			goto err1;
+			goto err;
 	}
+	vzctl_free_snapshot_tree(tree);
+
+	return 0;
+
+err:
+	vzctl_free_snapshot_tree(tree);
+	*ctx = NULL;
+	return vzctl_snapshot_end(c, VZCTL_E_CREATE_SNAPSHOT);
+}
+
+int vzctl_snapshot_take(struct vzctl_snapshot_ctx *c)
+{
+	int ret;
+	cpt_param cpt = {};
+	char fname[PATH_MAX];
+	struct ploop_snapshot_param image_param = {};
+
 	/* 2 create snapshot with specified guid */
-	image_param.guid = guid;
-	PLOOP_CLEANUP(ret = ploop.create_snapshot(di, &image_param));
+	image_param.guid = c->guid;
+	PLOOP_CLEANUP(ret = ploop.create_snapshot(c->di, &image_param));
 	if (ret) {
 		logger(-1, 0, "Failed to create snapshot: %s [%d]",
 				ploop.get_last_error(), ret);
-		goto err1;
+		return VZCTL_E_CREATE_SNAPSHOT;
 	}
-	/* 3 store dump & continue */
-	if (run) {
-		vzctl_get_snapshot_dumpfile(fs->private, guid, fname, sizeof(fname));
+	c->taken = 1;
+	/* 3 store dump */
+	if (c->run) {
+		vzctl_get_snapshot_dumpfile(c->fs->private, c->guid,
+				fname, sizeof(fname));
 		cpt.dumpfile = fname;
-		ret = vps_chkpnt(h, veid, fs, CMD_DUMP, &cpt);
+		ret = vps_chkpnt(c->h, c->veid, c->fs, CMD_DUMP, &cpt);
 		if (ret)
-			goto err2;
-		if (cpt_cmd(h, veid, fs->root, CMD_CHKPNT, CMD_RESUME, 0))
-			logger(-1, 0, "Failed to resume Container");
+			return VZCTL_E_CREATE_SNAPSHOT;
 	}
+
+	return 0;
+}
+
+int vzctl_snapshot_end(struct vzctl_snapshot_ctx *c, int err)
+{
+	int ret;
+	char fname[PATH_MAX];
+	struct ploop_merge_param merge_param = {};
+
+	if (err)
+		goto err;
+	/* continue */
+	if (c->run && cpt_cmd(c->h, c->veid, c->fs->root,
+				CMD_CHKPNT, CMD_RESUME, 0))
+		logger(-1, 0, "Failed to resume Container");
 	// move snapshot.xml to its place
-	GET_SNAPSHOT_XML(fname, fs->private);
-	if (rename(tmp, fname))
-		logger(-1, errno, "Failed to rename %s -> %s", tmp, fname);
+	GET_SNAPSHOT_XML(fname, c->fs->private);
+	if (rename(c->tmp, fname))
+		logger(-1, errno, "Failed to rename %s -> %s", c->tmp, fname);
 	logger(0, 0, "Snapshot %s has been successfully created",
-			guid);
+			c->guid);
 	ret = 0;
 	goto out;
 
-err2:
-	// merge top_delta
-	merge_param.guid = guid;
-	PLOOP_CLEANUP(ret = ploop.merge_snapshot(di, &merge_param));
-	if (ret)
-		logger(-1, 0, "Rollback failed, ploop_merge_snapshot %s: %s [%d]",
-				guid, ploop.get_last_error(), ret);
-
-err1:
-	if (run)
-		cpt_cmd(h, veid, fs->root, CMD_CHKPNT, CMD_RESUME, 0);
-	unlink(tmp);
-	unlink(snap_ve_conf);
-
 err:
+	if (c->taken) {
+		// merge top_delta
+		merge_param.guid = c->guid;
+		PLOOP_CLEANUP(ret = ploop.merge_snapshot(c->di, &merge_param));
+		if (ret)
+			logger(-1, 0, "Rollback failed, ploop_merge_snapshot %s: %s [%d]",
+					c->guid, ploop.get_last_error(), ret);
+		vzctl_get_snapshot_dumpfile(c->fs->private, c->guid,
+				fname, sizeof(fname));
+		unlink(fname);
+	}
+	if (c->run)
+		cpt_cmd(c->h, c->veid, c->fs->root, CMD_CHKPNT, CMD_RESUME, 0);
+	if (c->tmp[0] != '\0')
+		unlink(c->tmp);
+	if (c->snap_ve_conf[0] != '\0')
+		unlink(c->snap_ve_conf);
 	ret = VZCTL_E_CREATE_SNAPSHOT;
 	logger(-1, 0, "Failed to create snapshot");
 
 out:
-	if (di != NULL)
-		ploop.free_diskdescriptor(di);
-	if (tree != NULL)
-		vzctl_free_snapshot_tree(tree);
+	if (c->di != NULL)
+		ploop.free_diskdescriptor(c->di);
+	free(c);
 
 	return ret;
 }
 
+const char *vzctl_snapshot_guid(struct vzctl_snapshot_ctx *c)
+{
+	return c->guid;
+}
+
+int vzctl_env_create_snapshot(vps_handler *h, envid_t veid,
+		const fs_param *fs,
+		const struct vzctl_snapshot_param *param)
+{
+	struct vzctl_snapshot_ctx *ctx;
+	int ret;
+
+	ret = vzctl_snapshot_begin(h, veid, fs, param, &ctx);
+	if (ret)
+		return ret;
+	ret = vzctl_snapshot_take(ctx);
+
+	return vzctl_snapshot_end(ctx, ret);
+}
+
 int vzctl_env_switch_snapshot(vps_handler *h, envid_t veid,
 		vps_param *g_p, const struct vzctl_snapshot_param *param)
 {
@@ -0,0 +1,373 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * vzctl start-many: start a set of containers using a number of
+ * parallel worker processes, then (with --wait) wait for all of them
+ * to reach their default runlevel from this single process, watching
+ * the start marks through CT roots rather than entering every CT.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "vzerror.h"
+#include "vzconfig.h"
+#include "logger.h"
+#include "script.h"
+#include "env.h"
+#include "util.h"
+#include "vzctl.h"
+
+/* Worker exit status for a CT restored from its dump, not started */
+#define START_RESTORED	255
+
+int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
+	vps_param *cmd_p, int argc, char **argv, int skiplock);
+
+struct start_job {
+	envid_t veid;
+	pid_t pid;
+	int status;
+	int restored;	/* CT is restored, no need to wait for it */
+	char *root;	/* CT root, to wait for the CT */
+};
+
+struct start_many_param {
+	envid_t *ves;
+	int nves;
+	int jobs;
+	int wait;
+	int timeout;	/* wait timeout, seconds; 0 - unlimited */
+	int skiplock;
+};
+
+static void usage_start_many(int err)
+{
+	fprintf(err ? stderr : stdout,
+"vzctl start-many --ctids <ctid[,ctid...]> [--jobs <N>]\n"
+"   [--wait [--timeout <seconds>]]\n");
+}
+
+static int parse_start_many_opt(vps_handler *h, int argc, char **argv,
+		struct start_many_param *p)
+{
+	int c;
+	char *ctids = NULL;
+	static struct option start_many_options[] = {
+		{"ctids",	required_argument, NULL, 'c'},
+		{"jobs",	required_argument, NULL, 'j'},
+		{"wait",	no_argument, NULL, 'w'},
+		{"timeout",	required_argument, NULL, 't'},
+		{"help",	no_argument, NULL, 'h'},
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while (1) {
+		c = getopt_long(argc, argv, "+", start_many_options, NULL);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'c':
+			ctids = optarg;
+			break;
+		case 'j':
+			if (parse_int(optarg, &p->jobs) || p->jobs <= 0)
+				return vzctl_err(VZ_INVALID_PARAMETER_VALUE, 0,
+					"Invalid value for --jobs: %s",
+					optarg);
+			break;
+		case 'w':
+			p->wait = 1;
+			break;
+		case 't':
+			if (parse_int(optarg, &p->timeout) || p->timeout < 0)
+				return vzctl_err(VZ_INVALID_PARAMETER_VALUE, 0,
+					"Invalid value for --timeout: %s",
+					optarg);
+			break;
+		case 'h':
+			usage_start_many(0);
+			exit(0);
+		default:
+			usage_start_many(1);
+			return VZ_INVALID_PARAMETER_SYNTAX;
+		}
+	}
+
+	if (ctids == NULL) {
+		usage_start_many(1);
+		return vzctl_err(VZ_INVALID_PARAMETER_SYNTAX, 0,
+				"Option --ctids is required");
+	}
+	/* For parse_ve_list(), "all" is all running CTs */
+	if (!strcmp(ctids, "all"))
+		return vzctl_err(VZ_INVALID_PARAMETER_VALUE, 0,
+				"--ctids all can not be used for start-many");
+	if (optind < argc) {
+		usage_start_many(1);
+		return vzctl_err(VZ_INVALID_PARAMETER_SYNTAX, 0,
+				"Non-option argument given: %s", argv[optind]);
+	}
+
+	return parse_ve_list(h, ctids, &p->ves, &p->nves);
+}
+
+/* Read the global and CT configs, the same way vzctl does for a CT */
+static int read_ct_config(envid_t veid, vps_param **g_p, vps_param **vps_p)
+{
+	char conf[STR_SIZE];
+
+	*g_p = init_vps_param();
+	*vps_p = init_vps_param();
+	get_vps_conf_path(veid, conf, sizeof(conf));
+	if (vps_parse_config(veid, GLOBAL_CFG, *g_p, NULL))
+		return VZ_NOCONFIG;
+	if (stat_file(conf) != 1)
+		return vzctl_err(VZ_NOVECONFIG, 0,
+				"Container config file does not exist");
+	if (vps_parse_config(veid, conf, *vps_p, NULL))
+		return VZ_NOCONFIG;
+	/* do not use the layout from global config, autodetect it */
+	(*g_p)->res.fs.layout = 0;
+	merge_vps_param(*g_p, *vps_p);
+
+	return 0;
+}
+
+/* Runs in a worker process: start a CT the same way vzctl start does,
+ * i.e. restore it if it has a dump file. With wait, the CT start mark
+ * is set, but waiting for it is left to the parent.
+ */
+static int start_one(envid_t veid, struct start_many_param *p)
+{
+	vps_param *g_p, *vps_p, *cmd_p;
+	int ret;
+
+	set_log_ctid(veid);
+	cmd_p = init_vps_param();
+	if (p->wait) {
+		cmd_p->res.misc.wait = YES;
+		cmd_p->opt.skip_wait = YES;
+	}
+	if ((ret = read_ct_config(veid, &g_p, &vps_p)))
+		goto out;
+	merge_global_param(cmd_p, g_p);
+	ret = run_action(veid, ACTION_START, g_p, vps_p, cmd_p, 0, NULL,
+			p->skiplock);
+	/* start() only passes the wait flag on to vps_start(), so it is
+	 * not set if the CT was restored, and there is nothing to wait for.
+	 */
+	if (ret == 0 && p->wait && g_p->res.misc.wait != YES)
+		ret = START_RESTORED;
+out:
+	free_vps_param(g_p);
+	free_vps_param(vps_p);
+	free_vps_param(cmd_p);
+
+	return ret;
+}
+
+static int start_job(struct start_job *job, struct start_many_param *p)
+{
+	fflush(stdout);
+	fflush(stderr);
+	job->pid = fork();
+	if (job->pid < 0)
+		return vzctl_err(VZ_RESOURCE_ERROR, errno, "Unable to fork");
+	else if (job->pid == 0)
+		exit(start_one(job->veid, p));
+
+	return 0;
+}
+
+/* Start all CTs, running up to p->jobs workers at a time */
+static void run_jobs(struct start_many_param *p, struct start_job *jobs)
+{
+	int i, next = 0, running = 0, status;
+	pid_t pid;
+
+	while (next < p->nves || running) {
+		while (running < p->jobs && next < p->nves) {
+			if (start_job(&jobs[next], p))
+				jobs[next].status = VZ_RESOURCE_ERROR;
+			else
+				running++;
+			next++;
+		}
+		if (!running)
+			break;
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Error in waitpid()");
+			for (i = 0; i < next; i++)
+				if (jobs[i].pid > 0)
+					jobs[i].status = VZ_SYSTEM_ERROR;
+			break;
+		}
+		for (i = 0; i < next; i++)
+			if (jobs[i].pid == pid)
+				break;
+		if (i == next)
+			continue;
+		if (WIFEXITED(status) &&
+				WEXITSTATUS(status) == START_RESTORED)
+			jobs[i].restored = 1;
+		else if (WIFEXITED(status))
+			jobs[i].status = WEXITSTATUS(status);
+		else if (WIFSIGNALED(status))
+			jobs[i].status = VZ_SYSTEM_ERROR;
+		else
+			continue;
+		jobs[i].pid = 0;
+		running--;
+	}
+}
+
+/* Wait for all started CTs at once, see vps_wait_started() */
+static int wait_jobs(vps_handler *h, struct start_many_param *p,
+		struct start_job *jobs)
+{
+	envid_t *veids;
+	const char **roots;
+	int *ready;
+	vps_param *g_p, *vps_p;
+	int i, n = 0, ret = 0;
+
+	veids = calloc(p->nves, sizeof(*veids));
+	roots = calloc(p->nves, sizeof(*roots));
+	ready = calloc(p->nves, sizeof(*ready));
+	if (veids == NULL || roots == NULL || ready == NULL) {
+		ret = vzctl_err(VZ_RESOURCE_ERROR, ENOMEM,
+				"Unable to allocate memory");
+		goto out;
+	}
+	for (i = 0; i < p->nves; i++) {
+		if (jobs[i].status || jobs[i].restored)
+			continue;
+		if (read_ct_config(jobs[i].veid, &g_p, &vps_p) == 0 &&
+				g_p->res.fs.root != NULL)
+			jobs[i].root = strdup(g_p->res.fs.root);
+		free_vps_param(g_p);
+		free_vps_param(vps_p);
+		if (jobs[i].root == NULL) {
+			logger(-1, 0, "CT %d: unable to get VE_ROOT",
+					jobs[i].veid);
+			jobs[i].status = VZ_WAIT_FAILED;
+			ret = VZ_WAIT_FAILED;
+			continue;
+		}
+		veids[n] = jobs[i].veid;
+		roots[n++] = jobs[i].root;
+	}
+	if (n == 0)
+		goto out;
+	logger(0, 0, "Waiting for %d containers to start ...", n);
+	if (vps_wait_started(h, veids, roots, n, p->timeout, ready))
+		ret = VZ_WAIT_FAILED;
+	for (i = 0; i < n; i++) {
+		if (ready[i] == 1)
+			continue;
+		logger(-1, 0, "CT %d: %s", veids[i], ready[i] == 0 ?
+				"not started in time" : "wait failed");
+	}
+out:
+	free(veids);
+	free(roots);
+	free(ready);
+
+	return ret;
+}
+
+/** Start a number of containers in parallel.
+ *
+ * @param g_p		global parameters.
+ * @param argc		number of arguments (argv[0] is program name).
+ * @param argv		start-many options.
+ * @param skiplock	do not lock containers.
+ * @return		0 if all CTs are started.
+ */
+int start_many(vps_param *g_p, int argc, char **argv, int skiplock)
+{
+	struct start_many_param p = {};
+	struct start_job *jobs = NULL;
+	vps_handler *h;
+	int i, failed = 0, ret;
+
+	p.timeout = MAX_WAIT_TIMEOUT;
+	if ((h = vz_open(0, g_p)) == NULL)
+		return VZ_BAD_KERNEL;
+	if ((ret = parse_start_many_opt(h, argc, argv, &p)))
+		goto out;
+	if (p.nves == 0) {
+		logger(0, 0, "No containers to start");
+		goto out;
+	}
+	p.skiplock = skiplock;
+	if (p.jobs == 0)
+		p.jobs = get_num_cpu();
+	if (p.jobs > p.nves)
+		p.jobs = p.nves;
+
+	jobs = calloc(p.nves, sizeof(*jobs));
+	if (jobs == NULL) {
+		ret = vzctl_err(VZ_RESOURCE_ERROR, ENOMEM,
+				"Unable to allocate job table");
+		goto out;
+	}
+	for (i = 0; i < p.nves; i++)
+		jobs[i].veid = p.ves[i];
+
+	logger(0, 0, "Starting %d containers, %d jobs", p.nves, p.jobs);
+	run_jobs(&p, jobs);
+	for (i = 0; i < p.nves; i++) {
+		if (jobs[i].status == 0)
+			continue;
+		failed++;
+		logger(-1, 0, "CT %d: start failed (exit status %d)",
+				jobs[i].veid, jobs[i].status);
+	}
+	if (p.wait && failed < p.nves)
+		ret = wait_jobs(h, &p, jobs);
+	if (failed) {
+		logger(-1, 0, "Failed to start %d of %d containers",
+				failed, p.nves);
+		ret = VZ_COMMAND_EXECUTION_ERROR;
+	} else if (ret) {
+		ret = VZ_WAIT_FAILED;
+	} else {
+		logger(0, 0, "All %d containers started", p.nves);
+	}
+out:
+	vz_close(h);
+	if (jobs != NULL)
+		for (i = 0; i < p.nves; i++)
+			free(jobs[i].root);
+	free(jobs);
+	free(p.ves);
+
+	return ret;
+}
@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <limits.h>
+#include <fcntl.h>
 
 #include "vzctl.h"
 #include "vzctl_param.h"
@@ -44,6 +45,7 @@
 #include "io.h"
 #include "image.h"
 #include "cpt.h"
+#include "cptstream.h"
 #include "snapshot.h"
 #include "cleanup.h"
 
@@ -363,6 +365,8 @@ static int start(vps_handler *h, envid_t veid, vps_param *g_p,
 		skip |= SKIP_FSCK;
 	if (cmd_p->opt.skip_remount == YES)
 		skip |= SKIP_REMOUNT;
+	if (cmd_p->opt.skip_wait == YES)
+		skip |= SKIP_WAIT;
 	/* Try restore first */
 	ret = try_restore(h, veid, g_p, cmd_p, skip);
 	if (ret == 0)
@@ -570,6 +574,36 @@ static int compact(vps_handler *h, envid_t veid, vps_param *g_p,
 }
 #endif /* HAVE_PLOOP */
 
+/* With --dumpfile -, the dump goes to stdout (comes from stdin).
+ * Take that descriptor for the dump only: stdout is pointed to stderr
+ * so that messages do not get into the dump, stdin to /dev/null so
+ * that scripts do not eat it.
+ */
+static int stdio_dump_fd(cpt_param *cpt, int fd)
+{
+	int nullfd;
+
+	if (isatty(fd)) {
+		logger(-1, 0, "Refusing to use a terminal for the dump, "
+				"redirect %s", fd == STDOUT_FILENO ?
+				"stdout" : "stdin");
+		return VZ_INVALID_PARAMETER_VALUE;
+	}
+	fflush(stdout);
+	if ((cpt->dumpfd = dup(fd)) < 0) {
+		logger(-1, errno, "Unable to dup dump descriptor");
+		return VZ_SYSTEM_ERROR;
+	}
+	if (fd == STDOUT_FILENO) {
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	} else if ((nullfd = open("/dev/null", O_RDONLY)) >= 0) {
+		dup2(nullfd, STDIN_FILENO);
+		close(nullfd);
+	}
+
+	return 0;
+}
+
 static int parse_chkpnt_opt(int argc, char **argv, vps_param *vps_p)
 {
 	int c;
@@ -586,6 +620,9 @@ static int parse_chkpnt_opt(int argc, char **argv, vps_param *vps_p)
 	{"flags",	required_argument, NULL, PARAM_CPU_FLAGS},
 	{"context",	required_argument, NULL, PARAM_CPTCONTEXT},
 	{"dumpfile",	required_argument, NULL, PARAM_DUMPFILE},
+	{"compress",	no_argument, NULL, PARAM_COMPRESS},
+	{"dedup",	no_argument, NULL, PARAM_DEDUP},
+	{"pre-dump-iterations", required_argument, NULL, PARAM_PRE_DUMP_ITER},
 	{ NULL, 0, NULL, 0 }
 	};
 
@@ -604,6 +641,21 @@ static int parse_chkpnt_opt(int argc, char **argv, vps_param *vps_p)
 		case PARAM_CPU_FLAGS:
 			cpt->cpu_flags = strtoul(optarg, NULL, 0);
 			break;
+		case PARAM_COMPRESS:
+			cpt->compress = CPT_STREAM_LEVEL;
+			break;
+		case PARAM_DEDUP:
+			cpt->dedup = YES;
+			break;
+		case PARAM_PRE_DUMP_ITER:
+			if (parse_int(optarg, &cpt->pre_dump_iter) ||
+					cpt->pre_dump_iter < 0)
+			{
+				logger(-1, 0, "Invalid value for "
+					"--pre-dump-iterations: %s", optarg);
+				return VZ_INVALID_PARAMETER_VALUE;
+			}
+			break;
 		case PARAM_DUMP:
 			if (cpt->cmd)
 				goto err_syntax;
@@ -638,6 +690,9 @@ static int parse_chkpnt_opt(int argc, char **argv, vps_param *vps_p)
 	/* Do full checkpointing */
 	if (!cpt->cmd)
 		cpt->cmd = CMD_CHKPNT;
+	if (is_stdio_dump(cpt->dumpfile) &&
+			(cpt->cmd == CMD_CHKPNT || cpt->cmd == CMD_DUMP))
+		return stdio_dump_fd(cpt, STDOUT_FILENO);
 	return 0;
 
 err_syntax:
@@ -662,6 +717,7 @@ static int parse_restore_opt(int argc, char **argv, vps_param *vps_p)
 	{"skip_arpdetect", no_argument, NULL, PARAM_SKIPARPDETECT},
 	{"skip-remount", no_argument, NULL, PARAM_SKIP_REMOUNT},
 	{"skip-fsck",	no_argument, NULL, PARAM_SKIP_FSCK},
+	{"lazy",	no_argument, NULL, PARAM_LAZY},
 	{ NULL, 0, NULL, 0 }
 	};
 
@@ -680,6 +736,9 @@ static int parse_restore_opt(int argc, char **argv, vps_param *vps_p)
 		case PARAM_CPU_FLAGS:
 			cpt->cpu_flags = strtoul(optarg, NULL, 0);
 			break;
+		case PARAM_LAZY:
+			cpt->lazy = 1;
+			break;
 		case PARAM_UNDUMP:
 			if (cpt->cmd)
 				goto err_syntax;
@@ -715,6 +774,9 @@ static int parse_restore_opt(int argc, char **argv, vps_param *vps_p)
 	/* Do full restore */
 	if (!cpt->cmd)
 		cpt->cmd = CMD_RESTORE;
+	if (is_stdio_dump(cpt->dumpfile) &&
+			(cpt->cmd == CMD_RESTORE || cpt->cmd == CMD_UNDUMP))
+		return stdio_dump_fd(cpt, STDIN_FILENO);
 	return 0;
 err_syntax:
 	logger(-1, 0, "Invalid syntax: only one sub command may be used");
@@ -1446,6 +1508,32 @@ static int exec(vps_handler *h, act_t action, envid_t veid, const char *root,
 	return ret;
 }
 
+static int exec_agent(vps_handler *h, envid_t veid, vps_param *g_p,
+		const char *cmd)
+{
+	if (!strcmp(cmd, "start")) {
+		if (g_p->opt.exec_agent != YES)
+			logger(0, 0, "Warning: EXEC_AGENT is not enabled "
+				"in the global config, the agent is not used");
+		return vps_exec_agent_start(h, veid, g_p->res.fs.root);
+	}
+	if (!strcmp(cmd, "stop")) {
+		if (vps_exec_agent_stop(veid))
+			logger(0, 0, "Exec agent is not running");
+		else
+			logger(0, 0, "Exec agent stopped");
+		return 0;
+	}
+
+	/* status */
+	if (vps_exec_agent_status(veid)) {
+		printf("Exec agent is running\n");
+		return 0;
+	}
+	printf("Exec agent is not running\n");
+	return VZ_VE_NOT_RUNNING;
+}
+
 static int chkpnt(vps_handler *h, envid_t veid, vps_param *g_p, vps_param *cmd_p)
 {
 	int cmd, ret;
@@ -1453,6 +1541,11 @@ static int chkpnt(vps_handler *h, envid_t veid, vps_param *g_p, vps_param *cmd_p
 	cmd = cmd_p->res.cpt.cmd;
 	merge_vps_param(g_p, cmd_p);
 	cmd_p->res.cpt.dumpdir = g_p->res.cpt.dumpdir;
+	/* DUMP_DEDUP is for dumps kept in DUMPDIR, not for the ones
+	 * written elsewhere to be copied (e.g. by vzmigrate)
+	 */
+	if (cmd_p->res.cpt.dumpfile == NULL)
+		cmd_p->res.cpt.dedup = g_p->res.cpt.dedup;
 	if (cmd == CMD_KILL || cmd == CMD_RESUME) {
 		/* FIXME: CRIU support? */
 		ret = cpt_cmd(h, veid, g_p->res.fs.root,
@@ -1596,6 +1689,16 @@ int parse_action_opt(envid_t veid, act_t action, int argc, char *argv[],
 			ret = VZ_INVALID_PARAMETER_SYNTAX;
 		}
 		break;
+	case ACTION_EXEC_AGENT:
+		if (argc != 2 || (strcmp(argv[1], "start") &&
+				  strcmp(argv[1], "stop") &&
+				  strcmp(argv[1], "status")))
+		{
+			fprintf(stderr, "Invalid syntax: exec-agent command "
+					"must be one of start, stop, status\n");
+			ret = VZ_INVALID_PARAMETER_SYNTAX;
+		}
+		break;
 	case ACTION_CUSTOM:
 		ret = parse_custom_opt(veid, argc, argv, param, name);
 		break;
@@ -1674,6 +1777,7 @@ int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
 		action != ACTION_EXEC3 &&
 		action != ACTION_ENTER &&
 		action != ACTION_CONSOLE &&
+		action != ACTION_EXEC_AGENT &&
 		action != ACTION_STATUS)
 	{
 		if (skiplock != YES) {
@@ -1744,6 +1848,9 @@ int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
 		if (ret && action == ACTION_EXEC)
 			ret = VZ_COMMAND_EXECUTION_ERROR;
 		break;
+	case ACTION_EXEC_AGENT:
+		ret = exec_agent(h, veid, g_p, argv[1]);
+		break;
 	case ACTION_SUSPEND:
 		ret = chkpnt(h, veid, g_p, cmd_p);
 		break;
@@ -1809,6 +1916,12 @@ int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
 	case ACTION_CUSTOM:
 		ret = mod_setup(h, veid, 0, 0, &g_action, g_p);
 		break;
+	case ACTION_EXEC_MANY:
+	case ACTION_START_MANY:
+	case ACTION_STATS:
+	case ACTION_SNAPSHOT_MANY:
+		/* Handled in main(), as it does not take a CTID */
+		break;
 	}
 err:
 	/* Unlock CT in case lock taken */
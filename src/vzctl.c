@@ -33,6 +33,7 @@
 #include "types.h"
 #include "util.h"
 #include "modules.h"
+#include "stats.h"
 
 struct mod_action g_action;
 char *_proc_title;
@@ -44,6 +45,11 @@ int parse_action_opt(envid_t veid, act_t action, int argc, char *argv[],
 	vps_param *param, const char *name);
 int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
 	vps_param *cmd_p, int argc, char **argv, int skiplock);
+int exec_many(vps_param *g_p, int argc, char **argv);
+int start_many(vps_param *g_p, int argc, char **argv, int skiplock);
+#ifdef HAVE_PLOOP
+int snapshot_many(vps_param *g_p, int argc, char **argv, int skiplock);
+#endif
 
 static void version(FILE *fp)
 {
@@ -67,6 +73,8 @@ static void usage(int rc)
 "   [--diskspace <kbytes>] [--diskinodes <NUM> [--private <path>] [--root <path>]\n"
 "   [--local_uid <UID>] [--local_gid <GID>]\n"
 "vzctl start <ctid> [--force] [--wait] [--skip-fsck] [--skip-remount]\n"
+"vzctl start-many --ctids <ctid[,ctid...]> [--jobs <N>]\n"
+"   [--wait [--timeout <seconds>]]\n"
 "vzctl destroy | mount | umount | stop | restart | status <ctid>\n"
 #ifdef HAVE_PLOOP
 "vzctl convert <ctid> [--layout ploop[:mode]]\n"
@@ -79,13 +87,20 @@ static void usage(int rc)
 "vzctl snapshot-mount <ctid> --id <uuid> --target <dir>\n"
 "vzctl snapshot-umount <ctid> --id <uuid>\n"
 "vzctl snapshot-list <ctid> [-H] [-o field[,field...]] [--id <uuid>]\n"
+"vzctl snapshot-many --ctids <ctid[,ctid...]>|all [--id <uuid>]\n"
+"   [--name <name>] [--description <desc>] [--skip-suspend] [--skip-config]\n"
 #endif
 "vzctl quotaon | quotaoff | quotainit <ctid>\n"
 "vzctl console <ctid> [ttyno]\n"
 "vzctl enter <ctid> [--exec <command> [arg ...]]\n"
 "vzctl exec | exec2 <ctid> <command> [arg ...]\n"
+"vzctl exec-many --ctids <ctid[,ctid...]>|all [--jobs <N>]\n"
+"   [--timeout <seconds>] [--collect] -- <command> [arg ...]\n"
+"vzctl exec-agent <ctid> start | stop | status\n"
+"vzctl stats [--reset]\n"
 "vzctl runscript <ctid> <script>\n"
-"vzctl suspend | resume <ctid> [--dumpfile <name>]\n"
+"vzctl suspend | resume <ctid> [--dumpfile <name>|-] [--compress]\n"
+"   [--dedup] [--pre-dump-iterations <N>] [--lazy]\n"
 "vzctl set <ctid> [--save] [--force] [--setmode restart|ignore]\n"
 "   [--ram <bytes>[KMG]] [--swap <bytes>[KMG]]\n"
 "   [--ipadd <addr>] [--ipdel <addr>|all] [--hostname <name>]\n"
@@ -206,6 +221,9 @@ int main(int argc, char *argv[], char *envp[])
 	} else if (!strcmp(argv[1], "start")) {
 		init_modules(&g_action, "set");
 		action = ACTION_START;
+	} else if (!strcmp(argv[1], "start-many")) {
+		init_modules(&g_action, "set");
+		action = ACTION_START_MANY;
 	} else if (!strcmp(argv[1], "stop")) {
 		init_modules(&g_action, "set");
 		action = ACTION_STOP;
@@ -223,6 +241,12 @@ int main(int argc, char *argv[], char *envp[])
 		action = ACTION_EXEC2;
 	} else if (!strcmp(argv[1], "exec")) {
 		action = ACTION_EXEC;
+	} else if (!strcmp(argv[1], "exec-many")) {
+		action = ACTION_EXEC_MANY;
+	} else if (!strcmp(argv[1], "exec-agent")) {
+		action = ACTION_EXEC_AGENT;
+	} else if (!strcmp(argv[1], "stats")) {
+		action = ACTION_STATS;
 	} else if (!strcmp(argv[1], "runscript")) {
 		action = ACTION_RUNSCRIPT;
 	} else if (!strcmp(argv[1], "enter")) {
@@ -266,6 +290,8 @@ int main(int argc, char *argv[], char *envp[])
 		action = ACTION_SNAPSHOT_MOUNT;
 	} else if (!strcmp(argv[1], "snapshot-umount")) {
 		action = ACTION_SNAPSHOT_UMOUNT;
+	} else if (!strcmp(argv[1], "snapshot-many")) {
+		action = ACTION_SNAPSHOT_MANY;
 #endif
 	} else if (!strcmp(argv[1], "--help")) {
 		usage(0);
@@ -278,22 +304,30 @@ int main(int argc, char *argv[], char *envp[])
 			goto error;
 		}
 	}
-	if (argc < 3) {
-		fprintf(stderr, "CT ID missing\n");
-		ret = VZ_INVALID_PARAMETER_VALUE;
-		goto error;
-	}
-	if (parse_int(argv[2], &veid)) {
-		name = strdup(argv[2]);
-		veid = get_veid_by_name(name);
-	}
-	if (veid < 0 || veid > VEID_MAX) {
-		fprintf(stderr, "Bad CT ID %s\n", argv[2]);
-		ret = VZ_INVALID_PARAMETER_VALUE;
-		goto error;
-	}
+	if (action == ACTION_EXEC_MANY || action == ACTION_STATS ||
+			action == ACTION_START_MANY ||
+			action == ACTION_SNAPSHOT_MANY) {
+		/* No CTID argument */
+		veid = 0;
+		argc -= 1; argv += 1;
+	} else {
+		if (argc < 3) {
+			fprintf(stderr, "CT ID missing\n");
+			ret = VZ_INVALID_PARAMETER_VALUE;
+			goto error;
+		}
+		if (parse_int(argv[2], &veid)) {
+			name = strdup(argv[2]);
+			veid = get_veid_by_name(name);
+		}
+		if (veid < 0 || veid > VEID_MAX) {
+			fprintf(stderr, "Bad CT ID %s\n", argv[2]);
+			ret = VZ_INVALID_PARAMETER_VALUE;
+			goto error;
+		}
 
-	argc -= 2; argv += 2;
+		argc -= 2; argv += 2;
+	}
 	/* getopt_long() prints argv[0] when reporting errors */
 	argv[0] = _proc_title;
 
@@ -315,6 +349,33 @@ int main(int argc, char *argv[], char *envp[])
 		verbose = -1;
 	if (verbose_custom)
 		set_log_verbose(verbose);
+	vps_exec_agent_enable(gparam->opt.exec_agent == YES);
+	if (action == ACTION_EXEC_MANY) {
+		ret = exec_many(gparam, argc, argv);
+		goto error;
+	}
+	if (action == ACTION_START_MANY) {
+		ret = start_many(gparam, argc, argv, skiplock);
+		goto error;
+	}
+#ifdef HAVE_PLOOP
+	if (action == ACTION_SNAPSHOT_MANY) {
+		ret = snapshot_many(gparam, argc, argv, skiplock);
+		goto error;
+	}
+#endif
+	if (action == ACTION_STATS) {
+		if (argc == 1) {
+			ret = vz_stats_print();
+		} else if (argc == 2 && !strcmp(argv[1], "--reset")) {
+			ret = vz_stats_reset();
+		} else {
+			fprintf(stderr, "Invalid syntax, "
+					"use: vzctl stats [--reset]\n");
+			ret = VZ_INVALID_PARAMETER_SYNTAX;
+		}
+		goto error;
+	}
 	if ((ret = parse_action_opt(veid, action, argc, argv, cmd_p,
 		action_nm)))
 	{
@@ -67,6 +67,9 @@ static char *default_nm_field_order = "smart_name,numproc,status,ip,hostname";
 static int g_sort_field = 0;
 static int *g_ve_list = NULL;
 static int n_ve_list = 0;
+/* CT resolved from a non-wildcard -N pattern, -1 if none */
+static int name_veid = -1;
+static int name_restr = 0;
 static int sort_rev = 0;
 static int show_hdr = 1;
 static int trim = 1;
@@ -1223,6 +1226,8 @@ static int read_ves_param()
 
 static int check_veid_restr(int veid)
 {
+	if (name_restr && veid != name_veid)
+		return 0;
 	if (g_ve_list == NULL)
 		return 1;
 	return (bsearch(&veid, g_ve_list, n_ve_list,
@@ -1849,6 +1854,11 @@ static int collect()
 	get_run_ve(update);
 	if (!only_stopped_ve && (ret = get_ub()))
 		return ret;
+	/* A name given to -N which is not found is an empty list,
+	 * same as when all CTs are collected and filtered by name
+	 */
+	if (!n_veinfo && name_restr)
+		return 0;
 	/* No CT found, exit with error */
 	if (!n_veinfo) {
 		if (fmt_json)
@@ -2022,6 +2032,13 @@ int main(int argc, char **argv)
 		}
 		qsort(g_ve_list, n_ve_list, sizeof(*g_ve_list), id_sort_fn);
 	}
+	/* A plain name (not a pattern) is looked up in the names
+	 * directory, so only that CT is collected instead of all of them
+	 */
+	if (name_pattern != NULL && strpbrk(name_pattern, "*?[\\") == NULL) {
+		name_restr = 1;
+		name_veid = get_veid_by_name(name_pattern);
+	}
 	init_log(NULL, 0, 0, 0, 0, NULL);
 	if (build_field_order(f_order))
 		return 1;
@@ -0,0 +1,194 @@
+/*
+ *  Copyright (C) 2000-2013, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* vzmigrate-engine: run the data transfer stage of a migration, from
+ * the first private area sync to CT start (resume) on destination.
+ * It is called by vzmigrate, which does the checks and preparations.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "migrate.h"
+#include "logger.h"
+#include "util.h"
+
+const char progname[] = "vzmigrate-engine";
+
+static void usage(int rc)
+{
+	fprintf(rc ? stderr : stdout,
+"Usage: %s [option ...] <host> <ctid>\n"
+"	--transport ssh|local	how to reach destination (default ssh)\n"
+"	--ssh <options>		additional ssh options\n"
+"	--rsync <options>	rsync options\n"
+"	--private <dir>		source private area\n"
+"	--private-remote <dir>	destination private area\n"
+"	--state running|mounted|stopped\n"
+"	--online		live migration\n"
+"	--ploop-dev <dev>	ploop device, for a running ploop CT\n"
+"	--top-delta <file>	top delta, relative to private area\n"
+"	--dumpfile <file>	dump file on destination\n"
+"	--suspend-opts <opts>	additional vzctl chkpnt options\n"
+"	--quota-cmd <cmd>	command to sync 2nd level quota\n"
+"	--vzctl <cmd>		local vzctl command\n"
+"	--vzctl-remote <cmd>	remote vzctl command\n"
+"	--sync-jobs <n>		parallel jobs for the second simfs sync,\n"
+"				0 to rsync everything (default 4)\n"
+"	-t, --times		print phase timings\n"
+"	-v, --verbose		verbose mode\n",
+		progname);
+
+	exit(rc);
+}
+
+int main(int argc, char **argv)
+{
+	struct mig_param p = {
+		.vzctl = "vzctl --skiplock",
+		.vzctl_remote = "vzctl",
+		.state = -1,
+		.sync_jobs = 4,
+	};
+	struct mig_times tm;
+	const char *transport = "ssh", *ssh_opts = NULL;
+	int c, times = 0, ret;
+	static struct option options[] = {
+		{"transport",	required_argument, NULL, 'T'},
+		{"ssh",		required_argument, NULL, 'S'},
+		{"rsync",	required_argument, NULL, 'R'},
+		{"private",	required_argument, NULL, 'P'},
+		{"private-remote", required_argument, NULL, 'Q'},
+		{"state",	required_argument, NULL, 's'},
+		{"online",	no_argument, NULL, 'o'},
+		{"ploop-dev",	required_argument, NULL, 'D'},
+		{"top-delta",	required_argument, NULL, 'd'},
+		{"dumpfile",	required_argument, NULL, 'f'},
+		{"suspend-opts", required_argument, NULL, 'O'},
+		{"quota-cmd",	required_argument, NULL, 'q'},
+		{"vzctl",	required_argument, NULL, 'z'},
+		{"vzctl-remote", required_argument, NULL, 'Z'},
+		{"sync-jobs",	required_argument, NULL, 'j'},
+		{"times",	no_argument, NULL, 't'},
+		{"verbose",	no_argument, NULL, 'v'},
+		{"help",	no_argument, NULL, 'h'},
+		{ NULL, 0, NULL, 0 }
+	};
+
+	init_log(NULL, 0, 1, 0, 0, progname);
+
+	while ((c = getopt_long(argc, argv, "tvh", options, NULL)) != -1) {
+		switch (c) {
+		case 'T':
+			transport = optarg;
+			break;
+		case 'S':
+			ssh_opts = optarg;
+			break;
+		case 'R':
+			p.rsync_opts = optarg;
+			break;
+		case 'P':
+			p.private = optarg;
+			break;
+		case 'Q':
+			p.private_remote = optarg;
+			break;
+		case 's':
+			if (!strcmp(optarg, "running"))
+				p.state = MIG_RUNNING;
+			else if (!strcmp(optarg, "mounted"))
+				p.state = MIG_MOUNTED;
+			else if (!strcmp(optarg, "stopped"))
+				p.state = MIG_STOPPED;
+			else
+				usage(1);
+			break;
+		case 'o':
+			p.online = 1;
+			break;
+		case 'D':
+			p.ploop_dev = optarg;
+			break;
+		case 'd':
+			p.top_delta = optarg;
+			break;
+		case 'f':
+			p.dumpfile_remote = optarg;
+			break;
+		case 'O':
+			p.suspend_opts = optarg;
+			break;
+		case 'q':
+			p.quota_cmd = optarg;
+			break;
+		case 'z':
+			p.vzctl = optarg;
+			break;
+		case 'Z':
+			p.vzctl_remote = optarg;
+			break;
+		case 'j':
+			if (parse_int(optarg, &p.sync_jobs) ||
+					p.sync_jobs < 0 ||
+					p.sync_jobs > MIG_MAX_SYNC_JOBS)
+				usage(1);
+			break;
+		case 't':
+			times = 1;
+			break;
+		case 'v':
+			p.verbose++;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	if (argc - optind != 2)
+		usage(1);
+	if (parse_int(argv[optind + 1], (int *)&p.veid) ||
+			p.private == NULL || p.state < 0 ||
+			(p.online && (p.state != MIG_RUNNING ||
+				      p.dumpfile_remote == NULL)) ||
+			(p.ploop_dev != NULL && p.top_delta == NULL))
+		usage(1);
+	if (p.private_remote == NULL)
+		p.private_remote = p.private;
+	set_log_level(p.verbose);
+	set_log_verbose(p.verbose);
+
+	if (!strcmp(transport, "ssh"))
+		p.t = mig_ssh_transport(argv[optind], ssh_opts);
+	else if (!strcmp(transport, "local"))
+		p.t = mig_local_transport();
+	else
+		usage(1);
+	if (p.t == NULL)
+		return 1;
+
+	ret = vz_migrate(&p, &tm);
+	if (ret == 0 && times)
+		mig_print_times(&tm);
+	p.t->destroy(p.t);
+
+	return ret;
+}
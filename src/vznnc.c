@@ -18,24 +18,48 @@
 
 /* vzncc: VZ Nano NetCat, a trivial tool to either listen or connect to
  * a TCP port at localhost, and run a program with its input and output
- * redirected to the connected socket
+ * redirected to the connected socket.
+ *
+ * With several streams (-n), it opens that many connections, and
+ * carries the program data over all of them in parallel, see mux below.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <getopt.h>
 #include <poll.h>
+#include <signal.h>
+#ifdef HAVE_ZLIB
+#include <pthread.h>
+#include <zlib.h>
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
 #define FAIL 220
 #define SELF "vznnc"
 
+#ifdef HAVE_ZLIB
+#define MAX_STREAMS		16
+#else
+#define MAX_STREAMS		1
+#endif
+
 void usage(void) {
+#ifdef HAVE_ZLIB
+	fprintf(stderr,
+		"Usage: " SELF " {-l|-c} -p PORT [-f FD] [-n STREAMS [-z]] "
+		"CMD [arg ...]\n");
+#else
 	fprintf(stderr,
 		"Usage: " SELF " {-l|-c} -p PORT [-f FD] CMD [arg ...]\n");
+#endif
 
 	exit(1);
 }
@@ -81,17 +105,544 @@ int pollwait(int fd) {
 	return -1;
 }
 
+#ifdef HAVE_ZLIB
+/* Multi-stream mode ("mux").
+ *
+ * Data the program writes are cut into blocks, which are sent in
+ * parallel over all the connections (streams), and put back in order
+ * on the other side before being written to its program. Each block is
+ * checksummed, and optionally compressed, by the thread sending it,
+ * so several streams use several CPUs as well.
+ *
+ * Both directions work the same way, so program feedback (such as the
+ * one of ploop copy receiver) goes back over the same streams.
+ *
+ * Flow control: a receiver only has room for a window of blocks to
+ * put in order, so a sender only sends blocks up to the window ahead
+ * of the last one the other side has written out, and the other side
+ * reports ("credits") written blocks back over the first stream.
+ */
+#define MUX_MAGIC		"VZNNCMUX"
+#define BLOCK_SIZE		(256 * 1024)
+#define WINDOW_PER_STREAM	4
+
+struct hello {
+	char magic[8];
+	uint32_t streams;
+	uint32_t index;
+};
+
+/* Frame types */
+enum {
+	FR_DATA,
+	FR_EOF,		/* no more data */
+	FR_CREDIT,	/* seq: number of blocks written out by peer */
+};
+
+/* Frame flags */
+#define FR_ZLIB			0x1
+
+/* Frame header, in network byte order, followed by clen bytes */
+struct frame {
+	uint32_t type;
+	uint32_t seq;
+	uint32_t len;		/* raw data length */
+	uint32_t clen;		/* data length on the wire */
+	uint32_t crc;		/* crc32 of raw data */
+	uint32_t flags;
+};
+
+struct block {
+	int full;
+	uint32_t type;
+	uint32_t len;
+	char *data;
+};
+
+struct mux;
+
+struct stream {
+	struct mux *m;
+	int fd;
+	pthread_t tx;
+	pthread_t rx;
+	pthread_mutex_t lock;	/* serializes frames being sent */
+};
+
+struct mux {
+	int prog;		/* socket connected to the program */
+	int compress;
+	int n;
+	struct stream s[MAX_STREAMS];
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t window;
+	int err;
+	/* program -> peer */
+	uint32_t next_read;	/* next block to read from program */
+	uint32_t acked;		/* blocks written out by peer */
+	int reading;		/* a thread is reading from program */
+	int tx_done;		/* got EOF from program */
+	/* peer -> program */
+	struct block *rx;	/* window of blocks, by seq % window */
+	uint32_t next_write;	/* next block to write to program */
+	int rx_alive;		/* streams not closed by peer */
+	int prog_gone;		/* program does not read any more */
+};
+
+static void mux_fail(struct mux *m, const char *msg, int err)
+{
+	int i;
+
+	pthread_mutex_lock(&m->lock);
+	if (!m->err) {
+		if (err)
+			fprintf(stderr, SELF ": %s: %s\n", msg, strerror(err));
+		else
+			fprintf(stderr, SELF ": %s\n", msg);
+		m->err = 1;
+		/* Wake up everyone blocked on I/O */
+		for (i = 0; i < m->n; i++)
+			shutdown(m->s[i].fd, SHUT_RDWR);
+		shutdown(m->prog, SHUT_RDWR);
+	}
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+}
+
+/* Returns 0 on success, 1 on EOF before anything is read, -1 on error */
+static int read_all(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, (char *)buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			errno = ECONNRESET;
+			return done ? -1 : 1;
+		}
+		done += n;
+	}
+
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int send_frame(struct stream *s, struct frame *fr, const void *data)
+{
+	struct frame hdr;
+	int ret;
+
+	hdr.type = htonl(fr->type);
+	hdr.seq = htonl(fr->seq);
+	hdr.len = htonl(fr->len);
+	hdr.clen = htonl(fr->clen);
+	hdr.crc = htonl(fr->crc);
+	hdr.flags = htonl(fr->flags);
+
+	pthread_mutex_lock(&s->lock);
+	ret = write_all(s->fd, &hdr, sizeof(hdr));
+	if (ret == 0 && fr->clen > 0)
+		ret = write_all(s->fd, data, fr->clen);
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+/* Read a block from the program and send it, until EOF */
+static void *tx_thread(void *arg)
+{
+	struct stream *s = arg;
+	struct mux *m = s->m;
+	uLongf zlen = compressBound(BLOCK_SIZE);
+	struct frame fr;
+	char *buf, *zbuf = NULL;
+	const char *data;
+	ssize_t len;
+
+	buf = malloc(BLOCK_SIZE);
+	if (m->compress)
+		zbuf = malloc(zlen);
+	if (buf == NULL || (m->compress && zbuf == NULL)) {
+		mux_fail(m, "malloc()", ENOMEM);
+		goto out;
+	}
+	for (;;) {
+		/* One reader at a time, so blocks are read in seq order */
+		pthread_mutex_lock(&m->lock);
+		while (!m->err && !m->tx_done && (m->reading ||
+				m->next_read - m->acked >= m->window))
+			pthread_cond_wait(&m->cond, &m->lock);
+		if (m->err || m->tx_done) {
+			pthread_mutex_unlock(&m->lock);
+			break;
+		}
+		m->reading = 1;
+		fr.seq = m->next_read++;
+		pthread_mutex_unlock(&m->lock);
+
+		do {
+			len = read(m->prog, buf, BLOCK_SIZE);
+		} while (len < 0 && errno == EINTR);
+		/* Program exited leaving some input unread */
+		if (len < 0 && errno == ECONNRESET)
+			len = 0;
+
+		pthread_mutex_lock(&m->lock);
+		m->reading = 0;
+		if (len <= 0)
+			m->tx_done = 1;
+		pthread_cond_broadcast(&m->cond);
+		pthread_mutex_unlock(&m->lock);
+		if (len < 0) {
+			mux_fail(m, "read()", errno);
+			break;
+		}
+
+		fr.type = len ? FR_DATA : FR_EOF;
+		fr.len = fr.clen = len;
+		fr.crc = crc32(0, (Bytef *)buf, len);
+		fr.flags = 0;
+		data = buf;
+		zlen = compressBound(BLOCK_SIZE);
+		if (m->compress && len > 0 &&
+				compress2((Bytef *)zbuf, &zlen, (Bytef *)buf,
+					len, Z_BEST_SPEED) == Z_OK &&
+				zlen < (uLongf)len)
+		{
+			fr.clen = zlen;
+			fr.flags = FR_ZLIB;
+			data = zbuf;
+		}
+		if (send_frame(s, &fr, data)) {
+			mux_fail(m, "send", errno);
+			break;
+		}
+		if (fr.type == FR_EOF)
+			break;
+	}
+out:
+	free(buf);
+	free(zbuf);
+
+	return NULL;
+}
+
+/* Receive blocks and put them in the window, and receive credits */
+static void *rx_thread(void *arg)
+{
+	struct stream *s = arg;
+	struct mux *m = s->m;
+	uLongf zlen = compressBound(BLOCK_SIZE), len;
+	struct frame fr;
+	struct block *b;
+	char *zbuf, *data = NULL;
+	int ret;
+
+	if ((zbuf = malloc(zlen)) == NULL) {
+		mux_fail(m, "malloc()", ENOMEM);
+		goto out;
+	}
+	for (;;) {
+		ret = read_all(s->fd, &fr, sizeof(fr));
+		if (ret == 1)
+			/* Closed by peer, writer checks it got everything */
+			break;
+		if (ret) {
+			mux_fail(m, "recv", errno);
+			break;
+		}
+		fr.type = ntohl(fr.type);
+		fr.seq = ntohl(fr.seq);
+		fr.len = ntohl(fr.len);
+		fr.clen = ntohl(fr.clen);
+		fr.crc = ntohl(fr.crc);
+		fr.flags = ntohl(fr.flags);
+
+		if (fr.type == FR_CREDIT) {
+			pthread_mutex_lock(&m->lock);
+			m->acked = fr.seq;
+			pthread_cond_broadcast(&m->cond);
+			pthread_mutex_unlock(&m->lock);
+			continue;
+		}
+		if (fr.type > FR_EOF || fr.len > BLOCK_SIZE ||
+				fr.clen > zlen ||
+				(!(fr.flags & FR_ZLIB) && fr.clen != fr.len))
+		{
+			mux_fail(m, "protocol error", 0);
+			break;
+		}
+		if ((data = malloc(fr.len ? : 1)) == NULL) {
+			mux_fail(m, "malloc()", ENOMEM);
+			break;
+		}
+		if (read_all(s->fd, fr.flags & FR_ZLIB ? zbuf : data,
+					fr.clen)) {
+			mux_fail(m, "recv", errno);
+			break;
+		}
+		len = fr.len;
+		if ((fr.flags & FR_ZLIB) &&
+				(uncompress((Bytef *)data, &len, (Bytef *)zbuf,
+					    fr.clen) != Z_OK || len != fr.len))
+		{
+			mux_fail(m, "corrupted data", 0);
+			break;
+		}
+		if (crc32(0, (Bytef *)data, fr.len) != fr.crc) {
+			mux_fail(m, "checksum mismatch", 0);
+			break;
+		}
+
+		pthread_mutex_lock(&m->lock);
+		b = &m->rx[fr.seq % m->window];
+		if (fr.seq - m->next_write >= m->window || b->full) {
+			pthread_mutex_unlock(&m->lock);
+			mux_fail(m, "protocol error: window overflow", 0);
+			break;
+		}
+		b->full = 1;
+		b->type = fr.type;
+		b->len = fr.len;
+		b->data = data;
+		data = NULL;
+		pthread_cond_broadcast(&m->cond);
+		pthread_mutex_unlock(&m->lock);
+	}
+out:
+	free(data);
+	free(zbuf);
+	pthread_mutex_lock(&m->lock);
+	m->rx_alive--;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+
+	return NULL;
+}
+
+/* Write blocks to the program in order, and report it to peer */
+static void *writer_thread(void *arg)
+{
+	struct mux *m = arg;
+	struct frame fr = { .type = FR_CREDIT };
+	struct block b, *slot;
+
+	for (;;) {
+		pthread_mutex_lock(&m->lock);
+		slot = &m->rx[m->next_write % m->window];
+		while (!m->err && !slot->full && m->rx_alive > 0)
+			pthread_cond_wait(&m->cond, &m->lock);
+		if (m->err || !slot->full) {
+			pthread_mutex_unlock(&m->lock);
+			mux_fail(m, "connection closed by peer", 0);
+			break;
+		}
+		b = *slot;
+		slot->full = 0;
+		slot->data = NULL;
+		pthread_mutex_unlock(&m->lock);
+
+		if (b.type == FR_EOF) {
+			free(b.data);
+			shutdown(m->prog, SHUT_WR);
+			break;
+		}
+		/* If the program is gone, the rest is thrown away,
+		 * and its exit code tells what happened */
+		if (!m->prog_gone && write_all(m->prog, b.data, b.len)) {
+			if (errno != EPIPE) {
+				free(b.data);
+				mux_fail(m, "write()", errno);
+				break;
+			}
+			m->prog_gone = 1;
+		}
+		free(b.data);
+
+		pthread_mutex_lock(&m->lock);
+		fr.seq = ++m->next_write;
+		pthread_cond_broadcast(&m->cond);
+		pthread_mutex_unlock(&m->lock);
+		if (send_frame(&m->s[0], &fr, NULL)) {
+			mux_fail(m, "send", errno);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* Exchange hello on a connection, and check that the peer
+ * uses the same number of streams.
+ * Returns stream index the peer has, or -1 on error.
+ */
+static int mux_hello(int fd, int n, int index)
+{
+	struct hello h = { .streams = htonl(n), .index = htonl(index) };
+	struct hello peer;
+
+	memcpy(h.magic, MUX_MAGIC, sizeof(h.magic));
+	if (write_all(fd, &h, sizeof(h)) ||
+			read_all(fd, &peer, sizeof(peer))) {
+		fprintf(stderr, SELF ": no hello from peer\n");
+		return -1;
+	}
+	if (memcmp(peer.magic, MUX_MAGIC, sizeof(peer.magic)) ||
+			ntohl(peer.streams) != (uint32_t)n ||
+			ntohl(peer.index) >= (uint32_t)n) {
+		fprintf(stderr, SELF ": peer is not a %d-stream " SELF "\n",
+				n);
+		return -1;
+	}
+
+	return ntohl(peer.index);
+}
+
+/* Run the program, and pass its I/O over the streams until both
+ * it and the peer are done. Returns program exit status, or FAIL.
+ */
+static int run_mux(int *fds, int n, int fd, int compress, char *argv[])
+{
+	struct mux m = {
+		.n = n,
+		.compress = compress,
+		.window = n * WINDOW_PER_STREAM,
+		.rx_alive = n,
+	};
+	int sp[2], i, status;
+	int started_rx = 0, started_tx = 0, writer = 0;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp)) {
+		perror(SELF ": socketpair()");
+		return FAIL;
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror(SELF ": fork()");
+		return FAIL;
+	} else if (pid == 0) {
+		for (i = 0; i < n; i++)
+			close(fds[i]);
+		close(sp[0]);
+		if (fd < 0) {
+			dup2(sp[1], 0);
+			dup2(sp[1], 1);
+		} else if (dup2(sp[1], fd) != fd) {
+			perror(SELF ": dup2()");
+			_exit(FAIL);
+		}
+		if (sp[1] != fd && sp[1] > 1)
+			close(sp[1]);
+		execvp(argv[0], argv);
+		perror(SELF ": execvp()");
+		_exit(127);
+	}
+	close(sp[1]);
+	/* Errors are handled, no need to die */
+	signal(SIGPIPE, SIG_IGN);
+
+	m.prog = sp[0];
+	m.rx = calloc(m.window, sizeof(*m.rx));
+	pthread_mutex_init(&m.lock, NULL);
+	pthread_cond_init(&m.cond, NULL);
+	if (m.rx == NULL)
+		mux_fail(&m, "malloc()", ENOMEM);
+	for (i = 0; i < n; i++) {
+		m.s[i].m = &m;
+		m.s[i].fd = fds[i];
+		pthread_mutex_init(&m.s[i].lock, NULL);
+	}
+
+	for (; !m.err && started_rx < n; started_rx++)
+		if (pthread_create(&m.s[started_rx].rx, NULL, rx_thread,
+					&m.s[started_rx]))
+			mux_fail(&m, "pthread_create()", errno);
+	if (!m.err) {
+		if (pthread_create(&m.writer, NULL, writer_thread, &m))
+			mux_fail(&m, "pthread_create()", errno);
+		else
+			writer = 1;
+	}
+	for (; !m.err && started_tx < n; started_tx++)
+		if (pthread_create(&m.s[started_tx].tx, NULL, tx_thread,
+					&m.s[started_tx]))
+			mux_fail(&m, "pthread_create()", errno);
+	/* A thread that failed to start is not counted */
+	pthread_mutex_lock(&m.lock);
+	m.rx_alive -= n - started_rx;
+	pthread_mutex_unlock(&m.lock);
+
+	for (i = 0; i < started_tx; i++)
+		pthread_join(m.s[i].tx, NULL);
+	if (writer)
+		pthread_join(m.writer, NULL);
+	/* Both directions are done, let the peer know */
+	for (i = 0; i < n; i++)
+		shutdown(fds[i], SHUT_WR);
+	for (i = 0; i < started_rx; i++)
+		pthread_join(m.s[i].rx, NULL);
+
+	close(m.prog);
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+	for (i = 0; i < (int)m.window && m.rx != NULL; i++)
+		free(m.rx[i].data);
+	free(m.rx);
+
+	/* The program might not notice the socket is closed */
+	if (m.err)
+		kill(pid, SIGTERM);
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR) {
+			perror(SELF ": waitpid()");
+			return FAIL;
+		}
+	if (m.err)
+		return FAIL;
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+
+	return FAIL;
+}
+#endif /* HAVE_ZLIB */
+
 int main(int argc, char *argv[])
 {
 	int sockfd, connfd, port = -1;
 	struct sockaddr_in srv_addr = {};
 	int lis = 0, con = 0, fd = -1;
+	int streams = 1, compress = 0, i;
+	int fds[MAX_STREAMS];
 	const int yes = 1;
 
 	while (1) {
 		int c;
 
-		c = getopt(argc, argv, "lcp:f:");
+		c = getopt(argc, argv, "lcp:f:n:z");
 		if (c == -1)
 			break;
 		switch (c) {
@@ -107,6 +658,12 @@ int main(int argc, char *argv[])
 			case 'f':
 				fd = atoi(optarg);
 				break;
+			case 'n':
+				streams = atoi(optarg);
+				break;
+			case 'z':
+				compress++;
+				break;
 			default:
 				usage();
 		}
@@ -127,27 +684,39 @@ int main(int argc, char *argv[])
 		usage();
 	}
 
-	if (argc - optind < 1)
+	if (streams < 1 || streams > MAX_STREAMS) {
+		fprintf(stderr, SELF ": number of streams should be "
+				"1 to %d\n", MAX_STREAMS);
 		usage();
-
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
-		perror(SELF ": socket()");
-		return FAIL;
 	}
 
-	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) {
-		perror(SELF ": setsockopt()");
-		return FAIL;
+#ifndef HAVE_ZLIB
+	if (compress) {
+		fprintf(stderr, SELF ": option -z is not supported "
+				"(built without zlib)\n");
+		usage();
 	}
+#endif
+
+	if (argc - optind < 1)
+		usage();
 
 	srv_addr.sin_family = AF_INET;
 	srv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 	srv_addr.sin_port = htons(port);
 
 	if (lis) { /* listen */
-		struct sockaddr_in cl_addr = {};
-		socklen_t cl_len = sizeof(cl_addr);
+		sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (sockfd < 0) {
+			perror(SELF ": socket()");
+			return FAIL;
+		}
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
+					&yes, sizeof(int))) {
+			perror(SELF ": setsockopt()");
+			return FAIL;
+		}
 
 		if (bind(sockfd, (struct sockaddr *) &srv_addr,
 					sizeof(srv_addr)) < 0) {
@@ -155,30 +724,69 @@ int main(int argc, char *argv[])
 			return FAIL;
 		}
 
-		if (listen(sockfd, 0) < 0) {
+		if (listen(sockfd, streams - 1) < 0) {
 			perror(SELF ": listen()");
 			return FAIL;
 		}
 
-		if (pollwait(sockfd))
-			return FAIL;
+		for (i = 0; i < streams; i++) {
+			struct sockaddr_in cl_addr = {};
+			socklen_t cl_len = sizeof(cl_addr);
 
-		connfd = accept(sockfd, (struct sockaddr *)&cl_addr, &cl_len);
-		if (connfd < 0) {
-			perror(SELF ": accept()");
-			return FAIL;
+			if (pollwait(sockfd))
+				return FAIL;
+
+			connfd = accept(sockfd, (struct sockaddr *)&cl_addr,
+					&cl_len);
+			if (connfd < 0) {
+				perror(SELF ": accept()");
+				return FAIL;
+			}
+			fds[i] = connfd;
 		}
 		close(sockfd);
 		sockfd = -1;
 	}
 	else /* if (con) */ { /* connect */
-		if (connect(sockfd, (struct sockaddr *)&srv_addr,
-					sizeof(srv_addr)) < 0) {
-			perror(SELF ": connect()");
-			return FAIL;
+		for (i = 0; i < streams; i++) {
+			sockfd = socket(AF_INET, SOCK_STREAM, 0);
+			if (sockfd < 0) {
+				perror(SELF ": socket()");
+				return FAIL;
+			}
+			if (connect(sockfd, (struct sockaddr *)&srv_addr,
+						sizeof(srv_addr)) < 0) {
+				perror(SELF ": connect()");
+				return FAIL;
+			}
+			fds[i] = sockfd;
+		}
+	}
+	connfd = fds[0];
+
+#ifdef HAVE_ZLIB
+	if (streams > 1 || compress) {
+		int sorted[MAX_STREAMS], idx;
+
+		/* Streams are accepted in any order, the connecting
+		 * side numbering is used on both sides */
+		for (i = 0; i < streams; i++)
+			sorted[i] = -1;
+		for (i = 0; i < streams; i++) {
+			idx = mux_hello(fds[i], streams, i);
+			if (idx < 0)
+				return FAIL;
+			if (lis && sorted[idx] != -1) {
+				fprintf(stderr, SELF ": duplicate stream %d\n",
+						idx);
+				return FAIL;
+			}
+			sorted[lis ? idx : i] = fds[i];
 		}
-		connfd = sockfd;
+
+		return run_mux(sorted, streams, fd, compress, argv + optind);
 	}
+#endif
 
 	if (fd < 0) {
 		/* redirect stdin/stdout */
@@ -33,6 +33,7 @@ Conflicts: ploop-lib <= 1.12.2-1
 BuildRequires: ploop-devel > 1.12.2-1
 BuildRequires: libxml2-devel >= 2.6.16
 BuildRequires: libcgroup-devel >= 0.37
+BuildRequires: zlib-devel
 # requires for vzmigrate purposes
 Requires: rsync
 Requires: gawk
@@ -85,6 +86,7 @@ rm -rf %{buildroot}
 %{_sbindir}/vzsplit
 %{_sbindir}/vzlist
 %{_sbindir}/vzmemcheck
+%{_sbindir}/vzmigrate-engine
 %{_sbindir}/vzcpucheck
 %{_sbindir}/vznetcfg
 %{_sbindir}/vznetaddbr
@@ -103,6 +105,7 @@ rm -rf %{buildroot}
 %{_netdir}/ifcfg-venet0
 %{_mandir}/man8/vzeventd.8.*
 %{_mandir}/man8/vzmigrate.8.*
+%{_mandir}/man8/vzmigrate-engine.8.*
 %{_mandir}/man8/vzcptcheck.8.*
 %{_mandir}/man8/vzfsync.8.*
 %{_mandir}/man8/vznnc.8.*
@@ -240,6 +243,7 @@ OpenVZ containers control utility core package
 %dir %{_sharedstatedir}/vzctl/veip
 %dir %{_sharedstatedir}/vzctl/vzreboot
 %dir %{_sharedstatedir}/vzctl/vepid
+%dir %{_sharedstatedir}/vzctl/fingerprint
 %dir %{_configdir}
 %dir %{_configdir}/names
 %dir %{_vpsconfdir}